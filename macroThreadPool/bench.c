@@ -0,0 +1,553 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#include "macroThreadPool.h"
+
+/* Microbenchmark suite. For every combination of thread count, ring size,
+ * payload size, and job duration asked for, half the threads produce jobs
+ * as fast as they can while the other half, the pool's workers, run them.
+ * Each run reports its throughput, the time producers spent inside
+ * EnqueueJob, and the time from a job being enqueued to it having run, the
+ * latter two as percentiles. Runs may also be repeated under each of the
+ * pool's idle strategies. Results are one CSV row or one JSON object per
+ * line so that runs can be appended to a file and compared over time.
+ *
+ * The payload size is the size of the pool's element type and so is fixed
+ * at compile time, one pool being generated per size below. Built with
+ * -DMTP_CACHE_LINE=64 the queue is padded to 64 byte lines, which the bench
+ * target of the Makefile builds as well so that the two can be compared */
+
+#define BENCH_MAX_LIST 16
+#define BENCH_MAX_SIDE 64
+
+/* Most end-to-end samples kept per run, past which each worker's slice wraps
+ * round to keep the latest */
+#define BENCH_MAX_SAMPLES (1UL << 22)
+
+struct benchConfig
+{
+	size_t threads;
+	size_t ring;
+	size_t payload;
+	unsigned long work_ns;
+	MTP_IDLE idle;
+	unsigned long jobs;
+};
+
+struct benchResult
+{
+	double seconds;
+	double *submit;
+	unsigned long num_submit;
+	double *e2e;
+	unsigned long num_e2e;
+};
+
+struct benchProducer
+{
+	pthread_t thread;
+	void *pool;
+	double *submit;
+	unsigned long jobs;
+};
+
+/* How long each job spins for in the current run */
+static unsigned long bench_work_ns;
+
+/* End-to-end samples, each worker filling only its own slice of max */
+static double *bench_e2e;
+static unsigned long bench_e2e_max;
+static unsigned long bench_e2e_count[BENCH_MAX_SIDE];
+
+static double benchNow(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (double) now.tv_sec * 1e9 + (double) now.tv_nsec;
+}
+
+/* Spins for the job's duration, then records how long ago it was queued */
+static void benchJobDone(int worker, double queued)
+{
+	const double begin = benchNow();
+	double now = begin;
+
+	while (now - begin < (double) bench_work_ns)
+	{
+		now = benchNow();
+	}
+
+	if ((worker >= 0) && (worker < BENCH_MAX_SIDE))
+	{
+		bench_e2e[(unsigned long) worker * bench_e2e_max
+			+ bench_e2e_count[worker]++ % bench_e2e_max]
+			= benchNow() - queued;
+	}
+}
+
+/* Generates a payload of SIZE bytes, a pool over it, its producer thread, and
+ * benchRun##SIZE which runs one configuration through that pool */
+#define BENCH_PAYLOAD(SIZE)                                                  \
+	                                                                     \
+struct benchJob##SIZE                                                        \
+{                                                                            \
+	double queued;                                                       \
+	char fill[SIZE - sizeof(double)];                                    \
+};                                                                           \
+	                                                                     \
+static void benchFunction##SIZE(struct benchJob##SIZE job);                  \
+	                                                                     \
+MACRO_THREAD_POOL_COMPLETE(bench##SIZE, struct benchJob##SIZE,               \
+	benchFunction##SIZE);                                                \
+	                                                                     \
+static void benchFunction##SIZE(struct benchJob##SIZE job)                   \
+{                                                                            \
+	benchJobDone(bench##SIZE##GetThreadId(), job.queued);                \
+}                                                                            \
+	                                                                     \
+static void* benchProduce##SIZE(void *arg)                                   \
+{                                                                            \
+	struct benchProducer * const self = arg;                             \
+	struct benchJob##SIZE job;                                           \
+	unsigned long i;                                                     \
+	                                                                     \
+	memset(&job, 0, sizeof(job));                                        \
+	                                                                     \
+	for (i = 0; i < self->jobs; i++)                                     \
+	{                                                                    \
+		job.queued = benchNow();                                     \
+		bench##SIZE##EnqueueJob(self->pool, job);                    \
+		self->submit[i] = benchNow() - job.queued;                   \
+	}                                                                    \
+	                                                                     \
+	return NULL;                                                         \
+}                                                                            \
+	                                                                     \
+static MTP_BOOL benchRun##SIZE(const struct benchConfig *cfg,                \
+	struct benchProducer *producers, size_t num_producers,               \
+	size_t num_workers, double *seconds)                                 \
+{                                                                            \
+	struct bench##SIZE##ThreadPool *pool;                                \
+	struct mtpOptions opts = {0};                                        \
+	size_t started = 0;                                                  \
+	double begin;                                                        \
+	size_t i;                                                            \
+	                                                                     \
+	opts.idle = cfg->idle;                                               \
+	                                                                     \
+	if ((pool = bench##SIZE##NewThreadPoolEx(num_workers, cfg->ring,     \
+		&opts)) == NULL)                                             \
+	{                                                                    \
+		return MTP_FALSE;                                            \
+	}                                                                    \
+	                                                                     \
+	begin = benchNow();                                                  \
+	                                                                     \
+	for (i = 0; i < num_producers; i++)                                  \
+	{                                                                    \
+		producers[i].pool = pool;                                    \
+	                                                                     \
+		if (pthread_create(&(producers[i].thread), NULL,             \
+			benchProduce##SIZE, &(producers[i])) != 0)           \
+		{                                                            \
+			break;                                               \
+		}                                                            \
+	                                                                     \
+		started++;                                                   \
+	}                                                                    \
+	                                                                     \
+	for (i = 0; i < started; i++)                                        \
+	{                                                                    \
+		pthread_join(producers[i].thread, NULL);                     \
+	}                                                                    \
+	                                                                     \
+	bench##SIZE##WaitOnIdle(pool);                                       \
+	*seconds = (benchNow() - begin) / 1e9;                               \
+	bench##SIZE##CleanupThreadPool(pool);                                \
+	                                                                     \
+	return (started == num_producers) ? MTP_TRUE : MTP_FALSE;            \
+}                                                                            \
+	                                                                     \
+enum {bench##SIZE##_BENCH_DUMMY = 0}
+
+BENCH_PAYLOAD(16);
+BENCH_PAYLOAD(64);
+BENCH_PAYLOAD(256);
+
+static int benchCompare(const void *a, const void *b)
+{
+	const double x = *((const double *) a);
+	const double y = *((const double *) b);
+
+	return (x < y) ? -1 : (x > y) ? 1 : 0;
+}
+
+/* The p'th fraction, 0 to 1, of 'n' sorted samples */
+static double benchPercentile(const double *sorted, unsigned long n, double p)
+{
+	if (n == 0)
+	{
+		return 0.0;
+	}
+
+	return sorted[(unsigned long) (p * (double) (n - 1) + 0.5)];
+}
+
+/* Runs one configuration, leaving its sorted samples in 'res' for the
+ * caller to free */
+static MTP_BOOL benchRun(const struct benchConfig *cfg,
+	struct benchResult *res)
+{
+	struct benchProducer producers[BENCH_MAX_SIDE];
+	const size_t num_workers = cfg->threads / 2;
+	const size_t num_producers = cfg->threads - num_workers;
+	const unsigned long per = cfg->jobs / num_producers;
+	const unsigned long slice = (per * num_producers
+		< BENCH_MAX_SAMPLES / num_workers) ? per * num_producers + 1
+		: BENCH_MAX_SAMPLES / num_workers;
+	MTP_BOOL ok = MTP_FALSE;
+	size_t i;
+
+	res->seconds = 0.0;
+	res->num_submit = per * num_producers;
+	res->num_e2e = 0;
+	res->submit = calloc(res->num_submit + 1, sizeof(double));
+	res->e2e = calloc(num_workers * slice, sizeof(double));
+
+	if ((res->submit == NULL) || (res->e2e == NULL))
+	{
+		return MTP_FALSE;
+	}
+
+	bench_work_ns = cfg->work_ns;
+	bench_e2e = res->e2e;
+	bench_e2e_max = slice;
+	memset(bench_e2e_count, 0, sizeof(bench_e2e_count));
+
+	for (i = 0; i < num_producers; i++)
+	{
+		producers[i].jobs = per;
+		producers[i].submit = res->submit + i * per;
+	}
+
+	switch (cfg->payload)
+	{
+	case 16:
+		ok = benchRun16(cfg, producers, num_producers, num_workers,
+			&(res->seconds));
+		break;
+	case 64:
+		ok = benchRun64(cfg, producers, num_producers, num_workers,
+			&(res->seconds));
+		break;
+	case 256:
+		ok = benchRun256(cfg, producers, num_producers, num_workers,
+			&(res->seconds));
+		break;
+	}
+
+	/* Gather the workers' slices at the front */
+	for (i = 0; i < num_workers; i++)
+	{
+		const unsigned long n = (bench_e2e_count[i] < slice)
+			? bench_e2e_count[i] : slice;
+
+		memmove(res->e2e + res->num_e2e, res->e2e + i * slice,
+			n * sizeof(double));
+		res->num_e2e += n;
+	}
+
+	qsort(res->submit, res->num_submit, sizeof(double), benchCompare);
+	qsort(res->e2e, res->num_e2e, sizeof(double), benchCompare);
+
+	return ok;
+}
+
+static void benchPrintHeader(void)
+{
+	fputs("cache_line,threads,producers,workers,ring,payload,work_ns,"
+		"idle,jobs,seconds,jobs_per_s,submit_p50_ns,submit_p90_ns,"
+		"submit_p99_ns,submit_p999_ns,submit_max_ns,e2e_p50_ns,"
+		"e2e_p90_ns,e2e_p99_ns,e2e_p999_ns,e2e_max_ns\n", stdout);
+}
+
+static void benchPrint(const struct benchConfig *cfg,
+	const struct benchResult *res, MTP_BOOL json)
+{
+	static const double fracs[] = {0.5, 0.9, 0.99, 0.999, 1.0};
+	static const char * const names[] = {"p50", "p90", "p99", "p999",
+		"max"};
+	const double rate = (res->seconds > 0.0)
+		? (double) res->num_submit / res->seconds : 0.0;
+	size_t i;
+
+	if (json == MTP_TRUE)
+	{
+		fprintf(stdout, "{\"cache_line\": %d, \"threads\": %lu, "
+			"\"producers\": %lu, \"workers\": %lu, \"ring\": %lu, "
+			"\"payload\": %lu, \"work_ns\": %lu, \"idle\": %d, "
+			"\"jobs\": %lu, \"seconds\": %.6f, \"jobs_per_s\": %.0f",
+			MTP_CACHE_LINE, (unsigned long) cfg->threads,
+			(unsigned long) (cfg->threads - cfg->threads / 2),
+			(unsigned long) (cfg->threads / 2),
+			(unsigned long) cfg->ring, (unsigned long) cfg->payload,
+			cfg->work_ns, cfg->idle, res->num_submit, res->seconds,
+			rate);
+
+		for (i = 0; i < sizeof(fracs) / sizeof(fracs[0]); i++)
+		{
+			fprintf(stdout, ", \"submit_%s_ns\": %.0f", names[i],
+				benchPercentile(res->submit, res->num_submit,
+				fracs[i]));
+		}
+
+		for (i = 0; i < sizeof(fracs) / sizeof(fracs[0]); i++)
+		{
+			fprintf(stdout, ", \"e2e_%s_ns\": %.0f", names[i],
+				benchPercentile(res->e2e, res->num_e2e,
+				fracs[i]));
+		}
+
+		fputs("}\n", stdout);
+	}
+	else
+	{
+		fprintf(stdout, "%d,%lu,%lu,%lu,%lu,%lu,%lu,%d,%lu,%.6f,%.0f",
+			MTP_CACHE_LINE, (unsigned long) cfg->threads,
+			(unsigned long) (cfg->threads - cfg->threads / 2),
+			(unsigned long) (cfg->threads / 2),
+			(unsigned long) cfg->ring, (unsigned long) cfg->payload,
+			cfg->work_ns, cfg->idle, res->num_submit, res->seconds,
+			rate);
+
+		for (i = 0; i < sizeof(fracs) / sizeof(fracs[0]); i++)
+		{
+			fprintf(stdout, ",%.0f", benchPercentile(res->submit,
+				res->num_submit, fracs[i]));
+		}
+
+		for (i = 0; i < sizeof(fracs) / sizeof(fracs[0]); i++)
+		{
+			fprintf(stdout, ",%.0f", benchPercentile(res->e2e,
+				res->num_e2e, fracs[i]));
+		}
+
+		fputs("\n", stdout);
+	}
+
+	fflush(stdout);
+}
+
+/* Reads a comma separated list of up to BENCH_MAX_LIST numbers, returning
+ * how many or 0 if it is malformed */
+static size_t benchParseList(const char *str, unsigned long *list)
+{
+	size_t n = 0;
+	char *end;
+
+	while ((n < BENCH_MAX_LIST) && (*str != '\0'))
+	{
+		list[n++] = strtoul(str, &end, 10);
+
+		if ((end == str) || ((*end != ',') && (*end != '\0')))
+		{
+			return 0;
+		}
+
+		str = (*end == ',') ? end + 1 : end;
+	}
+
+	return (*str == '\0') ? n : 0;
+}
+
+static MTP_BOOL benchValid(const unsigned long *threads, size_t num_threads,
+	const unsigned long *payloads, size_t num_payloads,
+	const unsigned long *idles, size_t num_idles)
+{
+	size_t i;
+
+	for (i = 0; i < num_threads; i++)
+	{
+		if ((threads[i] < 2) || (threads[i] > 2 * BENCH_MAX_SIDE))
+		{
+			return MTP_FALSE;
+		}
+	}
+
+	for (i = 0; i < num_payloads; i++)
+	{
+		if ((payloads[i] != 16) && (payloads[i] != 64)
+			&& (payloads[i] != 256))
+		{
+			return MTP_FALSE;
+		}
+	}
+
+	for (i = 0; i < num_idles; i++)
+	{
+		if (idles[i] > MTP_IDLE_PARK)
+		{
+			return MTP_FALSE;
+		}
+	}
+
+	return MTP_TRUE;
+}
+
+static void printHelp(void)
+{
+	fputs("Macro Thread Pool Benchmark Suite:\n\n", stdout);
+	fputs("Usage:\n", stdout);
+	fputs("\t./mtpBench [options]\n", stdout);
+	fputs("\n", stdout);
+	fputs("\t-t LIST : thread counts from 2 to 128, half of them "
+		"producers\n\t          (2,4,8,16,32,64)\n", stdout);
+	fputs("\t-r LIST : ring sizes, the pool's max_jobs (64,1024)\n",
+		stdout);
+	fputs("\t-p LIST : payload sizes of 16, 64, or 256 bytes "
+		"(16,64,256)\n", stdout);
+	fputs("\t-d LIST : job durations in nanoseconds (0,1000,10000)\n",
+		stdout);
+	fputs("\t-i LIST : idle strategies, 0 adaptive, 1 spin, 2 park (0)\n",
+		stdout);
+	fputs("\t-n N    : jobs per run (50000)\n", stdout);
+	fputs("\t-j      : print JSON lines instead of CSV\n", stdout);
+	fputs("\t-H      : leave out the CSV header\n\n", stdout);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long threads[BENCH_MAX_LIST] = {2, 4, 8, 16, 32, 64};
+	unsigned long rings[BENCH_MAX_LIST] = {64, 1024};
+	unsigned long payloads[BENCH_MAX_LIST] = {16, 64, 256};
+	unsigned long durations[BENCH_MAX_LIST] = {0, 1000, 10000};
+	unsigned long idles[BENCH_MAX_LIST] = {MTP_IDLE_ADAPTIVE};
+	size_t num_threads = 6;
+	size_t num_rings = 2;
+	size_t num_payloads = 3;
+	size_t num_durations = 3;
+	size_t num_idles = 1;
+	struct benchConfig cfg = {0};
+	struct benchResult res;
+	MTP_BOOL json = MTP_FALSE;
+	MTP_BOOL header = MTP_TRUE;
+	size_t runs;
+	size_t k;
+	int i;
+
+	cfg.jobs = 50000;
+
+	for (i = 1; i < argc; i++)
+	{
+		const char *val = (i + 1 < argc) ? argv[i + 1] : "";
+		unsigned long *list = NULL;
+		size_t *num = NULL;
+
+		if (strcmp(argv[i], "-j") == 0)
+		{
+			json = MTP_TRUE;
+
+			continue;
+		}
+		else if (strcmp(argv[i], "-H") == 0)
+		{
+			header = MTP_FALSE;
+
+			continue;
+		}
+		else if (strcmp(argv[i], "-n") == 0)
+		{
+			cfg.jobs = strtoul(val, NULL, 10);
+			i++;
+
+			continue;
+		}
+		else if (strcmp(argv[i], "-t") == 0)
+		{
+			list = threads;
+			num = &num_threads;
+		}
+		else if (strcmp(argv[i], "-r") == 0)
+		{
+			list = rings;
+			num = &num_rings;
+		}
+		else if (strcmp(argv[i], "-p") == 0)
+		{
+			list = payloads;
+			num = &num_payloads;
+		}
+		else if (strcmp(argv[i], "-d") == 0)
+		{
+			list = durations;
+			num = &num_durations;
+		}
+		else if (strcmp(argv[i], "-i") == 0)
+		{
+			list = idles;
+			num = &num_idles;
+		}
+
+		if ((num == NULL) || ((*num = benchParseList(val, list)) == 0))
+		{
+			printHelp();
+
+			return 1;
+		}
+
+		i++;
+	}
+
+	if (benchValid(threads, num_threads, payloads, num_payloads, idles,
+		num_idles) == MTP_FALSE)
+	{
+		printHelp();
+
+		return 1;
+	}
+
+	if ((json == MTP_FALSE) && (header == MTP_TRUE))
+	{
+		benchPrintHeader();
+	}
+
+	runs = num_threads * num_rings * num_payloads * num_durations
+		* num_idles;
+
+	/* Every combination, the idle strategy varying fastest */
+	for (k = 0; k < runs; k++)
+	{
+		size_t at = k;
+
+		cfg.idle = (MTP_IDLE) idles[at % num_idles];
+		at /= num_idles;
+		cfg.work_ns = durations[at % num_durations];
+		at /= num_durations;
+		cfg.payload = payloads[at % num_payloads];
+		at /= num_payloads;
+		cfg.ring = rings[at % num_rings];
+		cfg.threads = threads[at / num_rings];
+
+		if (benchRun(&cfg, &res) == MTP_FALSE)
+		{
+			fprintf(stderr, "Failed to run %lu threads\n",
+				(unsigned long) cfg.threads);
+			free(res.submit);
+			free(res.e2e);
+
+			return 1;
+		}
+
+		benchPrint(&cfg, &res, json);
+		free(res.submit);
+		free(res.e2e);
+	}
+
+	return 0;
+}
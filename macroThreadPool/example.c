@@ -1,7 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-#include <unistd.h>
+#include <sched.h>
 
 #include "macroThreadPool.h"
 
@@ -22,7 +22,11 @@ static void workerFunction(struct myArgs args)
 {
 	const int thread_id = fooGetThreadId();
 
-	usleep(rand() % 5);
+	if (rand() % 2 != 0)
+	{
+		sched_yield();
+	}
+
 	fprintf(stdout, "thread: %d, job: %d, str: %s\n", 
 		thread_id, args.id, args.str);
 }
@@ -3,14 +3,264 @@
 #ifndef MACRO_THREAD_POOL_H
 #define MACRO_THREAD_POOL_H
 
-#include <stddef.h>  /* NULL, size_t */
+/* A strict -std=c89 or c99 build declares nothing of POSIX, clock_gettime
+ * and CLOCK_MONOTONIC included, unless asked for. Only takes if this header
+ * comes before every system header, otherwise the clocks fall back below */
+#if defined(__STRICT_ANSI__) && !defined(__APPLE__)                          \
+	&& !defined(_POSIX_C_SOURCE) && !defined(_XOPEN_SOURCE)              \
+	&& !defined(_GNU_SOURCE) && !defined(_DEFAULT_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <stddef.h>  /* NULL, size_t, offsetof */
 #include <limits.h>  /* INT_MAX */
+#include <errno.h>   /* ETIMEDOUT */
+#include <string.h>  /* memset */
+#include <time.h>    /* clock_gettime, struct timespec */
 #include <pthread.h> /* lots, can use a windows wrapper */
+#include <sched.h>   /* sched_yield, and cpu_set_t with affinity */
+#include <unistd.h>  /* sysconf, getpid, and read, write, close, pipe */
+
+#if defined(MACRO_THREAD_POOL_TRACE) || defined(MACRO_THREAD_POOL_AFFINITY)
+#include <stdio.h>   /* FILE, fprintf, and fopen for the topology in /sys */
+#endif
+
+/* Without clock_gettime, as in a strict build that included a system header
+ * first, time comes from gettimeofday on the wall clock and conditions wait
+ * on their default clock. Either way a condition told to wait on the
+ * monotonic clock needs pthread_condattr_setclock, declared from POSIX 2001 */
+#ifdef CLOCK_REALTIME
+#define MTP_REALTIME CLOCK_REALTIME
+#define MTP_CLOCK_NOW(clock, ts) clock_gettime((clock), &(ts))
+#else
+#include <sys/time.h> /* gettimeofday */
+#define MTP_REALTIME 0
+#define MTP_CLOCK_NOW(clock, ts)                                             \
+do                                                                           \
+{                                                                            \
+	struct timeval mtp_tv;                                               \
+	                                                                     \
+	(void) (clock);                                                      \
+	gettimeofday(&mtp_tv, NULL);                                         \
+	(ts).tv_sec  = mtp_tv.tv_sec;                                        \
+	(ts).tv_nsec = (long) mtp_tv.tv_usec * 1000L;                        \
+} while (0)
+#endif
+
+#ifdef CLOCK_MONOTONIC
+#define MTP_MONOTONIC CLOCK_MONOTONIC
+#else
+#define MTP_MONOTONIC MTP_REALTIME
+#endif
+
+#if defined(CLOCK_MONOTONIC) && defined(_POSIX_CLOCK_SELECTION)              \
+	&& (_POSIX_CLOCK_SELECTION > 0) && (!defined(__STRICT_ANSI__)        \
+	|| (defined(_POSIX_C_SOURCE) && (_POSIX_C_SOURCE >= 200112L)))
+#define MTP_HAS_SETCLOCK
+#endif
+
+#ifdef MACRO_THREAD_POOL_COMPLETIONS
+#include <fcntl.h>   /* fcntl, the fallback pipe is made non-blocking */
+#ifdef __linux__
+#include <stdint.h>  /* uint64_t, an eventfd is read and written in these */
+#include <sys/eventfd.h>
+#endif
+#endif
 
 #define MTP_BOOL    int
 #define MTP_TRUE    1
 #define MTP_FALSE   0
 
+#define MTP_SCHEDULE     int
+#define MTP_SCHED_STATIC  0
+#define MTP_SCHED_DYNAMIC 1
+#define MTP_SCHED_GUIDED  2
+
+#define MTP_STAT      signed char
+#define MTP_SUCCESS   (0)
+#define MTP_FULLUP    (1)
+#define MTP_TIMEOUT   (2)
+#define MTP_RANINLINE (3)
+#define MTP_ERRMEM    (-1)
+#define MTP_ERRCYCLE  (-2)
+#define MTP_FAILURE   (-3)
+
+/* What TryEnqueueJob does when the queue is full */
+#define MTP_OVERFLOW             int
+#define MTP_OVERFLOW_REJECT      0
+#define MTP_OVERFLOW_BLOCK       1
+#define MTP_OVERFLOW_CALLER_RUNS 2
+#define MTP_OVERFLOW_GROW        3
+#define MTP_OVERFLOW_TIMEOUT     4
+
+/* What a worker that runs out of jobs does before it parks */
+#define MTP_IDLE          int
+#define MTP_IDLE_ADAPTIVE 0
+#define MTP_IDLE_SPIN     1
+#define MTP_IDLE_PARK     2
+
+/* Settings fixed when a pool is created with NewThreadPoolEx, zero is the
+ * default for every field so a zeroed structure gives what NewThreadPool does.
+ * timeout_ms is how long MTP_OVERFLOW_TIMEOUT waits for room and grow_max the
+ * ring size at which MTP_OVERFLOW_GROW stops growing, 0 for no limit.
+ * max_threads is the most workers the pool can ever have, at least as many as
+ * it starts with. A non-zero scale_depth turns on autoscaling: a worker is
+ * added when more than scale_depth jobs wait beyond one per live worker, and
+ * one is retired when a worker has sat idle for scale_idle_ms, 0 never, as
+ * long as more than min_threads, or one, remain. Under
+ * MACRO_THREAD_POOL_AFFINITY workers are pinned round robin to the CPUs in
+ * cpu_list, written as in /sys e.g. "0-3,8", or with numa set are spread round
+ * robin over the NUMA nodes, pinned to the CPUs of their node, each node also
+ * getting a ring of its own for EnqueueJobOnNode. A non-zero arena_size gives
+ * each worker a scratch arena of that many bytes, see WorkerArena. idle picks
+ * how an idle worker waits, see MTP_SPIN_UNTIL, and spin is the most rounds
+ * it spins for, 0 for MTP_SPIN_DEFAULT */
+struct mtpOptions
+{
+	MTP_OVERFLOW overflow;
+	unsigned long timeout_ms;
+	size_t grow_max;
+	size_t max_threads;
+	size_t min_threads;
+	size_t scale_depth;
+	unsigned long scale_idle_ms;
+	const char *cpu_list;
+	MTP_BOOL numa;
+	size_t arena_size;
+	MTP_IDLE idle;
+	size_t spin;
+};
+
+/* A worker's spin budget in rounds, kept between 'lo' and 'hi' */
+struct mtpSpin
+{
+	size_t budget;
+	size_t lo;
+	size_t hi;
+};
+
+/* A worker's scratch memory, handed out from the front by ArenaAlloc and
+ * wound back after each job to wherever it stood when the job began */
+struct mtpArena
+{
+	char *base;
+	size_t size;
+	size_t used;
+};
+
+/* Arena allocations are aligned as strictly as the most demanding of these */
+union mtpMaxAlign
+{
+	long l;
+	double d;
+	long double ld;
+	void *p;
+	void (*f)(void);
+};
+
+#define MTP_ARENA_ALIGN sizeof(union mtpMaxAlign)
+#define MTP_ROUND_UP(n, to) ((((n) + (to) - 1) / (to)) * (to))
+
+/* A pool's memory is laid out in pieces of whole lines, when MTP_CACHE_LINE
+ * sets one, each aligned for any type, see MTP_CARVE */
+#define MTP_BLOCK_ALIGN ((MTP_CACHE_LINE > MTP_ARENA_ALIGN)                  \
+	? MTP_ROUND_UP(MTP_CACHE_LINE, MTP_ARENA_ALIGN) : MTP_ARENA_ALIGN)
+
+/* Smallest power of two no less than 'n' or 'min', itself a power of two,
+ * stopping at the largest one 'out' can hold */
+#define MTP_POW2_AT_LEAST(out, n, min)                                       \
+do                                                                           \
+{                                                                            \
+	(out) = (min);                                                       \
+	                                                                     \
+	while (((out) < (n)) && (((out) << 1) > (out)))                      \
+	{                                                                    \
+		(out) <<= 1;                                                 \
+	}                                                                    \
+} while (0)
+
+/* Names a timer for CancelTimer, going stale once the timer is done with */
+struct mtpTimer
+{
+	size_t index;
+	unsigned long seq;
+};
+
+/* Histogram bucket i counts times from 2^i up to 2^(i + 1) nanoseconds, the
+ * first also taking anything shorter and the last anything longer */
+#define MTP_STATS_BUCKETS 32
+
+/* What GetStats reports for each worker slot, idle_us being the time spent
+ * waiting for work and steals the jobs taken off another worker's deque */
+struct mtpWorkerStats
+{
+	unsigned long jobs;
+	unsigned long steals;
+	unsigned long idle_us;
+};
+
+/* What GetStats reports for the whole pool, wait_hist being the time jobs
+ * spent queued before a worker started them and run_hist the time they took.
+ * blocked_us is the time producers spent asleep waiting for room, peak_depth
+ * the most jobs ever queued or running at once */
+struct mtpStats
+{
+	unsigned long wait_hist[MTP_STATS_BUCKETS];
+	unsigned long run_hist[MTP_STATS_BUCKETS];
+	unsigned long blocked_us;
+	size_t peak_depth;
+};
+
+/* What PipelineStats reports for each stage, named as generated. capacity is
+ * the size of the stage's ring, queued how many items wait in it and running
+ * how many its workers hold, done counts the items it has finished and stalls
+ * the times an item had to wait for room in its ring. The sink reports its
+ * reorder window as capacity and the items held back there as queued, its
+ * stalls being the Push calls that waited for the window */
+struct mtpStageStats
+{
+	const char *name;
+	size_t threads;
+	size_t capacity;
+	size_t queued;
+	size_t running;
+	unsigned long done;
+	unsigned long stalls;
+};
+
+/* A stage's entry in the list its pipeline keeps for PipelineStats */
+struct mtpPipeStage
+{
+	void *stage;
+	void (*stats)(void *stage, struct mtpStageStats *stats);
+	struct mtpPipeStage *next;
+};
+
+/* What the stages of a pipeline share with its sink. Every item pushed takes
+ * the next sequence number from issued and is counted in retired once the
+ * sink has it, or once a stage drops it through skip, so that at most window
+ * items are in flight, or any number if it is 0 */
+struct mtpPipeline
+{
+	size_t window;
+	size_t issued;
+	size_t retired;
+	size_t waiters;
+	unsigned long stalls;
+	void *sink;
+	void (*skip)(void *sink, size_t seq);
+	struct mtpPipeStage *stages;
+	pthread_cond_t changed;
+	pthread_mutex_t mutex;
+};
+
+/* Stealing workers park and wake through the same announced waiter counts as
+ * the lock-free ring, so the injection queue is always lock-free in that mode */
+#if defined(MACRO_THREAD_POOL_WORK_STEALING)                                 \
+	&& !defined(MACRO_THREAD_POOL_LOCK_FREE)
+#define MACRO_THREAD_POOL_LOCK_FREE
+#endif
+
 #ifdef MACRO_THREAD_POOL_CUSTOM_ALLOC
 #if !defined(MTP_CALLOC) || !defined(MTP_FREE)
 #error "Please define both MTP_{CALLOC,FREE} if using custom allocation"
@@ -21,308 +271,5861 @@
 #define MTP_FREE free
 #endif
 
-#define MTP_ENQUEUE_JOB(type, queue, in)                                     \
+/* Upper bound on the number of jobs a worker takes off the queue at once */
+#ifndef MTP_DEQUEUE_BATCH
+#define MTP_DEQUEUE_BATCH 1
+#elif MTP_DEQUEUE_BATCH < 1
+#error "MTP_DEQUEUE_BATCH must be at least 1"
+#endif
+
+/* Number of job priority levels, and how many times a level holding jobs may
+ * be passed over for more urgent ones before it is served anyway, 0 never */
+#ifndef MTP_PRIORITY_LEVELS
+#define MTP_PRIORITY_LEVELS 1
+#elif MTP_PRIORITY_LEVELS < 1
+#error "MTP_PRIORITY_LEVELS must be at least 1"
+#endif
+
+#ifndef MTP_PRIORITY_AGING
+#define MTP_PRIORITY_AGING 0
+#endif
+
+/* Jobs a group holds for its waiters to take, past which EnqueueJobInGroup
+ * runs a job in the caller */
+#ifndef MTP_GROUP_JOBS
+#define MTP_GROUP_JOBS 32
+#endif
+
+/* Most rounds an idle worker spins for before it yields, unless the pool's
+ * options say otherwise, and the fewest an adaptive budget falls to */
+#ifndef MTP_SPIN_DEFAULT
+#define MTP_SPIN_DEFAULT 4096
+#endif
+
+#ifndef MTP_SPIN_MIN
+#define MTP_SPIN_MIN 16
+#endif
+
+/* Times an idle worker that spun to no avail yields the CPU before parking */
+#ifndef MTP_SPIN_YIELDS
+#define MTP_SPIN_YIELDS 2
+#endif
+
+/* Assumed size of a cache line. The members of the queue that producers,
+ * workers, and waiters each write are kept at least this far apart, so that
+ * one side's writes do not keep pulling the line out from under the other.
+ * Off by default, 1 leaving them all but packed, as what it is worth has not
+ * been measured; set it to the machine's line size, 64 on most, to try it */
+#ifndef MTP_CACHE_LINE
+#define MTP_CACHE_LINE 1
+#endif
+
+/* Takes the next 'count' times 'size' bytes, rounded up to MTP_BLOCK_ALIGN,
+ * from a block being laid out at 'base', just counting them in 'at' when base
+ * is NULL. Should the total overflow 'at' is left at MTP_CARVE_FAIL */
+#define MTP_CARVE_FAIL ((size_t) -1)
+#define MTP_CARVE(base, at, count, size, out)                                \
+do                                                                           \
+{                                                                            \
+	const size_t mtp_max = MTP_CARVE_FAIL / 2;                           \
+	const size_t mtp_n                                                   \
+		= MTP_ROUND_UP((count) * (size), MTP_BLOCK_ALIGN);           \
+	                                                                     \
+	(out) = NULL;                                                        \
+	                                                                     \
+	if (((count) > mtp_max / (size)) || ((at) > mtp_max - mtp_n))        \
+	{                                                                    \
+		(at) = MTP_CARVE_FAIL;                                       \
+	}                                                                    \
+	else                                                                 \
+	{                                                                    \
+		if ((base) != NULL)                                          \
+		{                                                            \
+			(out) = (void *) ((base) + (at));                    \
+		}                                                            \
+		                                                             \
+		(at) += mtp_n;                                               \
+	}                                                                    \
+} while (0)
+
+/* Delayed jobs wait on a wheel of MTP_TIMER_LEVELS levels of MTP_TIMER_SLOTS
+ * slots, a slot of the first level lasting one tick of MTP_TIMER_TICK_MS and
+ * one of each level above a whole turn of the level below. Timers due further
+ * out than the wheel reaches wait in its last slot and are placed again once
+ * it comes round. Timers are allocated MTP_TIMER_CHUNK at a time and kept
+ * until the pool is freed */
+#ifndef MTP_TIMER_TICK_MS
+#define MTP_TIMER_TICK_MS 1
+#elif MTP_TIMER_TICK_MS < 1
+#error "MTP_TIMER_TICK_MS must be at least 1"
+#endif
+
+#define MTP_TIMER_BITS 6
+#define MTP_TIMER_SLOTS (1UL << MTP_TIMER_BITS)
+#define MTP_TIMER_MASK (MTP_TIMER_SLOTS - 1)
+#define MTP_TIMER_LEVELS 4
+#define MTP_TIMER_SPAN (1UL << (MTP_TIMER_BITS * MTP_TIMER_LEVELS))
+#define MTP_TIMER_CHUNK 256
+#define MTP_TIMER_TICKS(ms)                                                  \
+	(((ms) + MTP_TIMER_TICK_MS - 1) / MTP_TIMER_TICK_MS)
+
+/* The timer thread sleeps on the monotonic clock its wheel counts ticks by,
+ * so that setting the wall clock neither delays nor hastens a timer, where
+ * a condition can be told which clock to use */
+#ifdef MTP_HAS_SETCLOCK
+#define MTP_TIMER_CLOCK MTP_MONOTONIC
+#define MTP_CONDATTR_SETCLOCK(attr, clock)                                   \
+	pthread_condattr_setclock((attr), (clock))
+#else
+#define MTP_TIMER_CLOCK MTP_REALTIME
+#define MTP_CONDATTR_SETCLOCK(attr, clock) ((void) (attr))
+#endif
+
+/* A timer is on the wheel while armed and on the timer thread's list of due
+ * ones while its job is being enqueued. The thread moves a due timer on to
+ * submitting without the wheel's lock, and from there to fired, or back to
+ * firing if the queue was full, so that CancelTimer knows whether its job
+ * went in and can claim one that has not */
+#define MTP_TIMER_FREE       0
+#define MTP_TIMER_ARMED      1
+#define MTP_TIMER_FIRING     2
+#define MTP_TIMER_SUBMITTING 3
+#define MTP_TIMER_FIRED      4
+#define MTP_TIMER_CANCELLED  5
+
+/* Even share of 'waiting' jobs between 'share' workers, clamped to [1, max] */
+#define MTP_FAIR_SHARE(waiting, share, max)                                  \
+	(((waiting) / (share) > (max)) ? (max)                               \
+	: ((waiting) / (share) == 0) ? 1 : (waiting) / (share))
+
+/* The in-flight job count, the lock-free ring, and the wakeup bookkeeping are
+ * built on GCC style __atomic builtins, which clang also provides. Any other
+ * compiler must supply equivalents with the same argument order */
+#ifdef MACRO_THREAD_POOL_CUSTOM_ATOMICS
+#if !defined(MTP_ATOMIC_LOAD) || !defined(MTP_ATOMIC_STORE)                  \
+	|| !defined(MTP_ATOMIC_ADD) || !defined(MTP_ATOMIC_SUB)              \
+	|| !defined(MTP_ATOMIC_CAS) || !defined(MTP_ATOMIC_FENCE)            \
+	|| !defined(MTP_RELAXED) || !defined(MTP_ACQUIRE)                    \
+	|| !defined(MTP_RELEASE) || !defined(MTP_SEQ_CST)
+#error "Please define MTP_ATOMIC_{LOAD,STORE,ADD,SUB,CAS,FENCE} and MTP_{RELAXED,ACQUIRE,RELEASE,SEQ_CST} if using custom atomics"
+#endif
+#elif defined(__GNUC__) || defined(__clang__)
+#define MTP_RELAXED __ATOMIC_RELAXED
+#define MTP_ACQUIRE __ATOMIC_ACQUIRE
+#define MTP_RELEASE __ATOMIC_RELEASE
+#define MTP_SEQ_CST __ATOMIC_SEQ_CST
+#define MTP_ATOMIC_LOAD(ptr, order)  __atomic_load_n((ptr), (order))
+#define MTP_ATOMIC_STORE(ptr, val, order)                                    \
+	__atomic_store_n((ptr), (val), (order))
+/* Both return the value held before the operation */
+#define MTP_ATOMIC_ADD(ptr, val, order)                                      \
+	__atomic_fetch_add((ptr), (val), (order))
+#define MTP_ATOMIC_SUB(ptr, val, order)                                      \
+	__atomic_fetch_sub((ptr), (val), (order))
+/* On failure the current value is written back through 'expected' */
+#define MTP_ATOMIC_CAS(ptr, expected, desired)                               \
+	__atomic_compare_exchange_n((ptr), (expected), (desired), 0,         \
+		__ATOMIC_SEQ_CST, __ATOMIC_RELAXED)
+#define MTP_ATOMIC_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#else
+#error "macroThreadPool.h requires __atomic builtins, see MACRO_THREAD_POOL_CUSTOM_ATOMICS"
+#endif
+
+/* One round of a spin, telling the CPU as much where it can be told */
+#ifndef MTP_CPU_RELAX
+#if (defined(__GNUC__) || defined(__clang__))                                \
+	&& (defined(__x86_64__) || defined(__i386__))
+#define MTP_CPU_RELAX() __asm__ __volatile__("pause")
+#elif (defined(__GNUC__) || defined(__clang__)) && defined(__aarch64__)
+#define MTP_CPU_RELAX() __asm__ __volatile__("yield")
+#else
+#define MTP_CPU_RELAX() ((void) 0)
+#endif
+#endif
+
+/* Retries 'attempt', which sets 'ok', for up to the budget of 'spin', a
+ * struct mtpSpin *, in rounds of MTP_CPU_RELAX, then MTP_SPIN_YIELDS times
+ * after yielding the CPU, before the caller parks. A hand-off caught this way
+ * spares the caller a sleep and a wake. The budget calibrates itself: a spin
+ * that pays off keeps it no lower than twice the rounds taken, one only paid
+ * off by a yield doubles it and one that comes to nothing halves it, so that
+ * a pool whose jobs come in bursts spins and one that sits idle soon stops.
+ * A budget with 'lo' at 'hi' stays put, and one with 'hi' at 0 never spins
+ * nor yields */
+#define MTP_SPIN_UNTIL(spin, attempt, ok)                                    \
+do                                                                           \
+{                                                                            \
+	size_t mtp_r;                                                        \
+	size_t mtp_y = 0;                                                    \
+	                                                                     \
+	for (mtp_r = 0; ((ok) == MTP_FALSE) && (mtp_r < (spin)->budget);     \
+		mtp_r++)                                                     \
+	{                                                                    \
+		MTP_CPU_RELAX();                                             \
+		attempt;                                                     \
+	}                                                                    \
+	                                                                     \
+	for (; ((ok) == MTP_FALSE) && ((spin)->hi != 0)                      \
+		&& (mtp_y < MTP_SPIN_YIELDS); mtp_y++)                       \
+	{                                                                    \
+		sched_yield();                                               \
+		attempt;                                                     \
+	}                                                                    \
+	                                                                     \
+	if ((ok) == MTP_FALSE)                                               \
+	{                                                                    \
+		(spin)->budget /= 2;                                         \
+	}                                                                    \
+	else if (mtp_y != 0)                                                 \
+	{                                                                    \
+		(spin)->budget = ((spin)->budget < (spin)->hi / 2)           \
+			? (spin)->budget * 2 + 1 : (spin)->hi;               \
+	}                                                                    \
+	else if ((spin)->budget < mtp_r * 2)                                 \
+	{                                                                    \
+		(spin)->budget = mtp_r * 2;                                  \
+	}                                                                    \
+	                                                                     \
+	if ((spin)->budget < (spin)->lo)                                     \
+	{                                                                    \
+		(spin)->budget = (spin)->lo;                                 \
+	}                                                                    \
+	else if ((spin)->budget > (spin)->hi)                                \
+	{                                                                    \
+		(spin)->budget = (spin)->hi;                                 \
+	}                                                                    \
+} while (0)
+
+/* Bounded multi-producer multi-consumer ring after Dmitry Vyukov. Every slot
+ * carries a sequence number: a slot at position 'pos' is free for writing
+ * when its sequence equals pos and holds a job for reading when it equals
+ * pos + 1. The cursors only ever increase, the slot index is pos & jobs_mask
+ * with jobs_max a power of two. Neither macro blocks, 'ok' reports whether a
+ * job was moved. These work on any structure with jobs, seqs, jobs_max,
+ * jobs_mask, write_curs, and read_curs members and are used as the job queue
+ * when MACRO_THREAD_POOL_LOCK_FREE is set */
+#define MTP_RING_TRY_PUSH(type, ring, in, ok)                                \
+do                                                                           \
+{                                                                            \
+	size_t mtp_pos                                                       \
+		= MTP_ATOMIC_LOAD(&((ring)->write_curs), MTP_RELAXED);       \
+	                                                                     \
+	(ok) = MTP_FALSE;                                                    \
+	                                                                     \
+	for (;;)                                                             \
+	{                                                                    \
+		size_t * const mtp_seq                                       \
+			= &((ring)->seqs[mtp_pos & (ring)->jobs_mask]);      \
+		const size_t mtp_cur                                         \
+			= MTP_ATOMIC_LOAD(mtp_seq, MTP_ACQUIRE);             \
+		                                                             \
+		if (mtp_cur == mtp_pos)                                      \
+		{                                                            \
+			if (MTP_ATOMIC_CAS(&((ring)->write_curs), &mtp_pos,  \
+				mtp_pos + 1))                                \
+			{                                                    \
+				((type *) (ring)->jobs)                      \
+					[mtp_pos & (ring)->jobs_mask]        \
+					= *((type *) in);                    \
+				MTP_ATOMIC_STORE(mtp_seq, mtp_pos + 1,       \
+					MTP_RELEASE);                        \
+				(ok) = MTP_TRUE;                             \
+				                                             \
+				break;                                       \
+			}                                                    \
+		}                                                            \
+		else if ((ptrdiff_t) (mtp_cur - mtp_pos) < 0)                \
+		{                                                            \
+			break;                                               \
+		}                                                            \
+		else                                                         \
+		{                                                            \
+			mtp_pos = MTP_ATOMIC_LOAD(&((ring)->write_curs),     \
+				MTP_RELAXED);                                \
+		}                                                            \
+	}                                                                    \
+} while (0)
+
+#define MTP_RING_TRY_POP(type, ring, out, ok)                                \
+do                                                                           \
+{                                                                            \
+	size_t mtp_pos                                                       \
+		= MTP_ATOMIC_LOAD(&((ring)->read_curs), MTP_RELAXED);        \
+	                                                                     \
+	(ok) = MTP_FALSE;                                                    \
+	                                                                     \
+	for (;;)                                                             \
+	{                                                                    \
+		size_t * const mtp_seq                                       \
+			= &((ring)->seqs[mtp_pos & (ring)->jobs_mask]);      \
+		const size_t mtp_cur                                         \
+			= MTP_ATOMIC_LOAD(mtp_seq, MTP_ACQUIRE);             \
+		const ptrdiff_t mtp_dif                                      \
+			= (ptrdiff_t) (mtp_cur - (mtp_pos + 1));             \
+		                                                             \
+		if (mtp_dif == 0)                                            \
+		{                                                            \
+			if (MTP_ATOMIC_CAS(&((ring)->read_curs), &mtp_pos,   \
+				mtp_pos + 1))                                \
+			{                                                    \
+				*((type *) out) = ((type *) (ring)->jobs)    \
+					[mtp_pos & (ring)->jobs_mask];       \
+				MTP_ATOMIC_STORE(mtp_seq,                    \
+					mtp_pos + (ring)->jobs_max,          \
+					MTP_RELEASE);                        \
+				(ok) = MTP_TRUE;                             \
+				                                             \
+				break;                                       \
+			}                                                    \
+		}                                                            \
+		else if (mtp_dif < 0)                                        \
+		{                                                            \
+			break;                                               \
+		}                                                            \
+		else                                                         \
+		{                                                            \
+			mtp_pos = MTP_ATOMIC_LOAD(&((ring)->read_curs),      \
+				MTP_RELAXED);                                \
+		}                                                            \
+	}                                                                    \
+} while (0)
+
+/* Batch form of MTP_RING_TRY_POP, claims up to 'want' consecutive jobs with a
+ * single compare and swap and copies them out into the array 'out', with the
+ * number taken reported in 'got' */
+#define MTP_RING_TRY_POP_N(type, ring, out, want, got, ok)                   \
+do                                                                           \
+{                                                                            \
+	size_t mtp_pos = MTP_ATOMIC_LOAD(&((ring)->read_curs), MTP_RELAXED); \
+	size_t mtp_i;                                                        \
+	                                                                     \
+	(ok) = MTP_FALSE;                                                    \
+	                                                                     \
+	for (;;)                                                             \
+	{                                                                    \
+		const ptrdiff_t mtp_dif = (ptrdiff_t) (MTP_ATOMIC_LOAD(      \
+			&((ring)->seqs[mtp_pos & (ring)->jobs_mask]),        \
+			MTP_ACQUIRE) - (mtp_pos + 1));                       \
+		                                                             \
+		if (mtp_dif < 0)                                             \
+		{                                                            \
+			break;                                               \
+		}                                                            \
+		else if (mtp_dif > 0)                                        \
+		{                                                            \
+			mtp_pos = MTP_ATOMIC_LOAD(&((ring)->read_curs),      \
+				MTP_RELAXED);                                \
+			                                                     \
+			continue;                                            \
+		}                                                            \
+		                                                             \
+		for ((got) = 1; (got) < (want); (got)++)                     \
+		{                                                            \
+			if (MTP_ATOMIC_LOAD(&((ring)->seqs[(mtp_pos + (got)) \
+				& (ring)->jobs_mask]), MTP_ACQUIRE)          \
+				!= mtp_pos + (got) + 1)                      \
+			{                                                    \
+				break;                                       \
+			}                                                    \
+		}                                                            \
+		                                                             \
+		if (MTP_ATOMIC_CAS(&((ring)->read_curs), &mtp_pos,           \
+			mtp_pos + (got)))                                    \
+		{                                                            \
+			for (mtp_i = 0; mtp_i < (got); mtp_i++)              \
+			{                                                    \
+				const size_t mtp_at = (mtp_pos + mtp_i)      \
+					& (ring)->jobs_mask;                 \
+				                                             \
+				((type *) (out))[mtp_i]                      \
+					= ((type *) (ring)->jobs)[mtp_at];   \
+				MTP_ATOMIC_STORE(&((ring)->seqs[mtp_at]),    \
+					mtp_pos + mtp_i + (ring)->jobs_max,  \
+					MTP_RELEASE);                        \
+			}                                                    \
+			                                                     \
+			(ok) = MTP_TRUE;                                     \
+			                                                     \
+			break;                                               \
+		}                                                            \
+	}                                                                    \
+} while (0)
+
+/* Wakes sleepers on 'cond' only if some thread has announced itself in the
+ * 'waiters' counter. A sleeper bumps the counter and re-checks the ring while
+ * holding ring_mutex, the waker publishes first and reads the counter second,
+ * so between the two fences at least one side sees the other */
+#define MTP_WAKE(queue, waiters, cond, wake_fn)                              \
+do                                                                           \
+{                                                                            \
+	MTP_ATOMIC_FENCE();                                                  \
+	                                                                     \
+	if (MTP_ATOMIC_LOAD(&((queue)->waiters), MTP_RELAXED) != 0)          \
+	{                                                                    \
+		pthread_mutex_lock(&((queue)->ring_mutex));                  \
+		wake_fn(&((queue)->cond));                                   \
+		pthread_mutex_unlock(&((queue)->ring_mutex));                \
+	}                                                                    \
+} while (0)
+
+/* As MTP_WAKE but for a batch of 'n' new jobs or slots, signals at most one
+ * sleeper per item. The count is re-read under ring_mutex where every thread
+ * it includes is either asleep on 'cond' or about to be */
+#define MTP_WAKE_SOME(queue, waiters, cond, n)                               \
+do                                                                           \
+{                                                                            \
+	MTP_ATOMIC_FENCE();                                                  \
+	                                                                     \
+	if (MTP_ATOMIC_LOAD(&((queue)->waiters), MTP_RELAXED) != 0)          \
+	{                                                                    \
+		size_t mtp_w;                                                \
+		                                                             \
+		pthread_mutex_lock(&((queue)->ring_mutex));                  \
+		mtp_w = MTP_ATOMIC_LOAD(&((queue)->waiters), MTP_RELAXED);   \
+		mtp_w = (mtp_w < (n)) ? mtp_w : (n);                         \
+		                                                             \
+		while (mtp_w-- > 0)                                          \
+		{                                                            \
+			pthread_cond_signal(&((queue)->cond));               \
+		}                                                            \
+		                                                             \
+		pthread_mutex_unlock(&((queue)->ring_mutex));                \
+	}                                                                    \
+} while (0)
+
+/* Lets a thread about to wait for room run a queued job instead if it is one
+ * of the pool's workers, which may be the very thread that would make room.
+ * MTP_TRUE if it did, with 'lock' released meanwhile, for the caller to look
+ * again, MTP_FALSE for any other thread, 'lock' untouched. 'unqueued' is how
+ * many jobs the caller has counted in jobs_inflight but is yet to queue */
+#define MTP_HELP(queue, lock, unqueued)                                      \
+	((queue)->help((queue), (lock), (unqueued)))
+
+/* Parks on 'cond' until 'attempt' sets 'ok', the attempt is retried after
+ * announcing so that a concurrent MTP_WAKE cannot be missed. Only producers
+ * waiting for room park without a deadline, so the sleep counts as blocked,
+ * and a worker helps rather than parks */
+#define MTP_PARK_UNTIL(queue, waiters, cond, attempt, ok, unqueued)          \
+do                                                                           \
+{                                                                            \
+	attempt;                                                             \
+	                                                                     \
+	while ((ok) == MTP_FALSE)                                            \
+	{                                                                    \
+		if (MTP_HELP(queue, NULL, unqueued) == MTP_TRUE)             \
+		{                                                            \
+			attempt;                                             \
+			                                                     \
+			continue;                                            \
+		}                                                            \
+		                                                             \
+		pthread_mutex_lock(&((queue)->ring_mutex));                  \
+		MTP_ATOMIC_ADD(&((queue)->waiters), 1, MTP_SEQ_CST);         \
+		MTP_ATOMIC_FENCE();                                          \
+		attempt;                                                     \
+		                                                             \
+		if ((ok) == MTP_FALSE)                                       \
+		{                                                            \
+			MTP_STATS_BLOCKED(queue,                             \
+				pthread_cond_wait(&((queue)->cond),          \
+				&((queue)->ring_mutex)));                    \
+		}                                                            \
+		                                                             \
+		MTP_ATOMIC_SUB(&((queue)->waiters), 1, MTP_SEQ_CST);         \
+		pthread_mutex_unlock(&((queue)->ring_mutex));                \
+	}                                                                    \
+} while (0)
+
+/* MTP_PARK_UNTIL that gives up once the absolute time 'deadline' has passed,
+ * leaving 'ok' at MTP_FALSE, a NULL deadline waits as long as it takes. For
+ * the idle workers that use it, spinning first as 'spin' allows, producers
+ * pass a budget of nothing */
+#define MTP_PARK_UNTIL_TIMED(queue, waiters, cond, attempt, ok, deadline,    \
+	spin)                                                                \
+do                                                                           \
+{                                                                            \
+	int mtp_rc = 0;                                                      \
+	                                                                     \
+	attempt;                                                             \
+	                                                                     \
+	if ((ok) == MTP_FALSE)                                               \
+	{                                                                    \
+		MTP_SPIN_UNTIL(spin, attempt, ok);                           \
+	}                                                                    \
+	                                                                     \
+	while (((ok) == MTP_FALSE) && (mtp_rc != ETIMEDOUT))                 \
+	{                                                                    \
+		pthread_mutex_lock(&((queue)->ring_mutex));                  \
+		MTP_ATOMIC_ADD(&((queue)->waiters), 1, MTP_SEQ_CST);         \
+		MTP_ATOMIC_FENCE();                                          \
+		attempt;                                                     \
+		                                                             \
+		if (((ok) == MTP_FALSE) && ((deadline) != NULL))             \
+		{                                                            \
+			mtp_rc = pthread_cond_timedwait(&((queue)->cond),    \
+				&((queue)->ring_mutex), (deadline));         \
+		}                                                            \
+		else if ((ok) == MTP_FALSE)                                  \
+		{                                                            \
+			pthread_cond_wait(&((queue)->cond),                  \
+				&((queue)->ring_mutex));                     \
+		}                                                            \
+		                                                             \
+		MTP_ATOMIC_SUB(&((queue)->waiters), 1, MTP_SEQ_CST);         \
+		pthread_mutex_unlock(&((queue)->ring_mutex));                \
+	}                                                                    \
+} while (0)
+
+/* Absolute time 'ms' milliseconds from now, as pthread_cond_timedwait wants
+ * for a condition on the default clock */
+#define MTP_DEADLINE(ts, ms) MTP_DEADLINE_ON(MTP_REALTIME, ts, ms)
+
+/* MTP_DEADLINE for a condition set to wait on 'clock' */
+#define MTP_DEADLINE_ON(clock, ts, ms)                                       \
+do                                                                           \
+{                                                                            \
+	MTP_CLOCK_NOW((clock), (ts));                                        \
+	(ts).tv_sec  += (time_t) ((ms) / 1000);                              \
+	(ts).tv_nsec += (long) ((ms) % 1000) * 1000000L;                     \
+	                                                                     \
+	if ((ts).tv_nsec >= 1000000000L)                                     \
+	{                                                                    \
+		(ts).tv_sec  += 1;                                           \
+		(ts).tv_nsec -= 1000000000L;                                 \
+	}                                                                    \
+} while (0)
+
+/* Jobs are stamped with the monotonic clock as they are queued whenever
+ * MACRO_THREAD_POOL_STATS or MACRO_THREAD_POOL_TRACE wants to know how long
+ * they waited, and the workers read it once between each job and the next.
+ * With MACRO_THREAD_POOL_STATS each worker also keeps its own counters,
+ * written only by itself so plain relaxed stores do, which GetStats sums.
+ * Without either every one of these expands to nothing and the pool carries
+ * no extra members */
+#if defined(MACRO_THREAD_POOL_STATS) || defined(MACRO_THREAD_POOL_TRACE)
+#define MTP_IF_STAMP(x) x
+#define MTP_STAMP_CLOCK(ts) MTP_CLOCK_NOW(MTP_MONOTONIC, ts)
+#else
+#define MTP_IF_STAMP(x)
+#define MTP_STAMP_CLOCK(ts) ((void) 0)
+#endif
+
+#define MTP_JOB_STAMP(job) MTP_STAMP_CLOCK((job).queued)
+
+#ifdef MACRO_THREAD_POOL_STATS
+
+struct mtpWorkerCounters
+{
+	struct mtpWorkerStats totals;
+	unsigned long wait_hist[MTP_STATS_BUCKETS];
+	unsigned long run_hist[MTP_STATS_BUCKETS];
+};
+
+#define MTP_IF_STATS(x) x
+
+#define MTP_STATS_CLOCK(ts) MTP_STAMP_CLOCK(ts)
+
+/* Unsigned arithmetic keeps this right across a tv_nsec borrow */
+#define MTP_ELAPSED_NS(from, to)                                             \
+	((unsigned long) ((to).tv_sec - (from).tv_sec) * 1000000000UL        \
+	+ (unsigned long) (to).tv_nsec - (unsigned long) (from).tv_nsec)
+
+#define MTP_STATS_BUMP(ptr, n)                                               \
+	MTP_ATOMIC_STORE((ptr), MTP_ATOMIC_LOAD((ptr), MTP_RELAXED) + (n),   \
+		MTP_RELAXED)
+
+#define MTP_STATS_RECORD(hist, ns)                                           \
+do                                                                           \
+{                                                                            \
+	unsigned long mtp_ns = (ns);                                         \
+	size_t mtp_b;                                                        \
+	                                                                     \
+	for (mtp_b = 0; (mtp_ns > 1) && (mtp_b < MTP_STATS_BUCKETS - 1);     \
+		mtp_b++)                                                     \
+	{                                                                    \
+		mtp_ns >>= 1;                                                \
+	}                                                                    \
+	                                                                     \
+	MTP_STATS_BUMP(&((hist)[mtp_b]), 1);                                 \
+} while (0)
+
+#define MTP_STATS_IDLE(worker, from, to)                                     \
+	MTP_STATS_BUMP(&((worker)->counters.totals.idle_us),                 \
+		MTP_ELAPSED_NS(from, to) / 1000)
+
+#define MTP_STATS_STEAL(worker, ok)                                          \
+do                                                                           \
+{                                                                            \
+	if ((ok) == MTP_TRUE)                                                \
+	{                                                                    \
+		MTP_STATS_BUMP(&((worker)->counters.totals.steals), 1);      \
+	}                                                                    \
+} while (0)
+
+/* Records one job run from 'start' to 'end', the end of one job serving as
+ * the start of the next so that back to back jobs cost a clock read each */
+#define MTP_STATS_JOB(worker, job, start, end)                               \
 do                                                                           \
 {                                                                            \
-	pthread_mutex_lock(&((queue)->ring_mutex));                          \
+	MTP_STATS_RECORD((worker)->counters.wait_hist,                       \
+		MTP_ELAPSED_NS((job).queued, start));                        \
+	MTP_STATS_RECORD((worker)->counters.run_hist,                        \
+		MTP_ELAPSED_NS(start, end));                                 \
+	MTP_STATS_BUMP(&((worker)->counters.totals.jobs), 1);                \
+} while (0)
+
+/* Runs 'wait', a sleep on has_room, adding the time it took to blocked_us */
+#define MTP_STATS_BLOCKED(queue, wait)                                       \
+do                                                                           \
+{                                                                            \
+	struct timespec mtp_from;                                            \
+	struct timespec mtp_to;                                              \
+	                                                                     \
+	MTP_STATS_CLOCK(mtp_from);                                           \
+	wait;                                                                \
+	MTP_STATS_CLOCK(mtp_to);                                             \
+	MTP_ATOMIC_ADD(&((queue)->blocked_us),                               \
+		MTP_ELAPSED_NS(mtp_from, mtp_to) / 1000, MTP_RELAXED);       \
+} while (0)
+
+#define MTP_STATS_PEAK(queue, depth)                                         \
+do                                                                           \
+{                                                                            \
+	const size_t mtp_d = (depth);                                        \
+	size_t mtp_p = MTP_ATOMIC_LOAD(&((queue)->peak_depth), MTP_RELAXED); \
+	                                                                     \
+	while ((mtp_p < mtp_d)                                               \
+	&& (!MTP_ATOMIC_CAS(&((queue)->peak_depth), &mtp_p, mtp_d)))         \
+	{                                                                    \
+	}                                                                    \
+} while (0)
+
+/* Fills 'stats' from the queue and the histograms summed over every worker
+ * slot, and each of the first 'n' slots' own counts into 'workers' */
+#define MTP_STATS_READ(pool, stats, workers, n)                              \
+do                                                                           \
+{                                                                            \
+	size_t mtp_i;                                                        \
+	size_t mtp_b;                                                        \
+	                                                                     \
+	(stats)->blocked_us = MTP_ATOMIC_LOAD(&((pool)->queue->blocked_us),  \
+		MTP_RELAXED);                                                \
+	(stats)->peak_depth = MTP_ATOMIC_LOAD(&((pool)->queue->peak_depth),  \
+		MTP_RELAXED);                                                \
+	                                                                     \
+	for (mtp_i = 0; mtp_i < (pool)->max_threads; mtp_i++)                \
+	{                                                                    \
+		const struct mtpWorkerCounters * const mtp_c                 \
+			= &((pool)->workers[mtp_i].counters);                \
+		                                                             \
+		for (mtp_b = 0; mtp_b < MTP_STATS_BUCKETS; mtp_b++)          \
+		{                                                            \
+			(stats)->wait_hist[mtp_b] += MTP_ATOMIC_LOAD(        \
+				&(mtp_c->wait_hist[mtp_b]), MTP_RELAXED);    \
+			(stats)->run_hist[mtp_b] += MTP_ATOMIC_LOAD(         \
+				&(mtp_c->run_hist[mtp_b]), MTP_RELAXED);     \
+		}                                                            \
+		                                                             \
+		if (mtp_i < (n))                                             \
+		{                                                            \
+			(workers)[mtp_i].jobs = MTP_ATOMIC_LOAD(             \
+				&(mtp_c->totals.jobs), MTP_RELAXED);         \
+			(workers)[mtp_i].steals = MTP_ATOMIC_LOAD(           \
+				&(mtp_c->totals.steals), MTP_RELAXED);       \
+			(workers)[mtp_i].idle_us = MTP_ATOMIC_LOAD(          \
+				&(mtp_c->totals.idle_us), MTP_RELAXED);      \
+		}                                                            \
+	}                                                                    \
+} while (0)
+
+#define MTP_STATS_SLOTS(pool) ((pool)->max_threads)
+
+#else
+
+#define MTP_IF_STATS(x)
+#define MTP_STATS_CLOCK(ts)                    ((void) 0)
+#define MTP_STATS_IDLE(worker, from, to)       ((void) 0)
+#define MTP_STATS_STEAL(worker, ok)            ((void) 0)
+#define MTP_STATS_JOB(worker, job, start, end) ((void) 0)
+#define MTP_STATS_BLOCKED(queue, wait)         wait
+#define MTP_STATS_PEAK(queue, depth)           ((void) (depth))
+#define MTP_STATS_SLOTS(pool)                  0
+#define MTP_STATS_READ(pool, stats, workers, n)                              \
+	((void) (pool), (void) (stats), (void) (workers), (void) (n))
+
+#endif /* MACRO_THREAD_POOL_STATS */
+
+/* With MACRO_THREAD_POOL_TRACE every worker slot keeps the last
+ * MTP_TRACE_EVENTS jobs it ran in a ring of its own, overwriting the oldest.
+ * Only the worker writes its ring, publishing each event by moving head on,
+ * so the job path takes no lock and DumpTrace reads the rings as they are */
+#ifdef MACRO_THREAD_POOL_TRACE
+
+#ifndef MTP_TRACE_EVENTS
+#define MTP_TRACE_EVENTS 1024
+#endif
+
+struct mtpTraceEvent
+{
+	struct timespec queued;
+	struct timespec start;
+	struct timespec end;
+	MTP_BOOL task;
+};
+
+struct mtpTraceRing
+{
+	struct mtpTraceEvent events[MTP_TRACE_EVENTS];
+	size_t head;
+};
+
+#define MTP_IF_TRACE(x) x
+
+#define MTP_TRACE_JOB(worker, job, from, to)                                 \
+do                                                                           \
+{                                                                            \
+	struct mtpTraceRing * const mtp_ring = &((worker)->trace);           \
+	const size_t mtp_head                                                \
+		= MTP_ATOMIC_LOAD(&(mtp_ring->head), MTP_RELAXED);           \
+	struct mtpTraceEvent * const mtp_ev                                  \
+		= &(mtp_ring->events[mtp_head % MTP_TRACE_EVENTS]);          \
+	                                                                     \
+	mtp_ev->queued = (job).queued;                                       \
+	mtp_ev->start  = (from);                                             \
+	mtp_ev->end    = (to);                                               \
+	mtp_ev->task   = ((job).task != NULL) ? MTP_TRUE : MTP_FALSE;        \
+	MTP_ATOMIC_STORE(&(mtp_ring->head), mtp_head + 1, MTP_RELEASE);      \
+} while (0)
+
+/* Microseconds from 'epoch' to 'ts' as the trace-event format has them */
+#define MTP_TRACE_US(epoch, ts)                                              \
+	((double) ((ts).tv_sec - (epoch).tv_sec) * 1e6                       \
+	+ (double) ((ts).tv_nsec - (epoch).tv_nsec) / 1e3)
+
+/* Writes every slot's ring to 'out', one complete event per job run and an
+ * async begin and end pair per wait in the queue, on a thread per worker
+ * slot. Each ring is copied before it is written out, and whatever the
+ * worker could have written over meanwhile, including the slot it may be
+ * writing now, is left out. 'stat' is MTP_ERRMEM if the copy cannot be had */
+#define MTP_TRACE_DUMP(pool, name, out, stat)                                \
+do                                                                           \
+{                                                                            \
+	const long mtp_pid = (long) getpid();                                \
+	struct mtpTraceEvent *mtp_copy;                                      \
+	struct mtpTraceEvent *mtp_ev;                                        \
+	unsigned long mtp_id = 0;                                            \
+	size_t mtp_i;                                                        \
+	size_t mtp_k;                                                        \
+	                                                                     \
+	if ((mtp_copy = MTP_CALLOC(MTP_TRACE_EVENTS,                         \
+		sizeof(struct mtpTraceEvent))) == NULL)                      \
+	{                                                                    \
+		(stat) = MTP_ERRMEM;                                         \
+	}                                                                    \
+	else                                                                 \
+	{                                                                    \
+		fprintf((out), "{\"displayTimeUnit\":\"ns\","                \
+			"\"traceEvents\":[");                                \
+	}                                                                    \
+	                                                                     \
+	for (mtp_i = 0; (mtp_copy != NULL) && (mtp_i < (pool)->max_threads); \
+		mtp_i++)                                                     \
+	{                                                                    \
+		struct mtpTraceRing * const mtp_ring                         \
+			= &((pool)->workers[mtp_i].trace);                   \
+		const size_t mtp_head                                        \
+			= MTP_ATOMIC_LOAD(&(mtp_ring->head), MTP_ACQUIRE);   \
+		size_t mtp_lo = (mtp_head > MTP_TRACE_EVENTS)                \
+			? mtp_head - MTP_TRACE_EVENTS : 0;                   \
+		size_t mtp_now;                                              \
+		                                                             \
+		for (mtp_k = mtp_lo; mtp_k < mtp_head; mtp_k++)              \
+		{                                                            \
+			mtp_copy[mtp_k % MTP_TRACE_EVENTS]                   \
+				= mtp_ring->events[mtp_k                     \
+				% MTP_TRACE_EVENTS];                         \
+		}                                                            \
+		                                                             \
+		MTP_ATOMIC_FENCE();                                          \
+		mtp_now = MTP_ATOMIC_LOAD(&(mtp_ring->head), MTP_RELAXED);   \
+		                                                             \
+		if ((mtp_now >= MTP_TRACE_EVENTS)                            \
+		&& (mtp_now - MTP_TRACE_EVENTS + 1 > mtp_lo))                \
+		{                                                            \
+			mtp_lo = mtp_now - MTP_TRACE_EVENTS + 1;             \
+		}                                                            \
+		                                                             \
+		if (mtp_lo < mtp_head)                                       \
+		{                                                            \
+			fprintf((out), "%s\n{\"name\":\"thread_name\","      \
+				"\"ph\":\"M\",\"pid\":%ld,\"tid\":%lu,"      \
+				"\"args\":{\"name\":\"%s worker %lu\"}}",    \
+				(mtp_id != 0) ? "," : "", mtp_pid,           \
+				(unsigned long) mtp_i, (name),               \
+				(unsigned long) mtp_i);                      \
+			mtp_id++;                                            \
+		}                                                            \
+		                                                             \
+		for (mtp_k = mtp_lo; mtp_k < mtp_head; mtp_k++, mtp_id++)    \
+		{                                                            \
+			mtp_ev = &(mtp_copy[mtp_k % MTP_TRACE_EVENTS]);      \
+			fprintf((out), ",\n{\"name\":\"%s\",\"cat\":\"%s\"," \
+				"\"ph\":\"X\",\"pid\":%ld,\"tid\":%lu,"      \
+				"\"ts\":%.3f,\"dur\":%.3f}",                 \
+				(mtp_ev->task == MTP_TRUE) ? "task" : "job", \
+				(name), mtp_pid, (unsigned long) mtp_i,      \
+				MTP_TRACE_US((pool)->epoch, mtp_ev->start),  \
+				MTP_TRACE_US(mtp_ev->start, mtp_ev->end));   \
+			fprintf((out), ",\n{\"name\":\"queued\",\"cat\":"    \
+				"\"%s\",\"ph\":\"b\",\"id\":%lu,"            \
+				"\"pid\":%ld,\"tid\":%lu,\"ts\":%.3f}",      \
+				(name), mtp_id, mtp_pid,                     \
+				(unsigned long) mtp_i,                       \
+				MTP_TRACE_US((pool)->epoch,                  \
+				mtp_ev->queued));                            \
+			fprintf((out), ",\n{\"name\":\"queued\",\"cat\":"    \
+				"\"%s\",\"ph\":\"e\",\"id\":%lu,"            \
+				"\"pid\":%ld,\"tid\":%lu,\"ts\":%.3f}",      \
+				(name), mtp_id, mtp_pid,                     \
+				(unsigned long) mtp_i,                       \
+				MTP_TRACE_US((pool)->epoch, mtp_ev->start)); \
+		}                                                            \
+	}                                                                    \
+	                                                                     \
+	if (mtp_copy != NULL)                                                \
+	{                                                                    \
+		fprintf((out), "\n]}\n");                                    \
+		MTP_FREE(mtp_copy);                                          \
+	}                                                                    \
+} while (0)
+
+/* DumpTrace takes a FILE, so it only exists where <stdio.h> is included */
+#define MTP_TRACE_PROTOTYPES(NAME)                                           \
+MTP_STAT NAME##DumpTrace(struct NAME##ThreadPool *pool, FILE *out);
+
+#define MTP_TRACE_DEFINITIONS(NAME)                                          \
+MTP_STAT NAME##DumpTrace(struct NAME##ThreadPool *pool, FILE *out)           \
+{                                                                            \
+	MTP_STAT stat = MTP_SUCCESS;                                         \
+	                                                                     \
+	MTP_TRACE_DUMP(pool, #NAME, out, stat);                              \
+	                                                                     \
+	return stat;                                                         \
+}
+
+#else
+
+#define MTP_IF_TRACE(x)
+#define MTP_TRACE_JOB(worker, job, from, to) ((void) 0)
+#define MTP_TRACE_PROTOTYPES(NAME)
+#define MTP_TRACE_DEFINITIONS(NAME)
+
+#endif /* MACRO_THREAD_POOL_TRACE */
+
+#ifdef MACRO_THREAD_POOL_AFFINITY
+
+/* cpu_set_t and pthread_attr_setaffinity_np are GNU extensions. Defining
+ * _GNU_SOURCE here would come too late should a system header have been
+ * included first, so that is left to the user, best on the command line */
+#ifndef CPU_SETSIZE
+#error "MACRO_THREAD_POOL_AFFINITY needs _GNU_SOURCE, define it on the command line"
+#endif
+
+#define MTP_CPU_SET cpu_set_t
+
+#define MTP_IS_DIGIT(c) (((c) >= '0') && ((c) <= '9'))
+
+/* Sets the ids in a list such as "0-3,8,10-11", as found in /sys, in 'set'.
+ * The list is read a character at a time from 'next', so a file is parsed
+ * straight from its stream rather than read into a buffer first */
+#define MTP_PARSE_CPU_LIST(next, set)                                        \
+do                                                                           \
+{                                                                            \
+	int mtp_c = (next);                                                  \
+	unsigned long mtp_lo;                                                \
+	unsigned long mtp_hi;                                                \
+	                                                                     \
+	CPU_ZERO(set);                                                       \
+	                                                                     \
+	while (MTP_IS_DIGIT(mtp_c))                                          \
+	{                                                                    \
+		for (mtp_lo = 0; MTP_IS_DIGIT(mtp_c); mtp_c = (next))        \
+		{                                                            \
+			mtp_lo = mtp_lo * 10                                 \
+				+ (unsigned long) (mtp_c - '0');             \
+		}                                                            \
+		                                                             \
+		mtp_hi = mtp_lo;                                             \
+		                                                             \
+		if (mtp_c == '-')                                            \
+		{                                                            \
+			for (mtp_hi = 0, mtp_c = (next);                     \
+				MTP_IS_DIGIT(mtp_c); mtp_c = (next))         \
+			{                                                    \
+				mtp_hi = mtp_hi * 10                         \
+					+ (unsigned long) (mtp_c - '0');     \
+			}                                                    \
+		}                                                            \
+		                                                             \
+		for (; (mtp_lo <= mtp_hi) && (mtp_lo < CPU_SETSIZE);         \
+			mtp_lo++)                                            \
+		{                                                            \
+			CPU_SET(mtp_lo, set);                                \
+		}                                                            \
+		                                                             \
+		if (mtp_c == ',')                                            \
+		{                                                            \
+			mtp_c = (next);                                      \
+		}                                                            \
+	}                                                                    \
+} while (0)
+
+/* Parses the list in the file at 'path' into 'set', 'ok' is MTP_FALSE and
+ * 'set' untouched if it cannot be opened */
+#define MTP_READ_CPU_LIST(path, set, ok)                                     \
+do                                                                           \
+{                                                                            \
+	FILE *mtp_f = fopen((path), "r");                                    \
+	                                                                     \
+	(ok) = (mtp_f != NULL) ? MTP_TRUE : MTP_FALSE;                       \
+	                                                                     \
+	if (mtp_f != NULL)                                                   \
+	{                                                                    \
+		MTP_PARSE_CPU_LIST(getc(mtp_f), set);                        \
+		fclose(mtp_f);                                               \
+	}                                                                    \
+} while (0)
+
+/* Builds the CPU set each worker slot is pinned to, taken round robin, one per
+ * CPU of cpu_list or with numa one per node that /sys lists as online limited
+ * to cpu_list if given, in which case 'num_nodes' is the number of sets */
+#define MTP_LOAD_PLACEMENT(opts, sets, num_sets, num_nodes, ok)              \
+do                                                                           \
+{                                                                            \
+	cpu_set_t mtp_ids;                                                   \
+	cpu_set_t mtp_allow;                                                 \
+	char mtp_path[64];                                                   \
+	unsigned long mtp_id;                                                \
+	size_t mtp_k = 0;                                                    \
+	MTP_BOOL mtp_numa = MTP_FALSE;                                       \
+	MTP_BOOL mtp_read;                                                   \
+	                                                                     \
+	(ok) = MTP_TRUE;                                                     \
+	CPU_ZERO(&mtp_ids);                                                  \
+	CPU_ZERO(&mtp_allow);                                                \
+	                                                                     \
+	if ((opts).cpu_list != NULL)                                         \
+	{                                                                    \
+		const char *mtp_s = (opts).cpu_list;                         \
+		                                                             \
+		MTP_PARSE_CPU_LIST(*mtp_s++, &mtp_allow);                    \
+		mtp_ids = mtp_allow;                                         \
+	}                                                                    \
+	                                                                     \
+	if ((opts).numa == MTP_TRUE)                                         \
+	{                                                                    \
+		MTP_READ_CPU_LIST("/sys/devices/system/node/online",         \
+			&mtp_ids, mtp_numa);                                 \
+	}                                                                    \
+	                                                                     \
+	if (CPU_COUNT(&mtp_ids) != 0)                                        \
+	{                                                                    \
+		(sets) = MTP_CALLOC((size_t) CPU_COUNT(&mtp_ids),            \
+			sizeof(cpu_set_t));                                  \
+		(ok) = ((sets) != NULL) ? MTP_TRUE : MTP_FALSE;              \
+	}                                                                    \
+	                                                                     \
+	for (mtp_id = 0; ((ok) == MTP_TRUE) && (mtp_id < CPU_SETSIZE);       \
+		mtp_id++)                                                    \
+	{                                                                    \
+		if (!CPU_ISSET(mtp_id, &mtp_ids))                            \
+		{                                                            \
+			continue;                                            \
+		}                                                            \
+		                                                             \
+		if (mtp_numa == MTP_FALSE)                                   \
+		{                                                            \
+			CPU_ZERO(&((sets)[mtp_k]));                          \
+			CPU_SET(mtp_id, &((sets)[mtp_k]));                   \
+			mtp_k++;                                             \
+			                                                     \
+			continue;                                            \
+		}                                                            \
+		                                                             \
+		snprintf(mtp_path, sizeof(mtp_path),                         \
+			"/sys/devices/system/node/node%lu/cpulist", mtp_id); \
+		MTP_READ_CPU_LIST(mtp_path, &((sets)[mtp_k]), mtp_read);     \
+		                                                             \
+		if (mtp_read == MTP_TRUE)                                    \
+		{                                                            \
+			if ((opts).cpu_list != NULL)                         \
+			{                                                    \
+				CPU_AND(&((sets)[mtp_k]), &((sets)[mtp_k]),  \
+					&mtp_allow);                         \
+			}                                                    \
+			                                                     \
+			mtp_k++;                                             \
+		}                                                            \
+	}                                                                    \
+	                                                                     \
+	(num_sets)  = mtp_k;                                                 \
+	(num_nodes) = (mtp_numa == MTP_TRUE) ? mtp_k : 0;                    \
+} while (0)
+
+/* A set left empty, as a node outside cpu_list would be, pins nothing */
+#define MTP_SPAWN_PINNED(thread, routine, arg, set, rc)                      \
+do                                                                           \
+{                                                                            \
+	pthread_attr_t mtp_attr;                                             \
+	                                                                     \
+	pthread_attr_init(&mtp_attr);                                        \
+	                                                                     \
+	if (((set) != NULL) && (CPU_COUNT(set) != 0))                        \
+	{                                                                    \
+		pthread_attr_setaffinity_np(&mtp_attr, sizeof(cpu_set_t),    \
+			(set));                                              \
+	}                                                                    \
+	                                                                     \
+	(rc) = pthread_create(&(thread), &mtp_attr, (routine), (arg));       \
+	pthread_attr_destroy(&mtp_attr);                                     \
+} while (0)
+
+#else
+
+#define MTP_CPU_SET char
+#define MTP_LOAD_PLACEMENT(opts, sets, num_sets, num_nodes, ok)              \
+	((ok) = MTP_TRUE)
+#define MTP_SPAWN_PINNED(thread, routine, arg, set, rc)                      \
+	((void) (set), (rc) = pthread_create(&(thread), NULL, (routine), (arg)))
+
+#endif /* MACRO_THREAD_POOL_AFFINITY */
+
+/* With MACRO_THREAD_POOL_COMPLETIONS a pool owns a descriptor, readable
+ * while finished jobs wait to be drained, for an event loop to poll. That is
+ * an eventfd on Linux and the read end of a non-blocking pipe elsewhere, 'fds'
+ * holding the end to read and the end to write, the same for an eventfd. A
+ * signal or clear that cannot go through is of no matter, as a full counter
+ * or pipe is already readable and an empty one is already clear */
+#ifdef MACRO_THREAD_POOL_COMPLETIONS
+
+#ifdef __linux__
+
+#define MTP_NOTIFY_OPEN(fds, ok)                                             \
+do                                                                           \
+{                                                                            \
+	(fds)[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);                   \
+	(fds)[1] = (fds)[0];                                                 \
+	(ok) = ((fds)[0] != -1) ? MTP_TRUE : MTP_FALSE;                      \
+} while (0)
+
+#define MTP_NOTIFY_SIGNAL(fds)                                               \
+do                                                                           \
+{                                                                            \
+	const uint64_t mtp_one = 1;                                          \
+	                                                                     \
+	if (write((fds)[1], &mtp_one, sizeof(mtp_one)) < 0)                  \
+	{                                                                    \
+	}                                                                    \
+} while (0)
+
+#define MTP_NOTIFY_CLEAR(fds)                                                \
+do                                                                           \
+{                                                                            \
+	uint64_t mtp_count;                                                  \
+	                                                                     \
+	if (read((fds)[0], &mtp_count, sizeof(mtp_count)) < 0)               \
+	{                                                                    \
+	}                                                                    \
+} while (0)
+
+#else
+
+#define MTP_NOTIFY_OPEN(fds, ok)                                             \
+do                                                                           \
+{                                                                            \
+	(ok) = MTP_FALSE;                                                    \
+	                                                                     \
+	if (pipe(fds) == 0)                                                  \
+	{                                                                    \
+		(ok) = ((fcntl((fds)[0], F_SETFL, O_NONBLOCK) != -1)         \
+			&& (fcntl((fds)[1], F_SETFL, O_NONBLOCK) != -1)      \
+			&& (fcntl((fds)[0], F_SETFD, FD_CLOEXEC) != -1)      \
+			&& (fcntl((fds)[1], F_SETFD, FD_CLOEXEC) != -1))     \
+			? MTP_TRUE : MTP_FALSE;                              \
+	}                                                                    \
+} while (0)
+
+#define MTP_NOTIFY_SIGNAL(fds)                                               \
+do                                                                           \
+{                                                                            \
+	const char mtp_one = 1;                                              \
+	                                                                     \
+	if (write((fds)[1], &mtp_one, 1) < 0)                                \
+	{                                                                    \
+	}                                                                    \
+} while (0)
+
+#define MTP_NOTIFY_CLEAR(fds)                                                \
+do                                                                           \
+{                                                                            \
+	char mtp_buf[64];                                                    \
+	                                                                     \
+	while (read((fds)[0], mtp_buf, sizeof(mtp_buf))                      \
+		== (ssize_t) sizeof(mtp_buf))                                \
+	{                                                                    \
+	}                                                                    \
+} while (0)
+
+#endif /* __linux__ */
+
+#define MTP_NOTIFY_CLOSE(fds)                                                \
+do                                                                           \
+{                                                                            \
+	if ((fds)[1] != (fds)[0])                                            \
+	{                                                                    \
+		close((fds)[1]);                                             \
+	}                                                                    \
+	                                                                     \
+	if ((fds)[0] != -1)                                                  \
+	{                                                                    \
+		close((fds)[0]);                                             \
+	}                                                                    \
+} while (0)
+
+#else
+
+#define MTP_NOTIFY_OPEN(fds, ok)  ((fds)[0] = (fds)[1] = -1, (ok) = MTP_TRUE)
+#define MTP_NOTIFY_SIGNAL(fds)    ((void) (fds))
+#define MTP_NOTIFY_CLEAR(fds)     ((void) (fds))
+#define MTP_NOTIFY_CLOSE(fds)     ((void) (fds))
+
+#endif /* MACRO_THREAD_POOL_COMPLETIONS */
+
+/* Claims up to 'want' consecutive free slots for a batch of jobs, reporting
+ * the first position in 'pos' and the number claimed in 'got'. The claimed
+ * slots must then be filled and published one by one with MTP_RING_PUBLISH */
+#define MTP_RING_TRY_RESERVE(ring, want, pos, got, ok)                       \
+do                                                                           \
+{                                                                            \
+	(pos) = MTP_ATOMIC_LOAD(&((ring)->write_curs), MTP_RELAXED);         \
+	(ok)  = MTP_FALSE;                                                   \
+	                                                                     \
+	for (;;)                                                             \
+	{                                                                    \
+		const ptrdiff_t mtp_dif = (ptrdiff_t) (MTP_ATOMIC_LOAD(      \
+			&((ring)->seqs[(pos) & (ring)->jobs_mask]),          \
+			MTP_ACQUIRE) - (pos));                               \
+		                                                             \
+		if (mtp_dif < 0)                                             \
+		{                                                            \
+			break;                                               \
+		}                                                            \
+		else if (mtp_dif > 0)                                        \
+		{                                                            \
+			(pos) = MTP_ATOMIC_LOAD(&((ring)->write_curs),       \
+				MTP_RELAXED);                                \
+			                                                     \
+			continue;                                            \
+		}                                                            \
+		                                                             \
+		for ((got) = 1; (got) < (want); (got)++)                     \
+		{                                                            \
+			if (MTP_ATOMIC_LOAD(&((ring)->seqs[((pos) + (got))   \
+				& (ring)->jobs_mask]), MTP_ACQUIRE)          \
+				!= (pos) + (got))                            \
+			{                                                    \
+				break;                                       \
+			}                                                    \
+		}                                                            \
+		                                                             \
+		if (MTP_ATOMIC_CAS(&((ring)->write_curs), &(pos),            \
+			(pos) + (got)))                                      \
+		{                                                            \
+			(ok) = MTP_TRUE;                                     \
+			                                                     \
+			break;                                               \
+		}                                                            \
+	}                                                                    \
+} while (0)
+
+#define MTP_RING_PUBLISH(ring, pos)                                          \
+	MTP_ATOMIC_STORE(&((ring)->seqs[(pos) & (ring)->jobs_mask]),         \
+		(pos) + 1, MTP_RELEASE)
+
+/* Workers come and go under resize_mutex, anywhere else the live count is only
+ * ever a hint and is read without it */
+#define MTP_LIVE_THREADS(pool)                                               \
+	MTP_ATOMIC_LOAD(&((pool)->num_threads), MTP_RELAXED)
+
+/* Every job is counted in jobs_inflight from just before it is queued until
+ * just after it has run, so a pool is idle exactly when the count is zero. A
+ * finished job only takes idle_mutex if it brings the count to zero while a
+ * WaitOnIdle caller is announced, the same handshake as MTP_WAKE. A worker
+ * in a nested WaitOnIdle is instead woken as a helper once the count is down
+ * to the jobs that such waits hold, both sides being sequentially consistent
+ * so that the one or the other sees the change */
+#define MTP_JOBS_QUEUED(queue, n)                                            \
+	MTP_ATOMIC_ADD(&((queue)->jobs_inflight), (n), MTP_SEQ_CST)
+
+#define MTP_JOBS_DONE(queue, n)                                              \
+do                                                                           \
+{                                                                            \
+	if ((n) != 0)                                                        \
+	{                                                                    \
+		const size_t mtp_left = MTP_ATOMIC_SUB(                      \
+			&((queue)->jobs_inflight), (n), MTP_SEQ_CST) - (n);  \
+		                                                             \
+		if (mtp_left == 0)                                           \
+		{                                                            \
+			MTP_ATOMIC_FENCE();                                  \
+			                                                     \
+			if (MTP_ATOMIC_LOAD(&((queue)->idle_waiters),        \
+				MTP_RELAXED) != 0)                           \
+			{                                                    \
+				pthread_mutex_lock(&((queue)->idle_mutex));  \
+				pthread_cond_broadcast(&((queue)->is_idle)); \
+				pthread_mutex_unlock(                        \
+					&((queue)->idle_mutex));             \
+			}                                                    \
+		}                                                            \
+		                                                             \
+		if ((MTP_ATOMIC_LOAD(&((queue)->helpers), MTP_SEQ_CST) != 0) \
+		&& (mtp_left <= MTP_ATOMIC_LOAD(&((queue)->held_waiting),    \
+			MTP_SEQ_CST)))                                       \
+		{                                                            \
+			pthread_mutex_lock(&((queue)->ring_mutex));          \
+			pthread_cond_broadcast(&((queue)->has_jobs));        \
+			pthread_mutex_unlock(&((queue)->ring_mutex));        \
+		}                                                            \
+	}                                                                    \
+} while (0)
+
+/* A worker waiting from inside a job parks on has_jobs with the idle ones,
+ * announced in 'helpers' as well, so that a new job wakes it to run that. Any
+ * other end to such a wait, a graph or future done, wakes them all to look
+ * again */
+#define MTP_WAKE_HELPERS(queue)                                              \
+	MTP_WAKE(queue, helpers, has_jobs, pthread_cond_broadcast)
+
+/* Each priority level has a ring of its own in the queue, level 0 being the
+ * most urgent and the last the one plain EnqueueJob uses. With aging on, a
+ * level that has been passed over MTP_PRIORITY_AGING times while it held jobs
+ * is served ahead of the more urgent ones, once, so that it cannot starve */
+#define MTP_DEFAULT_RING(queue) (&((queue)->rings[MTP_PRIORITY_LEVELS - 1]))
+
+/* Indexes run through the priority levels and then the per-node rings, with
+ * MTP_NO_RING for jobs that came off a deque */
+#define MTP_NO_RING ((size_t) -1)
+#define MTP_RING_AT(queue, i)                                                \
+	(((i) < MTP_PRIORITY_LEVELS) ? &((queue)->rings[i])                  \
+	: &((queue)->nodes[(i) - MTP_PRIORITY_LEVELS]))
+
+/* Ends the stack of ready nodes when checking a DAG for cycles */
+#define MTP_NO_NODE ((size_t) -1)
+
+/* Ends a failed attempt to find work early when 'stop' holds, with no jobs */
+#define MTP_STOP_IF(stop, got, ok)                                           \
+do                                                                           \
+{                                                                            \
+	if (((ok) == MTP_FALSE) && (stop))                                   \
+	{                                                                    \
+		(got) = 0;                                                   \
+		(ok)  = MTP_TRUE;                                            \
+	}                                                                    \
+} while (0)
+
+#if (MTP_PRIORITY_LEVELS > 1) && (MTP_PRIORITY_AGING > 0)
+
+/* Least urgent level below 'lim' that is due, or 'lim' if there is none */
+#define MTP_AGED_LEVEL(queue, lim, level)                                    \
+do                                                                           \
+{                                                                            \
+	size_t mtp_a = (lim);                                                \
+	                                                                     \
+	(level) = (lim);                                                     \
+	                                                                     \
+	while (mtp_a-- > 1)                                                  \
+	{                                                                    \
+		if (MTP_ATOMIC_LOAD(&((queue)->skipped[mtp_a]), MTP_RELAXED) \
+			>= MTP_PRIORITY_AGING)                               \
+		{                                                            \
+			(level) = mtp_a;                                     \
+			                                                     \
+			break;                                               \
+		}                                                            \
+	}                                                                    \
+} while (0)
+
+/* Bookkeeping for jobs just taken from 'level', every less urgent level that
+ * still holds jobs has been passed over once more */
+#define MTP_AGE_LEVELS(queue, level)                                         \
+do                                                                           \
+{                                                                            \
+	size_t mtp_a;                                                        \
+	                                                                     \
+	MTP_ATOMIC_STORE(&((queue)->skipped[level]), 0, MTP_RELAXED);        \
+	                                                                     \
+	for (mtp_a = (level) + 1; mtp_a < MTP_PRIORITY_LEVELS; mtp_a++)      \
+	{                                                                    \
+		if (MTP_ATOMIC_LOAD(&((queue)->rings[mtp_a].jobs_waiting),   \
+			MTP_RELAXED) != 0)                                   \
+		{                                                            \
+			MTP_ATOMIC_ADD(&((queue)->skipped[mtp_a]), 1,        \
+				MTP_RELAXED);                                \
+		}                                                            \
+	}                                                                    \
+} while (0)
+
+#else
+
+#define MTP_AGED_LEVEL(queue, lim, level) ((level) = (lim))
+#define MTP_AGE_LEVELS(queue, level) ((void) (level))
+
+#endif
+
+#ifdef MACRO_THREAD_POOL_LOCK_FREE
+
+/* A ring of one slot cannot tell a full slot from an empty one. Each slot
+ * has a sequence number alongside it */
+#define MTP_RING_MIN 2
+#define MTP_RING_SEQS 1
+
+/* jobs_waiting is bumped before the push so that it never reads lower than
+ * the number of jobs actually sitting in the ring */
+#define MTP_ENQUEUE_JOB(type, queue, ring, in)                               \
+do                                                                           \
+{                                                                            \
+	MTP_BOOL mtp_ok;                                                     \
+	                                                                     \
+	MTP_ATOMIC_ADD(&((ring)->jobs_waiting), 1, MTP_SEQ_CST);             \
+	MTP_PARK_UNTIL(queue, room_waiters, has_room,                        \
+		MTP_RING_TRY_PUSH(type, ring, in, mtp_ok), mtp_ok, 1);       \
+	MTP_WAKE(queue, jobs_waiters, has_jobs, pthread_cond_signal);        \
+} while (0)
+
+/* Non-blocking MTP_ENQUEUE_JOB, 'ok' is MTP_FALSE if the ring was full */
+#define MTP_TRY_ENQUEUE_JOB(type, queue, ring, in, ok)                       \
+do                                                                           \
+{                                                                            \
+	MTP_ATOMIC_ADD(&((ring)->jobs_waiting), 1, MTP_SEQ_CST);             \
+	MTP_RING_TRY_PUSH(type, ring, in, ok);                               \
+	                                                                     \
+	if ((ok) == MTP_TRUE)                                                \
+	{                                                                    \
+		MTP_WAKE(queue, jobs_waiters, has_jobs,                      \
+			pthread_cond_signal);                                \
+	}                                                                    \
+	else                                                                 \
+	{                                                                    \
+		MTP_ATOMIC_SUB(&((ring)->jobs_waiting), 1, MTP_SEQ_CST);     \
+	}                                                                    \
+} while (0)
+
+/* MTP_ENQUEUE_JOB that gives up at 'deadline', 'ok' is MTP_FALSE if it did */
+#define MTP_TIMED_ENQUEUE_JOB(type, queue, ring, in, deadline, ok)           \
+do                                                                           \
+{                                                                            \
+	struct mtpSpin mtp_none = {0, 0, 0};                                 \
+	                                                                     \
+	MTP_ATOMIC_ADD(&((ring)->jobs_waiting), 1, MTP_SEQ_CST);             \
+	MTP_STATS_BLOCKED(queue, MTP_PARK_UNTIL_TIMED(queue, room_waiters,   \
+		has_room, MTP_RING_TRY_PUSH(type, ring, in, ok), ok,         \
+		deadline, &mtp_none));                                       \
+	                                                                     \
+	if ((ok) == MTP_TRUE)                                                \
+	{                                                                    \
+		MTP_WAKE(queue, jobs_waiters, has_jobs,                      \
+			pthread_cond_signal);                                \
+	}                                                                    \
+	else                                                                 \
+	{                                                                    \
+		MTP_ATOMIC_SUB(&((ring)->jobs_waiting), 1, MTP_SEQ_CST);     \
+	}                                                                    \
+} while (0)
+
+/* The ring cannot be swapped for a larger one while lock-free readers may
+ * still be in it, so a pool set to grow waits for room instead */
+#define MTP_GROW_ENQUEUE_JOB(type, queue, ring, in, limit, stat)             \
+do                                                                           \
+{                                                                            \
+	(void) (limit);                                                      \
+	MTP_ENQUEUE_JOB(type, queue, ring, in);                              \
+	(stat) = MTP_SUCCESS;                                                \
+} while (0)
+
+/* Batch form of MTP_ENQUEUE_JOB for an array of 'n' payloads, claims as many
+ * slots as are free at once and only parks when the ring fills part way */
+#define MTP_ENQUEUE_JOBS(type, queue, ring, arr, n, max_wake)                \
+do                                                                           \
+{                                                                            \
+	size_t mtp_done = 0;                                                 \
+	size_t mtp_pos  = 0;                                                 \
+	size_t mtp_got  = 0;                                                 \
+	size_t mtp_i;                                                        \
+	MTP_BOOL mtp_ok;                                                     \
+	                                                                     \
+	(void) (max_wake);                                                   \
+	MTP_ATOMIC_ADD(&((ring)->jobs_waiting), (n), MTP_SEQ_CST);           \
+	                                                                     \
+	while (mtp_done < (n))                                               \
+	{                                                                    \
+		MTP_PARK_UNTIL(queue, room_waiters, has_room,                \
+			MTP_RING_TRY_RESERVE(ring, (n) - mtp_done, mtp_pos,  \
+			mtp_got, mtp_ok), mtp_ok, (n) - mtp_done);           \
+		                                                             \
+		for (mtp_i = 0; mtp_i < mtp_got; mtp_i++)                    \
+		{                                                            \
+			type * const mtp_slot = &(((type *) (ring)->jobs)    \
+				[(mtp_pos + mtp_i) & (ring)->jobs_mask]);    \
+			                                                     \
+			mtp_slot->terminate = MTP_FALSE;                     \
+			mtp_slot->task      = NULL;                          \
+			mtp_slot->payload   = (arr)[mtp_done + mtp_i];       \
+			MTP_JOB_STAMP(*mtp_slot);                            \
+			MTP_RING_PUBLISH(ring, mtp_pos + mtp_i);             \
+		}                                                            \
+		                                                             \
+		mtp_done += mtp_got;                                         \
+		MTP_WAKE_SOME(queue, jobs_waiters, has_jobs, mtp_got);       \
+	}                                                                    \
+} while (0)
+
+/* Bookkeeping for 'n' jobs that have left the ring, must not hold ring_mutex */
+#define MTP_DEQUEUED(queue, ring, n)                                         \
+do                                                                           \
+{                                                                            \
+	MTP_ATOMIC_SUB(&((ring)->jobs_waiting), (n), MTP_SEQ_CST);           \
+	MTP_WAKE_SOME(queue, room_waiters, has_room, n);                     \
+} while (0)
+
+/* Tries the rings of the levels below 'lim' in order, an aged one first, and
+ * takes between one and 'max' jobs from the first that has any, but no more
+ * than an even share of those waiting there between 'share' workers so that
+ * no one worker hoards a ring. 'level' reports the ring, or 'lim' if none */
+#define MTP_POP_LEVELS(type, queue, out, max, share, lim, level, got, ok)    \
+do                                                                           \
+{                                                                            \
+	size_t mtp_aged;                                                     \
+	size_t mtp_try;                                                      \
+	                                                                     \
+	(ok) = MTP_FALSE;                                                    \
+	MTP_AGED_LEVEL(queue, lim, mtp_aged);                                \
+	                                                                     \
+	for (mtp_try = 0; ((ok) == MTP_FALSE) && (mtp_try <= (lim));         \
+		mtp_try++)                                                   \
+	{                                                                    \
+		(level) = (mtp_try == 0) ? mtp_aged : mtp_try - 1;           \
+		                                                             \
+		if ((level) < (lim))                                         \
+		{                                                            \
+			size_t mtp_want = MTP_ATOMIC_LOAD(                   \
+				&((queue)->rings[level].jobs_waiting),       \
+				MTP_RELAXED);                                \
+			                                                     \
+			mtp_want = MTP_FAIR_SHARE(mtp_want, share, max);     \
+			MTP_RING_TRY_POP_N(type, &((queue)->rings[level]),   \
+				out, mtp_want, got, ok);                     \
+		}                                                            \
+	}                                                                    \
+	                                                                     \
+	if ((ok) == MTP_TRUE)                                                \
+	{                                                                    \
+		MTP_AGE_LEVELS(queue, level);                                \
+	}                                                                    \
+	else                                                                 \
+	{                                                                    \
+		(level) = (lim);                                             \
+	}                                                                    \
+} while (0)
+
+/* Tries the per-node rings in turn starting from 'home', the node of the
+ * worker asking, taking an even share as MTP_POP_LEVELS does. 'level' reports
+ * the ring as an index for MTP_RING_AT */
+#define MTP_POP_NODES(type, queue, home, out, max, share, level, got, ok)    \
+do                                                                           \
+{                                                                            \
+	size_t mtp_k;                                                        \
+	                                                                     \
+	for (mtp_k = 0; ((ok) == MTP_FALSE) && (mtp_k < (queue)->num_nodes); \
+		mtp_k++)                                                     \
+	{                                                                    \
+		const size_t mtp_n = ((home) + mtp_k) % (queue)->num_nodes;  \
+		size_t mtp_want = MTP_ATOMIC_LOAD(                           \
+			&((queue)->nodes[mtp_n].jobs_waiting), MTP_RELAXED); \
+		                                                             \
+		mtp_want = MTP_FAIR_SHARE(mtp_want, share, max);             \
+		MTP_RING_TRY_POP_N(type, &((queue)->nodes[mtp_n]), out,      \
+			mtp_want, got, ok);                                  \
+		(level) = MTP_PRIORITY_LEVELS + mtp_n;                       \
+	}                                                                    \
+} while (0)
+
+/* Parks until there are jobs, 'stop' holds, or 'deadline' passes, 'got' is 0
+ * in the latter two cases. The node rings are only tried once every level
+ * has come up empty */
+#define MTP_DEQUEUE_JOBS(type, queue, home, out, max, share, stop, deadline, \
+	spin, got)                                                           \
+do                                                                           \
+{                                                                            \
+	size_t mtp_level;                                                    \
+	MTP_BOOL mtp_ok;                                                     \
+	                                                                     \
+	(got) = 0;                                                           \
+	MTP_PARK_UNTIL_TIMED(queue, jobs_waiters, has_jobs,                  \
+		MTP_POP_LEVELS(type, queue, out, max, share,                 \
+		MTP_PRIORITY_LEVELS, mtp_level, got, mtp_ok);                \
+		MTP_POP_NODES(type, queue, home, out, max, share,            \
+		mtp_level, got, mtp_ok);                                     \
+		MTP_STOP_IF(stop, got, mtp_ok), mtp_ok, deadline, spin);     \
+	                                                                     \
+	if (mtp_ok == MTP_FALSE)                                             \
+	{                                                                    \
+		(got) = 0;                                                   \
+	}                                                                    \
+	                                                                     \
+	if ((got) != 0)                                                      \
+	{                                                                    \
+		MTP_DEQUEUED(queue, MTP_RING_AT(queue, mtp_level), got);     \
+	}                                                                    \
+} while (0)
+
+/* The slot sequence numbers start out equal to their index, marking every
+ * slot free for the first lap of the writer */
+#define MTP_RING_INIT(ring)                                                  \
+do                                                                           \
+{                                                                            \
+	size_t mtp_i;                                                        \
+	                                                                     \
+	for (mtp_i = 0; mtp_i < (ring)->jobs_max; mtp_i++)                   \
+	{                                                                    \
+		(ring)->seqs[mtp_i] = mtp_i;                                 \
+	}                                                                    \
+} while (0)
+
+/* Claims the next free slot of 'ring' for the caller to fill in place,
+ * waiting for room. The slot still reads as free to workers, and holds up
+ * those behind it, until MTP_RING_COMMIT publishes it */
+#define MTP_RING_ACQUIRE(type, queue, ring, out)                             \
+do                                                                           \
+{                                                                            \
+	size_t mtp_pos = 0;                                                  \
+	size_t mtp_got;                                                      \
+	MTP_BOOL mtp_ok;                                                     \
+	                                                                     \
+	MTP_ATOMIC_ADD(&((ring)->jobs_waiting), 1, MTP_SEQ_CST);             \
+	MTP_PARK_UNTIL(queue, room_waiters, has_room,                        \
+		MTP_RING_TRY_RESERVE(ring, 1, mtp_pos, mtp_got, mtp_ok),     \
+		mtp_ok, 1);                                                  \
+	(out) = &(((type *) (ring)->jobs)[mtp_pos & (ring)->jobs_mask]);     \
+} while (0)
+
+/* A claimed slot's sequence still holds its position, which is all that is
+ * needed to publish it */
+#define MTP_RING_COMMIT(type, queue, ring, slot)                             \
+do                                                                           \
+{                                                                            \
+	const size_t mtp_at                                                  \
+		= (size_t) ((type *) (slot) - (type *) (ring)->jobs);        \
+	                                                                     \
+	MTP_RING_PUBLISH(ring,                                               \
+		MTP_ATOMIC_LOAD(&((ring)->seqs[mtp_at]), MTP_RELAXED));      \
+	MTP_WAKE(queue, jobs_waiters, has_jobs, pthread_cond_signal);        \
+} while (0)
+
+#else
+
+#define MTP_RING_MIN 1
+#define MTP_RING_SEQS 0
+
+/* Every level's ring shares the one ring_mutex and pair of conditions */
+
+/* Counts 'n' new jobs in posted, which idle workers spin on without taking
+ * ring_mutex, and signals one parked worker for each, no more than are
+ * parked, where every enqueue once woke them all. Holds ring_mutex */
+#define MTP_JOBS_POSTED(queue, n)                                            \
+do                                                                           \
+{                                                                            \
+	size_t mtp_w = ((queue)->jobs_waiters < (n))                         \
+		? (queue)->jobs_waiters : (n);                               \
+	                                                                     \
+	MTP_ATOMIC_STORE(&((queue)->posted), (queue)->posted + (n),          \
+		MTP_RELAXED);                                                \
+	                                                                     \
+	while (mtp_w-- > 0)                                                  \
+	{                                                                    \
+		pthread_cond_signal(&((queue)->has_jobs));                   \
+	}                                                                    \
+} while (0)
+
+/* Sleeps on has_room by way of 'wait', counted both for the queue and for
+ * the ring waited on so that a dequeue knows whom it can wake. Holds
+ * ring_mutex */
+#define MTP_WAIT_ROOM(queue, ring, wait)                                     \
+do                                                                           \
+{                                                                            \
+	(ring)->room_waiters++;                                              \
+	(queue)->room_waiters++;                                             \
+	MTP_STATS_BLOCKED(queue, wait);                                      \
+	(queue)->room_waiters--;                                             \
+	(ring)->room_waiters--;                                              \
+} while (0)
+
+/* Signals one producer waiting for room per slot 'n' jobs freed in 'ring',
+ * no more than are waiting. Should any wait on another ring a signal could
+ * land on one that still finds its ring full, so then all are woken. Holds
+ * ring_mutex */
+#define MTP_WAKE_ROOM(queue, ring, n)                                        \
+do                                                                           \
+{                                                                            \
+	size_t mtp_w = (queue)->room_waiters;                                \
+	                                                                     \
+	if ((ring)->room_waiters != mtp_w)                                   \
+	{                                                                    \
+		pthread_cond_broadcast(&((queue)->has_room));                \
+	}                                                                    \
+	else                                                                 \
+	{                                                                    \
+		mtp_w = (mtp_w < (n)) ? mtp_w : (n);                         \
+		                                                             \
+		while (mtp_w-- > 0)                                          \
+		{                                                            \
+			pthread_cond_signal(&((queue)->has_room));           \
+		}                                                            \
+	}                                                                    \
+} while (0)
+
+#define MTP_ENQUEUE_JOB(type, queue, ring, in)                               \
+do                                                                           \
+{                                                                            \
+	pthread_mutex_lock(&((queue)->ring_mutex));                          \
+	                                                                     \
+	while ((ring)->jobs_waiting == (ring)->jobs_max)                     \
+	{                                                                    \
+		if (MTP_HELP(queue, &((queue)->ring_mutex), 1) == MTP_FALSE) \
+		{                                                            \
+			MTP_WAIT_ROOM(queue, ring,                           \
+				pthread_cond_wait(&((queue)->has_room),      \
+				&((queue)->ring_mutex)));                    \
+		}                                                            \
+	}                                                                    \
+	                                                                     \
+	((type *) (ring)->jobs)[(ring)->write_curs++] = *((type *) in);      \
+	(ring)->write_curs &= (ring)->jobs_mask;                             \
+	(ring)->jobs_waiting++;                                              \
+	                                                                     \
+	MTP_JOBS_POSTED(queue, 1);                                           \
+	pthread_mutex_unlock(&((queue)->ring_mutex));                        \
+} while (0)
+
+/* Non-blocking MTP_ENQUEUE_JOB, 'ok' is MTP_FALSE if the ring was full */
+#define MTP_TRY_ENQUEUE_JOB(type, queue, ring, in, ok)                       \
+do                                                                           \
+{                                                                            \
+	pthread_mutex_lock(&((queue)->ring_mutex));                          \
+	(ok) = ((ring)->jobs_waiting < (ring)->jobs_max)                     \
+		? MTP_TRUE : MTP_FALSE;                                      \
+	                                                                     \
+	if ((ok) == MTP_TRUE)                                                \
+	{                                                                    \
+		((type *) (ring)->jobs)[(ring)->write_curs++]                \
+			= *((type *) in);                                    \
+		(ring)->write_curs &= (ring)->jobs_mask;                     \
+		(ring)->jobs_waiting++;                                      \
+		MTP_JOBS_POSTED(queue, 1);                                   \
+	}                                                                    \
+	                                                                     \
+	pthread_mutex_unlock(&((queue)->ring_mutex));                        \
+} while (0)
+
+/* MTP_ENQUEUE_JOB that gives up at 'deadline', 'ok' is MTP_FALSE if it did */
+#define MTP_TIMED_ENQUEUE_JOB(type, queue, ring, in, deadline, ok)           \
+do                                                                           \
+{                                                                            \
+	int mtp_rc = 0;                                                      \
+	                                                                     \
+	pthread_mutex_lock(&((queue)->ring_mutex));                          \
+	                                                                     \
+	while (((ring)->jobs_waiting == (ring)->jobs_max)                    \
+	&& (mtp_rc != ETIMEDOUT))                                            \
+	{                                                                    \
+		MTP_WAIT_ROOM(queue, ring, mtp_rc = pthread_cond_timedwait(  \
+			&((queue)->has_room), &((queue)->ring_mutex),        \
+			(deadline)));                                        \
+	}                                                                    \
+	                                                                     \
+	(ok) = ((ring)->jobs_waiting < (ring)->jobs_max)                     \
+		? MTP_TRUE : MTP_FALSE;                                      \
+	                                                                     \
+	if ((ok) == MTP_TRUE)                                                \
+	{                                                                    \
+		((type *) (ring)->jobs)[(ring)->write_curs++]                \
+			= *((type *) in);                                    \
+		(ring)->write_curs &= (ring)->jobs_mask;                     \
+		(ring)->jobs_waiting++;                                      \
+		MTP_JOBS_POSTED(queue, 1);                                   \
+	}                                                                    \
+	                                                                     \
+	pthread_mutex_unlock(&((queue)->ring_mutex));                        \
+} while (0)
+
+/* Enqueues without waiting, doubling a full ring up to 'limit' slots, 0 for
+ * none, rounded up to a power of two as the ring itself is. The jobs are
+ * copied across in order so the new ring starts at 0 */
+#define MTP_GROW_ENQUEUE_JOB(type, queue, ring, in, limit, stat)             \
+do                                                                           \
+{                                                                            \
+	(stat) = MTP_SUCCESS;                                                \
+	pthread_mutex_lock(&((queue)->ring_mutex));                          \
+	                                                                     \
+	if ((ring)->jobs_waiting == (ring)->jobs_max)                        \
+	{                                                                    \
+		size_t mtp_cap = (ring)->jobs_max * 2;                       \
+		size_t mtp_lim;                                              \
+		type *mtp_jobs = NULL;                                       \
+		size_t mtp_i;                                                \
+		                                                             \
+		MTP_POW2_AT_LEAST(mtp_lim, limit, 1);                        \
+		                                                             \
+		if (((limit) != 0) && (mtp_cap > mtp_lim))                   \
+		{                                                            \
+			mtp_cap = mtp_lim;                                   \
+		}                                                            \
+		                                                             \
+		if (mtp_cap <= (ring)->jobs_max)                             \
+		{                                                            \
+			(stat) = MTP_FULLUP;                                 \
+		}                                                            \
+		else if ((mtp_jobs = MTP_CALLOC(mtp_cap, sizeof(type)))      \
+			== NULL)                                             \
+		{                                                            \
+			(stat) = MTP_ERRMEM;                                 \
+		}                                                            \
+		else                                                         \
+		{                                                            \
+			for (mtp_i = 0; mtp_i < (ring)->jobs_waiting;        \
+				mtp_i++)                                     \
+			{                                                    \
+				mtp_jobs[mtp_i] = ((type *) (ring)->jobs)    \
+					[((ring)->read_curs + mtp_i)         \
+					& (ring)->jobs_mask];                \
+			}                                                    \
+			                                                     \
+			if ((ring)->owned == MTP_TRUE)                       \
+			{                                                    \
+				MTP_FREE((ring)->jobs);                      \
+			}                                                    \
+	                                                                     \
+			(ring)->jobs       = mtp_jobs;                       \
+			(ring)->owned      = MTP_TRUE;                       \
+			(ring)->jobs_max   = mtp_cap;                        \
+			(ring)->jobs_mask  = mtp_cap - 1;                    \
+			(ring)->read_curs  = 0;                              \
+			(ring)->write_curs = (ring)->jobs_waiting;           \
+		}                                                            \
+	}                                                                    \
+	                                                                     \
+	if ((stat) == MTP_SUCCESS)                                           \
+	{                                                                    \
+		((type *) (ring)->jobs)[(ring)->write_curs++]                \
+			= *((type *) in);                                    \
+		(ring)->write_curs &= (ring)->jobs_mask;                     \
+		(ring)->jobs_waiting++;                                      \
+		MTP_JOBS_POSTED(queue, 1);                                   \
+	}                                                                    \
+	                                                                     \
+	pthread_mutex_unlock(&((queue)->ring_mutex));                        \
+} while (0)
+
+/* Fills every free slot under one hold of ring_mutex, only waiting for room
+ * when the ring fills part way through the batch, and signals no more
+ * workers than there are new jobs */
+#define MTP_ENQUEUE_JOBS(type, queue, ring, arr, n, max_wake)                \
+do                                                                           \
+{                                                                            \
+	size_t mtp_done = 0;                                                 \
+	size_t mtp_got;                                                      \
+	size_t mtp_i;                                                        \
+	                                                                     \
+	(void) (max_wake);                                                   \
+	pthread_mutex_lock(&((queue)->ring_mutex));                          \
+	                                                                     \
+	while (mtp_done < (n))                                               \
+	{                                                                    \
+		while ((ring)->jobs_waiting == (ring)->jobs_max)             \
+		{                                                            \
+			if (MTP_HELP(queue, &((queue)->ring_mutex),          \
+				(n) - mtp_done) == MTP_FALSE)                \
+			{                                                    \
+				MTP_WAIT_ROOM(queue, ring,                   \
+					pthread_cond_wait(                   \
+					&((queue)->has_room),                \
+					&((queue)->ring_mutex)));            \
+			}                                                    \
+		}                                                            \
+		                                                             \
+		mtp_got = (ring)->jobs_max - (ring)->jobs_waiting;           \
+		mtp_got = (mtp_got < (n) - mtp_done)                         \
+			? mtp_got : (n) - mtp_done;                          \
+		                                                             \
+		for (mtp_i = 0; mtp_i < mtp_got; mtp_i++)                    \
+		{                                                            \
+			type * const mtp_slot                                \
+				= &(((type *) (ring)->jobs)                  \
+				[(ring)->write_curs]);                       \
+			                                                     \
+			mtp_slot->terminate = MTP_FALSE;                     \
+			mtp_slot->task      = NULL;                          \
+			mtp_slot->payload   = (arr)[mtp_done + mtp_i];       \
+			MTP_JOB_STAMP(*mtp_slot);                            \
+			                                                     \
+			if (++((ring)->write_curs) == (ring)->jobs_max)      \
+			{                                                    \
+				(ring)->write_curs = 0;                      \
+			}                                                    \
+		}                                                            \
+		                                                             \
+		(ring)->jobs_waiting += mtp_got;                             \
+		mtp_done += mtp_got;                                         \
+		MTP_JOBS_POSTED(queue, mtp_got);                             \
+	}                                                                    \
+	                                                                     \
+	pthread_mutex_unlock(&((queue)->ring_mutex));                        \
+} while (0)
+
+/* Waits for any level to hold jobs, then serves an aged level if one is due
+ * and otherwise the most urgent level that is not empty, or failing that the
+ * first node ring with jobs counting from 'home'. Gives up with 'got' at 0 if
+ * 'stop' holds or 'deadline' passes first. Before it first parks it spins as
+ * 'spin' allows with ring_mutex let go, watching posted for new jobs */
+#define MTP_DEQUEUE_JOBS(type, queue, home, out, max, share, stop, deadline, \
+	spin, got)                                                           \
+do                                                                           \
+{                                                                            \
+	MTP_BOOL mtp_spun = MTP_FALSE;                                       \
+	MTP_BOOL mtp_new;                                                    \
+	size_t mtp_seen;                                                     \
+	size_t mtp_want;                                                     \
+	size_t mtp_l;                                                        \
+	size_t mtp_k;                                                        \
+	int mtp_rc = 0;                                                      \
+	                                                                     \
+	(got) = 0;                                                           \
+	pthread_mutex_lock(&((queue)->ring_mutex));                          \
+	                                                                     \
+	for (;;)                                                             \
+	{                                                                    \
+		MTP_AGED_LEVEL(queue, MTP_PRIORITY_LEVELS, mtp_l);           \
+		                                                             \
+		if ((mtp_l == MTP_PRIORITY_LEVELS)                           \
+		|| ((queue)->rings[mtp_l].jobs_waiting == 0))                \
+		{                                                            \
+			mtp_l = 0;                                           \
+			                                                     \
+			while ((mtp_l < MTP_PRIORITY_LEVELS)                 \
+			&& ((queue)->rings[mtp_l].jobs_waiting == 0))        \
+			{                                                    \
+				mtp_l++;                                     \
+			}                                                    \
+		}                                                            \
+		                                                             \
+		if (mtp_l == MTP_PRIORITY_LEVELS)                            \
+		{                                                            \
+			mtp_l = MTP_NO_RING;                                 \
+		}                                                            \
+		                                                             \
+		for (mtp_k = 0; (mtp_l == MTP_NO_RING)                       \
+			&& (mtp_k < (queue)->num_nodes); mtp_k++)            \
+		{                                                            \
+			const size_t mtp_n = ((home) + mtp_k)                \
+				% (queue)->num_nodes;                        \
+			                                                     \
+			if ((queue)->nodes[mtp_n].jobs_waiting != 0)         \
+			{                                                    \
+				mtp_l = MTP_PRIORITY_LEVELS + mtp_n;         \
+			}                                                    \
+		}                                                            \
+		                                                             \
+		if ((mtp_l != MTP_NO_RING) || (stop)                         \
+		|| (mtp_rc == ETIMEDOUT))                                    \
+		{                                                            \
+			break;                                               \
+		}                                                            \
+		                                                             \
+		if (mtp_spun == MTP_FALSE)                                   \
+		{                                                            \
+			mtp_spun = MTP_TRUE;                                 \
+			mtp_new  = MTP_FALSE;                                \
+			mtp_seen = (queue)->posted;                          \
+			pthread_mutex_unlock(&((queue)->ring_mutex));        \
+			MTP_SPIN_UNTIL(spin, mtp_new                         \
+				= (MTP_ATOMIC_LOAD(&((queue)->posted),       \
+				MTP_RELAXED) != mtp_seen)                    \
+				? MTP_TRUE : MTP_FALSE, mtp_new);            \
+			pthread_mutex_lock(&((queue)->ring_mutex));          \
+			                                                     \
+			continue;                                            \
+		}                                                            \
+		                                                             \
+		(queue)->jobs_waiters++;                                     \
+		                                                             \
+		if ((deadline) == NULL)                                      \
+		{                                                            \
+			pthread_cond_wait(&((queue)->has_jobs),              \
+				&((queue)->ring_mutex));                     \
+		}                                                            \
+		else                                                         \
+		{                                                            \
+			mtp_rc = pthread_cond_timedwait(                     \
+				&((queue)->has_jobs),                        \
+				&((queue)->ring_mutex), (deadline));         \
+		}                                                            \
+		                                                             \
+		(queue)->jobs_waiters--;                                     \
+	}                                                                    \
+	                                                                     \
+	if (mtp_l != MTP_NO_RING)                                            \
+	{                                                                    \
+		mtp_want = MTP_FAIR_SHARE(MTP_RING_AT(queue, mtp_l)          \
+			->jobs_waiting, share, max);                         \
+		                                                             \
+		for ((got) = 0; (got) < mtp_want; (got)++)                   \
+		{                                                            \
+			((type *) (out))[got]                                \
+				= ((type *) MTP_RING_AT(queue, mtp_l)->jobs) \
+				[MTP_RING_AT(queue, mtp_l)->read_curs];      \
+			                                                     \
+			if (++(MTP_RING_AT(queue, mtp_l)->read_curs)         \
+				== MTP_RING_AT(queue, mtp_l)->jobs_max)      \
+			{                                                    \
+				MTP_RING_AT(queue, mtp_l)->read_curs = 0;    \
+			}                                                    \
+		}                                                            \
+		                                                             \
+		MTP_RING_AT(queue, mtp_l)->jobs_waiting -= (got);            \
+		                                                             \
+		if (mtp_l < MTP_PRIORITY_LEVELS)                             \
+		{                                                            \
+			MTP_AGE_LEVELS(queue, mtp_l);                        \
+		}                                                            \
+		                                                             \
+		MTP_WAKE_ROOM(queue, MTP_RING_AT(queue, mtp_l), got);        \
+	}                                                                    \
+	                                                                     \
+	pthread_mutex_unlock(&((queue)->ring_mutex));                        \
+} while (0)
+
+#define MTP_RING_INIT(ring) ((void) (ring))
+
+/* The ring lock is held from MTP_RING_ACQUIRE until MTP_RING_COMMIT, as the
+ * slots must be published in the order they are handed out */
+#define MTP_RING_ACQUIRE(type, queue, ring, out)                             \
+do                                                                           \
+{                                                                            \
+	pthread_mutex_lock(&((queue)->ring_mutex));                          \
+	                                                                     \
+	while ((ring)->jobs_waiting == (ring)->jobs_max)                     \
+	{                                                                    \
+		if (MTP_HELP(queue, &((queue)->ring_mutex), 1) == MTP_FALSE) \
+		{                                                            \
+			MTP_WAIT_ROOM(queue, ring,                           \
+				pthread_cond_wait(&((queue)->has_room),      \
+				&((queue)->ring_mutex)));                    \
+		}                                                            \
+	}                                                                    \
+	                                                                     \
+	(out) = &(((type *) (ring)->jobs)[(ring)->write_curs]);              \
+} while (0)
+
+#define MTP_RING_COMMIT(type, queue, ring, slot)                             \
+do                                                                           \
+{                                                                            \
+	(void) (slot);                                                       \
+	(ring)->write_curs = ((ring)->write_curs + 1) & (ring)->jobs_mask;   \
+	(ring)->jobs_waiting++;                                              \
+	                                                                     \
+	MTP_JOBS_POSTED(queue, 1);                                           \
+	pthread_mutex_unlock(&((queue)->ring_mutex));                        \
+} while (0)
+
+#endif /* MACRO_THREAD_POOL_LOCK_FREE */
+
+#ifdef MACRO_THREAD_POOL_WORK_STEALING
+
+/* Chase-Lev work stealing deque, one per worker. Only the owning worker pushes
+ * and takes at the bottom, any other worker may steal from the top. The
+ * buffer is a power of two in size, 'cap' slots handed to MTP_DEQUE_INIT, and
+ * a full deque makes the push fail so that the job can go to the shared
+ * injection queue instead */
+#define MTP_DEQUE_CAP(cap, min_jobs) MTP_POW2_AT_LEAST(cap, min_jobs, 2)
+
+#define MTP_DEQUE_INIT(worker, slots, cap)                                   \
+do                                                                           \
+{                                                                            \
+	(worker)->deque = (slots);                                           \
+	(worker)->deque_mask = (cap) - 1;                                    \
+} while (0)
+
+#define MTP_DEQUE_PUSH(type, worker, in, ok)                                 \
+do                                                                           \
+{                                                                            \
+	const ptrdiff_t mtp_b                                                \
+		= MTP_ATOMIC_LOAD(&((worker)->bottom), MTP_RELAXED);         \
+	const ptrdiff_t mtp_t                                                \
+		= MTP_ATOMIC_LOAD(&((worker)->top), MTP_ACQUIRE);            \
+	                                                                     \
+	(ok) = MTP_FALSE;                                                    \
+	                                                                     \
+	if ((size_t) (mtp_b - mtp_t) <= (worker)->deque_mask)                \
+	{                                                                    \
+		((type *) (worker)->deque)                                   \
+			[(size_t) mtp_b & (worker)->deque_mask]              \
+			= *((type *) in);                                    \
+		MTP_ATOMIC_STORE(&((worker)->bottom), mtp_b + 1,             \
+			MTP_RELEASE);                                        \
+		(ok) = MTP_TRUE;                                             \
+	}                                                                    \
+} while (0)
+
+#define MTP_DEQUE_TAKE(type, worker, out, ok)                                \
+do                                                                           \
+{                                                                            \
+	const ptrdiff_t mtp_b                                                \
+		= MTP_ATOMIC_LOAD(&((worker)->bottom), MTP_RELAXED) - 1;     \
+	ptrdiff_t mtp_t;                                                     \
+	                                                                     \
+	MTP_ATOMIC_STORE(&((worker)->bottom), mtp_b, MTP_RELAXED);           \
+	MTP_ATOMIC_FENCE();                                                  \
+	mtp_t = MTP_ATOMIC_LOAD(&((worker)->top), MTP_RELAXED);              \
+	(ok) = MTP_FALSE;                                                    \
+	                                                                     \
+	if (mtp_t <= mtp_b)                                                  \
+	{                                                                    \
+		*((type *) out) = ((type *) (worker)->deque)                 \
+			[(size_t) mtp_b & (worker)->deque_mask];             \
+		(ok) = MTP_TRUE;                                             \
+		                                                             \
+		if (mtp_t == mtp_b)                                          \
+		{                                                            \
+			if (!MTP_ATOMIC_CAS(&((worker)->top), &mtp_t,        \
+				mtp_t + 1))                                  \
+			{                                                    \
+				(ok) = MTP_FALSE;                            \
+			}                                                    \
+			                                                     \
+			MTP_ATOMIC_STORE(&((worker)->bottom), mtp_b + 1,     \
+				MTP_RELAXED);                                \
+		}                                                            \
+	}                                                                    \
+	else                                                                 \
+	{                                                                    \
+		MTP_ATOMIC_STORE(&((worker)->bottom), mtp_b + 1,             \
+			MTP_RELAXED);                                        \
+	}                                                                    \
+} while (0)
+
+#define MTP_DEQUE_STEAL(type, worker, out, ok)                               \
+do                                                                           \
+{                                                                            \
+	ptrdiff_t mtp_t = MTP_ATOMIC_LOAD(&((worker)->top), MTP_ACQUIRE);    \
+	ptrdiff_t mtp_b;                                                     \
+	                                                                     \
+	MTP_ATOMIC_FENCE();                                                  \
+	mtp_b = MTP_ATOMIC_LOAD(&((worker)->bottom), MTP_ACQUIRE);           \
+	(ok) = MTP_FALSE;                                                    \
+	                                                                     \
+	if (mtp_t < mtp_b)                                                   \
+	{                                                                    \
+		*((type *) out) = ((type *) (worker)->deque)                 \
+			[(size_t) mtp_t & (worker)->deque_mask];             \
+		                                                             \
+		if (MTP_ATOMIC_CAS(&((worker)->top), &mtp_t, mtp_t + 1))     \
+		{                                                            \
+			(ok) = MTP_TRUE;                                     \
+		}                                                            \
+	}                                                                    \
+} while (0)
+
+/* Tries every other worker once, starting from a random victim so that idle
+ * workers do not all pile onto the same deque */
+#define MTP_STEAL_JOB(type, worker, out, ok)                                 \
+do                                                                           \
+{                                                                            \
+	const size_t mtp_n = MTP_LIVE_THREADS((worker)->pool);               \
+	size_t mtp_i;                                                        \
+	size_t mtp_v;                                                        \
+	                                                                     \
+	(worker)->seed ^= (worker)->seed << 13;                              \
+	(worker)->seed ^= (worker)->seed >> 17;                              \
+	(worker)->seed ^= (worker)->seed << 5;                               \
+	mtp_v = (mtp_n != 0) ? ((worker)->seed % mtp_n) : 0;                 \
+	(ok) = MTP_FALSE;                                                    \
+	                                                                     \
+	for (mtp_i = 0; (mtp_i < mtp_n) && ((ok) == MTP_FALSE); mtp_i++)     \
+	{                                                                    \
+		if (&((worker)->pool->workers[mtp_v]) != (worker))           \
+		{                                                            \
+			MTP_DEQUE_STEAL(type,                                \
+				&((worker)->pool->workers[mtp_v]), out, ok); \
+		}                                                            \
+		                                                             \
+		mtp_v = (mtp_v + 1) % mtp_n;                                 \
+	}                                                                    \
+	                                                                     \
+	MTP_STATS_STEAL(worker, ok);                                         \
+} while (0)
+
+/* Levels more urgent than the default one have no place on a worker's deque,
+ * so the rings for those are checked before it, as is the default level's
+ * ring when aging says it is due */
+#if MTP_PRIORITY_LEVELS > 1
+#define MTP_URGENT_TRY_POP(type, queue, out, max, share, level, got, ok)     \
+do                                                                           \
+{                                                                            \
+	MTP_AGED_LEVEL(queue, MTP_PRIORITY_LEVELS, level);                   \
+	                                                                     \
+	if ((level) == MTP_PRIORITY_LEVELS - 1)                              \
+	{                                                                    \
+		MTP_POP_LEVELS(type, queue, out, max, share,                 \
+			MTP_PRIORITY_LEVELS, level, got, ok);                \
+	}                                                                    \
+	else                                                                 \
+	{                                                                    \
+		MTP_POP_LEVELS(type, queue, out, max, share,                 \
+			MTP_PRIORITY_LEVELS - 1, level, got, ok);            \
+	}                                                                    \
+} while (0)
+#else
+#define MTP_URGENT_TRY_POP(type, queue, out, max, share, level, got, ok)     \
+	((ok) = MTP_FALSE)
+#endif
+
+/* Urgent levels first, then own deque as it is the warmest, then the default
+ * level of the injection queue, then the node rings from the worker's own
+ * node on, then the other workers. Only the rings are drained in batches of
+ * 'max'. 'level' reports the ring that jobs were taken from, or MTP_NO_RING
+ * for a deque, so that their bookkeeping can be done once ring_mutex is
+ * released */
+#define MTP_TRY_ANY_JOB(type, worker, out, max, share, got, level, ok)       \
+do                                                                           \
+{                                                                            \
+	(level) = MTP_NO_RING;                                               \
+	MTP_URGENT_TRY_POP(type, (worker)->pool->queue, out, max, share,     \
+		level, got, ok);                                             \
+	                                                                     \
+	if ((ok) == MTP_FALSE)                                               \
+	{                                                                    \
+		(level) = MTP_NO_RING;                                       \
+		(got)   = 1;                                                 \
+		MTP_DEQUE_TAKE(type, worker, out, ok);                       \
+	}                                                                    \
+	                                                                     \
+	if ((ok) == MTP_FALSE)                                               \
+	{                                                                    \
+		MTP_POP_LEVELS(type, (worker)->pool->queue, out, max, share, \
+			MTP_PRIORITY_LEVELS, level, got, ok);                \
+		MTP_POP_NODES(type, (worker)->pool->queue, (worker)->node,   \
+			out, max, share, level, got, ok);                    \
+	}                                                                    \
+	                                                                     \
+	if ((ok) == MTP_FALSE)                                               \
+	{                                                                    \
+		(level) = MTP_NO_RING;                                       \
+		(got)   = 1;                                                 \
+		MTP_STEAL_JOB(type, worker, out, ok);                        \
+	}                                                                    \
+} while (0)
+
+/* Parks until there are jobs, 'stop' holds, or 'deadline' passes, 'got' is 0
+ * in the latter two cases */
+#define MTP_NEXT_JOBS(type, worker, out, max, stop, deadline, got)           \
+do                                                                           \
+{                                                                            \
+	const size_t mtp_share = MTP_LIVE_THREADS((worker)->pool);           \
+	MTP_BOOL mtp_ok;                                                     \
+	size_t mtp_level;                                                    \
+	                                                                     \
+	(got) = 0;                                                           \
+	MTP_PARK_UNTIL_TIMED((worker)->pool->queue, jobs_waiters, has_jobs,  \
+		MTP_TRY_ANY_JOB(type, worker, out, max,                      \
+		(mtp_share != 0) ? mtp_share : 1, got, mtp_level, mtp_ok);   \
+		MTP_STOP_IF(stop, got, mtp_ok), mtp_ok, deadline,            \
+		&((worker)->spin));                                          \
+	                                                                     \
+	if (mtp_ok == MTP_FALSE)                                             \
+	{                                                                    \
+		(got) = 0;                                                   \
+	}                                                                    \
+	                                                                     \
+	if (((got) != 0) && (mtp_level != MTP_NO_RING))                      \
+	{                                                                    \
+		MTP_DEQUEUED((worker)->pool->queue,                          \
+			MTP_RING_AT((worker)->pool->queue, mtp_level), got); \
+	}                                                                    \
+} while (0)
+
+/* A job submitted from one of the pool's own workers stays on that worker's
+ * deque, unless the deque is full in which case it goes to the shared ring.
+ * One bound for a ring other than the default, a priority level or a node,
+ * always goes to that ring */
+#define MTP_SUBMIT_TO(type, pool, self, ring, in)                            \
+do                                                                           \
+{                                                                            \
+	MTP_BOOL mtp_ok = MTP_FALSE;                                         \
+	                                                                     \
+	if (((self) != NULL) && ((self)->pool == (pool))                     \
+	&& ((ring) == MTP_DEFAULT_RING((pool)->queue)))                      \
+	{                                                                    \
+		MTP_DEQUE_PUSH(type, self, in, mtp_ok);                      \
+		                                                             \
+		if (mtp_ok == MTP_TRUE)                                      \
+		{                                                            \
+			MTP_WAKE((pool)->queue, jobs_waiters, has_jobs,      \
+				pthread_cond_signal);                        \
+		}                                                            \
+	}                                                                    \
+	                                                                     \
+	if (mtp_ok == MTP_FALSE)                                             \
+	{                                                                    \
+		MTP_ENQUEUE_JOB(type, (pool)->queue, ring, in);              \
+	}                                                                    \
+} while (0)
+
+#define MTP_SUBMIT(type, pool, self, in)                                     \
+	MTP_SUBMIT_TO(type, pool, self, MTP_DEFAULT_RING((pool)->queue), in)
+
+#define MTP_TRY_SUBMIT(type, pool, self, in, ok)                             \
+do                                                                           \
+{                                                                            \
+	(ok) = MTP_FALSE;                                                    \
+	                                                                     \
+	if (((self) != NULL) && ((self)->pool == (pool)))                    \
+	{                                                                    \
+		MTP_DEQUE_PUSH(type, self, in, ok);                          \
+		                                                             \
+		if ((ok) == MTP_TRUE)                                        \
+		{                                                            \
+			MTP_WAKE((pool)->queue, jobs_waiters, has_jobs,      \
+				pthread_cond_signal);                        \
+		}                                                            \
+	}                                                                    \
+	                                                                     \
+	if ((ok) == MTP_FALSE)                                               \
+	{                                                                    \
+		MTP_TRY_ENQUEUE_JOB(type, (pool)->queue,                     \
+			MTP_DEFAULT_RING((pool)->queue), in, ok);            \
+	}                                                                    \
+} while (0)
+
+/* Batch form of MTP_SUBMIT, a worker keeps as much of the batch as fits on
+ * its own deque and the rest spills into the injection queue */
+#define MTP_SUBMIT_JOBS(type, pool, self, arr, n)                            \
+do                                                                           \
+{                                                                            \
+	size_t mtp_kept = 0;                                                 \
+	                                                                     \
+	if (((self) != NULL) && ((self)->pool == (pool)))                    \
+	{                                                                    \
+		type mtp_tmp;                                                \
+		MTP_BOOL mtp_ok;                                             \
+		                                                             \
+		mtp_tmp.terminate = MTP_FALSE;                               \
+		mtp_tmp.task      = NULL;                                    \
+		MTP_JOB_STAMP(mtp_tmp);                                      \
+		                                                             \
+		while (mtp_kept < (n))                                       \
+		{                                                            \
+			mtp_tmp.payload = (arr)[mtp_kept];                   \
+			MTP_DEQUE_PUSH(type, self, &mtp_tmp, mtp_ok);        \
+			                                                     \
+			if (mtp_ok == MTP_FALSE)                             \
+			{                                                    \
+				break;                                       \
+			}                                                    \
+			                                                     \
+			mtp_kept++;                                          \
+		}                                                            \
+		                                                             \
+		MTP_WAKE_SOME((pool)->queue, jobs_waiters, has_jobs,         \
+			mtp_kept);                                           \
+	}                                                                    \
+	                                                                     \
+	MTP_ENQUEUE_JOBS(type, (pool)->queue,                                \
+		MTP_DEFAULT_RING((pool)->queue), (arr) + mtp_kept,           \
+		(n) - mtp_kept, MTP_LIVE_THREADS(pool));                     \
+} while (0)
+
+#define MTP_CURRENT_WORKER(key) pthread_getspecific(key)
+
+#else
+
+#define MTP_DEQUE_CAP(cap, min_jobs) ((cap) = 0)
+#define MTP_DEQUE_INIT(worker, slots, cap) ((void) (slots))
+#define MTP_DEQUE_TAKE(type, worker, out, ok) ((ok) = MTP_FALSE)
+
+#define MTP_NEXT_JOBS(type, worker, out, max, stop, deadline, got)           \
+do                                                                           \
+{                                                                            \
+	const size_t mtp_share = MTP_LIVE_THREADS((worker)->pool);           \
+	                                                                     \
+	MTP_DEQUEUE_JOBS(type, (worker)->pool->queue, (worker)->node, out,   \
+		max, (mtp_share != 0) ? mtp_share : 1, stop, deadline,       \
+		&((worker)->spin), got);                                     \
+} while (0)
+
+#define MTP_SUBMIT_TO(type, pool, self, ring, in)                            \
+do                                                                           \
+{                                                                            \
+	(void) (self);                                                       \
+	MTP_ENQUEUE_JOB(type, (pool)->queue, ring, in);                      \
+} while (0)
+
+#define MTP_SUBMIT(type, pool, self, in)                                     \
+	MTP_SUBMIT_TO(type, pool, self, MTP_DEFAULT_RING((pool)->queue), in)
+
+#define MTP_TRY_SUBMIT(type, pool, self, in, ok)                             \
+do                                                                           \
+{                                                                            \
+	(void) (self);                                                       \
+	MTP_TRY_ENQUEUE_JOB(type, (pool)->queue,                             \
+		MTP_DEFAULT_RING((pool)->queue), in, ok);                    \
+} while (0)
+
+#define MTP_SUBMIT_JOBS(type, pool, self, arr, n)                            \
+do                                                                           \
+{                                                                            \
+	(void) (self);                                                       \
+	MTP_ENQUEUE_JOBS(type, (pool)->queue,                                \
+		MTP_DEFAULT_RING((pool)->queue), arr, n,                     \
+		MTP_LIVE_THREADS(pool));                                     \
+} while (0)
+
+#define MTP_CURRENT_WORKER(key) NULL
+
+#endif /* MACRO_THREAD_POOL_WORK_STEALING */
+
+/* How a pool hands a job's payload to its function, by value or, for pools
+ * made with the POINTER generators, by a pointer to the worker's copy */
+#define MTP_CALL_BY_VALUE(func, payload)   func(payload)
+#define MTP_CALL_BY_POINTER(func, payload) func(&(payload))
+
+/* ----------------------------- MIND THE GAP ----------------------------- */
+
+#define MACRO_THREAD_POOL_PROTOTYPES(NAME, ElmType)                          \
+	                                                                     \
+struct NAME##ThreadArgs                                                      \
+{                                                                            \
+	MTP_BOOL terminate;                                                  \
+	void (*task)(void *);                                                \
+	void *arg;                                                           \
+	ElmType payload;                                                     \
+	MTP_IF_STAMP(struct timespec queued;)                                \
+};                                                                           \
+	                                                                     \
+struct NAME##JobRing                                                         \
+{                                                                            \
+	struct NAME##ThreadArgs *jobs;                                       \
+	size_t *seqs;                                                        \
+	size_t  jobs_max;                                                    \
+	size_t  jobs_mask;                                                   \
+	MTP_BOOL owned;                                                      \
+	char    pad_waiting[MTP_CACHE_LINE];                                 \
+	size_t  jobs_waiting;                                                \
+	size_t  room_waiters;                                                \
+	char    pad_write[MTP_CACHE_LINE];                                   \
+	size_t  write_curs;                                                  \
+	char    pad_read[MTP_CACHE_LINE];                                    \
+	size_t  read_curs;                                                   \
+	char    pad_end[MTP_CACHE_LINE];                                     \
+};                                                                           \
+	                                                                     \
+struct NAME##JobQueue                                                        \
+{                                                                            \
+	struct NAME##JobRing rings[MTP_PRIORITY_LEVELS];                     \
+	struct NAME##JobRing *nodes;                                         \
+	size_t  num_nodes;                                                   \
+	MTP_BOOL (*help)(struct NAME##JobQueue *, pthread_mutex_t *,         \
+		size_t);                                                     \
+	char    pad_inflight[MTP_CACHE_LINE];                                \
+	size_t  jobs_inflight;                                               \
+	MTP_IF_STATS(size_t peak_depth;)                                     \
+	char    pad_jobs[MTP_CACHE_LINE];                                    \
+	size_t  jobs_waiters;                                                \
+	size_t  posted;                                                      \
+	size_t  skipped[MTP_PRIORITY_LEVELS];                                \
+	pthread_cond_t has_jobs;                                             \
+	char    pad_room[MTP_CACHE_LINE];                                    \
+	size_t  room_waiters;                                                \
+	MTP_IF_STATS(unsigned long blocked_us;)                              \
+	pthread_cond_t has_room;                                             \
+	char    pad_idle[MTP_CACHE_LINE];                                    \
+	size_t  idle_waiters;                                                \
+	size_t  held_waiting;                                                \
+	size_t  helpers;                                                     \
+	pthread_cond_t is_idle;                                              \
+	pthread_mutex_t idle_mutex;                                          \
+	char    pad_lock[MTP_CACHE_LINE];                                    \
+	pthread_mutex_t ring_mutex;                                          \
+	char    pad_end[MTP_CACHE_LINE];                                     \
+};                                                                           \
+	                                                                     \
+struct NAME##Timer                                                           \
+{                                                                            \
+	ElmType payload;                                                     \
+	unsigned long expires;                                               \
+	unsigned long period;                                                \
+	unsigned long seq;                                                   \
+	size_t index;                                                        \
+	int state;                                                           \
+	struct NAME##Timer *next;                                            \
+	struct NAME##Timer **pprev;                                          \
+};                                                                           \
+	                                                                     \
+struct NAME##TimerWheel                                                      \
+{                                                                            \
+	struct NAME##Timer *slots[MTP_TIMER_LEVELS][MTP_TIMER_SLOTS];        \
+	struct NAME##Timer **chunks;                                         \
+	size_t num_chunks;                                                   \
+	size_t max_chunks;                                                   \
+	struct NAME##Timer *free;                                            \
+	size_t pending;                                                      \
+	unsigned long curr;                                                  \
+	unsigned long wake;                                                  \
+	struct timespec epoch;                                               \
+	MTP_BOOL started;                                                    \
+	MTP_BOOL stop;                                                       \
+	pthread_t thread;                                                    \
+	pthread_cond_t changed;                                              \
+	pthread_mutex_t mutex;                                               \
+};                                                                           \
+	                                                                     \
+struct NAME##ThreadPool                                                      \
+{                                                                            \
+	struct NAME##Worker *workers;                                        \
+	size_t num_threads;                                                  \
+	size_t max_threads;                                                  \
+	size_t target_threads;                                               \
+	struct NAME##JobQueue *queue;                                        \
+	struct mtpOptions opts;                                              \
+	MTP_CPU_SET *cpu_sets;                                               \
+	size_t num_sets;                                                     \
+	char *arenas;                                                        \
+	void *block;                                                         \
+	struct NAME##TimerWheel timers;                                      \
+	pthread_cond_t retired;                                              \
+	pthread_mutex_t resize_mutex;                                        \
+	struct NAME##Group *groups;                                          \
+	pthread_mutex_t groups_mutex;                                        \
+	int notify[2];                                                       \
+	MTP_IF_TRACE(struct timespec epoch;)                                 \
+	char pad_done[MTP_CACHE_LINE];                                       \
+	struct NAME##Completion *done;                                       \
+	char pad_end[MTP_CACHE_LINE];                                        \
+};                                                                           \
+	                                                                     \
+struct NAME##Worker                                                          \
+{                                                                            \
+	pthread_t thread;                                                    \
+	struct NAME##ThreadPool *pool;                                       \
+	int id;                                                              \
+	size_t node;                                                         \
+	size_t held;                                                         \
+	size_t held_waiting;                                                 \
+	unsigned int seed;                                                   \
+	MTP_BOOL retire;                                                     \
+	MTP_BOOL started;                                                    \
+	MTP_BOOL exited;                                                     \
+	struct NAME##ThreadArgs *deque;                                      \
+	size_t deque_mask;                                                   \
+	ptrdiff_t bottom;                                                    \
+	struct mtpArena arena;                                               \
+	MTP_IF_STATS(struct mtpWorkerCounters counters;)                     \
+	MTP_IF_TRACE(struct mtpTraceRing trace;)                             \
+	struct mtpSpin spin;                                                 \
+	char pad_top[MTP_CACHE_LINE];                                        \
+	ptrdiff_t top;                                                       \
+	char pad_end[MTP_CACHE_LINE];                                        \
+};                                                                           \
+	                                                                     \
+struct NAME##DagNode                                                         \
+{                                                                            \
+	ElmType payload;                                                     \
+	struct NAME##Dag *dag;                                               \
+	size_t *succ;                                                        \
+	size_t  num_succ;                                                    \
+	size_t  max_succ;                                                    \
+	size_t  in_degree;                                                   \
+	size_t  pending;                                                     \
+	size_t  next;                                                        \
+};                                                                           \
+	                                                                     \
+struct NAME##Dag                                                             \
+{                                                                            \
+	struct NAME##DagNode *nodes;                                         \
+	size_t num_nodes;                                                    \
+	size_t max_nodes;                                                    \
+	size_t remaining;                                                    \
+	MTP_BOOL done;                                                       \
+	MTP_BOOL checked;                                                    \
+	struct NAME##ThreadPool *pool;                                       \
+	pthread_cond_t is_done;                                              \
+	pthread_mutex_t mutex;                                               \
+};                                                                           \
+	                                                                     \
+struct NAME##Group                                                           \
+{                                                                            \
+	struct NAME##ThreadPool *pool;                                       \
+	struct NAME##Group *next;                                            \
+	struct NAME##Group **pprev;                                          \
+	size_t head;                                                         \
+	size_t queued;                                                       \
+	ElmType jobs[MTP_GROUP_JOBS];                                        \
+	size_t pending;                                                      \
+	size_t waiters;                                                      \
+	pthread_cond_t changed;                                              \
+	pthread_mutex_t mutex;                                               \
+};                                                                           \
+	                                                                     \
+/* A job whose completion is reported through DrainCompletions, owned by the \
+ * caller. token is never touched by the pool */                             \
+struct NAME##Completion                                                      \
+{                                                                            \
+	ElmType payload;                                                     \
+	void *token;                                                         \
+	struct NAME##ThreadPool *pool;                                       \
+	struct NAME##Completion *next;                                       \
+};                                                                           \
+	                                                                     \
+void NAME##EnqueueJob(struct NAME##ThreadPool *pool, ElmType in);            \
+void NAME##EnqueueJobPriority(struct NAME##ThreadPool *pool, ElmType in,     \
+	unsigned int level);                                                 \
+void NAME##EnqueueJobOnNode(struct NAME##ThreadPool *pool, ElmType in,       \
+	size_t node);                                                        \
+MTP_STAT NAME##TryEnqueueJob(struct NAME##ThreadPool *pool, ElmType in);     \
+void NAME##EnqueueJobs(struct NAME##ThreadPool *pool, const ElmType *arr,    \
+	size_t n);                                                           \
+void NAME##EnqueueTask(struct NAME##ThreadPool *pool, void (*task)(void *),  \
+	void *arg);                                                          \
+MTP_BOOL NAME##TryEnqueueTask(struct NAME##ThreadPool *pool,                 \
+	void (*task)(void *), void *arg);                                    \
+ElmType* NAME##AcquireSlot(struct NAME##ThreadPool *pool);                   \
+void NAME##CommitSlot(struct NAME##ThreadPool *pool, ElmType *slot);         \
+void* NAME##ThreadRoutine(void *worker);                                     \
+struct NAME##ThreadPool* NAME##NewThreadPool(const size_t num_threads,       \
+	const size_t max_jobs);                                              \
+struct NAME##ThreadPool* NAME##NewThreadPoolEx(const size_t num_threads,     \
+	const size_t max_jobs, const struct mtpOptions *opts);               \
+size_t NAME##PoolMemoryRequired(const size_t num_threads,                    \
+	const size_t max_jobs, const struct mtpOptions *opts);               \
+struct NAME##ThreadPool* NAME##InitThreadPoolInPlace(void *mem, size_t size, \
+	const size_t num_threads, const size_t max_jobs,                     \
+	const struct mtpOptions *opts);                                      \
+MTP_STAT NAME##ResizeThreadPool(struct NAME##ThreadPool *pool,               \
+	size_t num_threads);                                                 \
+void NAME##CleanupThreadPool(struct NAME##ThreadPool *pool);                 \
+void NAME##WaitOnIdle(struct NAME##ThreadPool *pool);                        \
+int NAME##GetThreadId(void);                                                 \
+int NAME##GetThreadNode(void);                                               \
+struct mtpArena* NAME##WorkerArena(void);                                    \
+void* NAME##ArenaAlloc(struct mtpArena *arena, size_t n);                    \
+size_t NAME##GetStats(struct NAME##ThreadPool *pool, struct mtpStats *stats, \
+	struct mtpWorkerStats *workers, size_t n);                           \
+struct NAME##Dag* NAME##NewDag(size_t max_nodes);                            \
+MTP_STAT NAME##DagAddNode(struct NAME##Dag *dag, ElmType in, size_t *id);    \
+MTP_STAT NAME##DagAddEdge(struct NAME##Dag *dag, size_t from, size_t to);    \
+MTP_STAT NAME##DagRun(struct NAME##ThreadPool *pool, struct NAME##Dag *dag); \
+void NAME##CleanupDag(struct NAME##Dag *dag);                                \
+void NAME##GroupInit(struct NAME##Group *group,                              \
+	struct NAME##ThreadPool *pool);                                      \
+MTP_STAT NAME##EnqueueJobInGroup(struct NAME##Group *group, ElmType in);     \
+void NAME##GroupWait(struct NAME##Group *group);                             \
+void NAME##GroupDestroy(struct NAME##Group *group);                          \
+MTP_STAT NAME##EnqueueJobAfter(struct NAME##ThreadPool *pool,                \
+	unsigned long delay_ms, ElmType in, struct mtpTimer *timer);         \
+MTP_STAT NAME##EnqueueJobEvery(struct NAME##ThreadPool *pool,                \
+	unsigned long period_ms, ElmType in, struct mtpTimer *timer);        \
+MTP_BOOL NAME##CancelTimer(struct NAME##ThreadPool *pool,                    \
+	struct mtpTimer timer);                                              \
+void NAME##EnqueueJobNotify(struct NAME##ThreadPool *pool, ElmType in,       \
+	struct NAME##Completion *done);                                      \
+struct NAME##Completion* NAME##DrainCompletions(                             \
+	struct NAME##ThreadPool *pool);                                      \
+int NAME##CompletionFd(struct NAME##ThreadPool *pool);                       \
+MTP_TRACE_PROTOTYPES(NAME)                                                   \
+	                                                                     \
+enum {NAME##_MTP_PROTOTYPE_DUMMY = 0}
+
+/* ----------------------------- MIND THE GAP ----------------------------- */
+
+#define MTP_POOL_DEFINITIONS(NAME, ElmType, ThreadFunc, CallFunc)            \
+	                                                                     \
+static pthread_once_t NAME##_id_once = PTHREAD_ONCE_INIT;                    \
+static pthread_key_t NAME##_id_key;                                          \
+	                                                                     \
+static void NAME##IdKeyCreate(void)                                          \
+{                                                                            \
+	pthread_key_create(&(NAME##_id_key), NULL);                          \
+}                                                                            \
+	                                                                     \
+int NAME##GetThreadId(void)                                                  \
+{                                                                            \
+	struct NAME##Worker * const self                                     \
+		= pthread_getspecific(NAME##_id_key);                        \
+	                                                                     \
+	return (self != NULL) ? (self->id) : (-1);                           \
+}                                                                            \
+	                                                                     \
+/* The NUMA node the calling worker was placed on, 0 if the pool has none */ \
+int NAME##GetThreadNode(void)                                                \
+{                                                                            \
+	struct NAME##Worker * const self                                     \
+		= pthread_getspecific(NAME##_id_key);                        \
+	                                                                     \
+	return ((self != NULL) && (self->node <= INT_MAX))                   \
+		? ((int) self->node) : (-1);                                 \
+}                                                                            \
+	                                                                     \
+/* The calling worker's scratch arena, NULL outside the pool's workers or    \
+ * for a pool created without arenas */                                      \
+struct mtpArena* NAME##WorkerArena(void)                                     \
+{                                                                            \
+	struct NAME##Worker * const self                                     \
+		= pthread_getspecific(NAME##_id_key);                        \
+	                                                                     \
+	return ((self != NULL) && (self->arena.base != NULL))                \
+		? &(self->arena) : NULL;                                     \
+}                                                                            \
+	                                                                     \
+/* Bumps 'n' bytes, aligned for any type, off the front of 'arena', NULL if  \
+ * the arena is NULL or has not that much left */                            \
+void* NAME##ArenaAlloc(struct mtpArena *arena, size_t n)                     \
+{                                                                            \
+	const size_t want = MTP_ROUND_UP(n, MTP_ARENA_ALIGN);                \
+	void *out;                                                           \
+	                                                                     \
+	if ((arena == NULL) || (want < n)                                    \
+	|| (want > arena->size - arena->used))                               \
+	{                                                                    \
+		return NULL;                                                 \
+	}                                                                    \
+	                                                                     \
+	out = arena->base + arena->used;                                     \
+	arena->used += want;                                                 \
+	                                                                     \
+	return out;                                                          \
+}                                                                            \
+	                                                                     \
+/* Flags the highest live worker to leave once done with its current job so  \
+ * ids stay dense, as long as more than the target, or for an idle worker    \
+ * min_threads and at least one, would remain */                             \
+static void NAME##RetireWorker(struct NAME##ThreadPool *pool, MTP_BOOL idle) \
+{                                                                            \
+	size_t keep;                                                         \
+	size_t live;                                                         \
+	                                                                     \
+	pthread_mutex_lock(&(pool->resize_mutex));                           \
+	live = MTP_LIVE_THREADS(pool);                                       \
+	keep = (idle == MTP_TRUE) ? pool->opts.min_threads                   \
+		: pool->target_threads;                                      \
+	                                                                     \
+	if ((idle == MTP_TRUE) && (keep == 0))                               \
+	{                                                                    \
+		keep = 1;                                                    \
+	}                                                                    \
+	                                                                     \
+	if (live > keep)                                                     \
+	{                                                                    \
+		MTP_ATOMIC_STORE(&(pool->num_threads), live - 1,             \
+			MTP_RELAXED);                                        \
+		MTP_ATOMIC_STORE(&(pool->workers[live - 1].retire),          \
+			MTP_TRUE,                                            \
+			MTP_RELAXED);                                        \
+		                                                             \
+		/* Under the ring lock so a parking worker sees the flag */  \
+		pthread_mutex_lock(&(pool->queue->ring_mutex));              \
+		pthread_cond_broadcast(&(pool->queue->has_jobs));            \
+		pthread_mutex_unlock(&(pool->queue->ring_mutex));            \
+	}                                                                    \
+	                                                                     \
+	pthread_mutex_unlock(&(pool->resize_mutex));                         \
+}                                                                            \
+	                                                                     \
+/* Starts a worker in the first slot past the live ones, waiting for one     \
+ * still leaving that slot if 'wait' holds. Called with resize_mutex held */ \
+static MTP_STAT NAME##SpawnWorker(struct NAME##ThreadPool *pool,             \
+	MTP_BOOL wait)                                                       \
+{                                                                            \
+	struct NAME##Worker *slot;                                           \
+	MTP_CPU_SET *set = NULL;                                             \
+	size_t live;                                                         \
+	int rc;                                                              \
+	                                                                     \
+	for (;;)                                                             \
+	{                                                                    \
+		if ((live = MTP_LIVE_THREADS(pool)) >= pool->max_threads)    \
+		{                                                            \
+			return MTP_FULLUP;                                   \
+		}                                                            \
+		                                                             \
+		slot = &(pool->workers[live]);                               \
+		                                                             \
+		if ((slot->started == MTP_FALSE)                             \
+		|| (slot->exited == MTP_TRUE))                               \
+		{                                                            \
+			break;                                               \
+		}                                                            \
+		else if (wait == MTP_FALSE)                                  \
+		{                                                            \
+			return MTP_FULLUP;                                   \
+		}                                                            \
+		                                                             \
+		pthread_cond_wait(&(pool->retired), &(pool->resize_mutex));  \
+	}                                                                    \
+	                                                                     \
+	if (slot->started == MTP_TRUE)                                       \
+	{                                                                    \
+		pthread_join(slot->thread, NULL);                            \
+	}                                                                    \
+	                                                                     \
+	/* The last worker drained the deque, top and bottom stay */         \
+	slot->started = MTP_FALSE;                                           \
+	slot->exited  = MTP_FALSE;                                           \
+	MTP_ATOMIC_STORE(&(slot->retire), MTP_FALSE, MTP_RELAXED);           \
+	                                                                     \
+	if (pool->num_sets != 0)                                             \
+	{                                                                    \
+		set = &(pool->cpu_sets[live % pool->num_sets]);              \
+	}                                                                    \
+	                                                                     \
+	MTP_SPAWN_PINNED(slot->thread, NAME##ThreadRoutine, slot, set, rc);  \
+	                                                                     \
+	if (rc != 0)                                                         \
+	{                                                                    \
+		return MTP_ERRMEM;                                           \
+	}                                                                    \
+	                                                                     \
+	slot->started = MTP_TRUE;                                            \
+	MTP_ATOMIC_STORE(&(pool->num_threads), live + 1, MTP_RELAXED);       \
+	                                                                     \
+	return MTP_SUCCESS;                                                  \
+}                                                                            \
+	                                                                     \
+/* Adds a worker when the jobs in flight exceed one per live worker by more  \
+ * than scale_depth, never waiting on a resize already under way */          \
+static void NAME##AutoScale(struct NAME##ThreadPool *pool)                   \
+{                                                                            \
+	size_t live;                                                         \
+	                                                                     \
+	if (pthread_mutex_trylock(&(pool->resize_mutex)) != 0)               \
+	{                                                                    \
+		return;                                                      \
+	}                                                                    \
+	                                                                     \
+	live = MTP_LIVE_THREADS(pool);                                       \
+	                                                                     \
+	if ((live < pool->max_threads)                                       \
+	&& (MTP_ATOMIC_LOAD(&(pool->queue->jobs_inflight), MTP_RELAXED)      \
+		> live + pool->opts.scale_depth))                            \
+	{                                                                    \
+		NAME##SpawnWorker(pool, MTP_FALSE);                          \
+	}                                                                    \
+	                                                                     \
+	pthread_mutex_unlock(&(pool->resize_mutex));                         \
+}                                                                            \
+	                                                                     \
+static void NAME##JobsQueued(struct NAME##ThreadPool *pool, size_t n)        \
+{                                                                            \
+	MTP_STATS_PEAK(pool->queue, MTP_JOBS_QUEUED(pool->queue, n) + n);    \
+	                                                                     \
+	if (pool->opts.scale_depth != 0)                                     \
+	{                                                                    \
+		NAME##AutoScale(pool);                                       \
+	}                                                                    \
+}                                                                            \
+	                                                                     \
+void NAME##EnqueueJob(struct NAME##ThreadPool *pool, ElmType in)             \
+{                                                                            \
+	struct NAME##Worker * const self                                     \
+		= MTP_CURRENT_WORKER(NAME##_id_key);                         \
+	struct NAME##ThreadArgs tmp;                                         \
+	                                                                     \
+	tmp.terminate = MTP_FALSE;                                           \
+	tmp.task      = NULL;                                                \
+	tmp.payload   = in;                                                  \
+	MTP_JOB_STAMP(tmp);                                                  \
+	                                                                     \
+	NAME##JobsQueued(pool, 1);                                           \
+	MTP_SUBMIT(struct NAME##ThreadArgs, pool, self, &tmp);               \
+}                                                                            \
+	                                                                     \
+/* EnqueueJob onto the given priority level, 0 being the most urgent. Any    \
+ * level past the last is clamped to it, which is where EnqueueJob goes */   \
+void NAME##EnqueueJobPriority(struct NAME##ThreadPool *pool, ElmType in,     \
+	unsigned int level)                                                  \
+{                                                                            \
+	struct NAME##Worker * const self                                     \
+		= MTP_CURRENT_WORKER(NAME##_id_key);                         \
+	struct NAME##ThreadArgs tmp;                                         \
+	                                                                     \
+	tmp.terminate = MTP_FALSE;                                           \
+	tmp.task      = NULL;                                                \
+	tmp.payload   = in;                                                  \
+	MTP_JOB_STAMP(tmp);                                                  \
+	                                                                     \
+	NAME##JobsQueued(pool, 1);                                           \
+	MTP_SUBMIT_TO(struct NAME##ThreadArgs, pool, self,                   \
+		&(pool->queue->rings[(level < MTP_PRIORITY_LEVELS)           \
+		? level : MTP_PRIORITY_LEVELS - 1]), &tmp);                  \
+}                                                                            \
+	                                                                     \
+/* EnqueueJob onto the ring of a NUMA node, taken modulo the node count,     \
+ * which the workers placed on that node serve before any other node's.      \
+ * Falls back on EnqueueJob for a pool created without numa */               \
+void NAME##EnqueueJobOnNode(struct NAME##ThreadPool *pool, ElmType in,       \
+	size_t node)                                                         \
+{                                                                            \
+	struct NAME##Worker * const self                                     \
+		= MTP_CURRENT_WORKER(NAME##_id_key);                         \
+	struct NAME##ThreadArgs tmp;                                         \
+	                                                                     \
+	tmp.terminate = MTP_FALSE;                                           \
+	tmp.task      = NULL;                                                \
+	tmp.payload   = in;                                                  \
+	MTP_JOB_STAMP(tmp);                                                  \
+	                                                                     \
+	NAME##JobsQueued(pool, 1);                                           \
+	MTP_SUBMIT_TO(struct NAME##ThreadArgs, pool, self,                   \
+		(pool->queue->num_nodes != 0)                                \
+		? &(pool->queue->nodes[node % pool->queue->num_nodes])       \
+		: MTP_DEFAULT_RING(pool->queue), &tmp);                      \
+}                                                                            \
+	                                                                     \
+/* EnqueueJob that falls back on the pool's overflow policy if the queue is  \
+ * full, reporting what became of the job */                                 \
+MTP_STAT NAME##TryEnqueueJob(struct NAME##ThreadPool *pool, ElmType in)      \
+{                                                                            \
+	struct NAME##Worker * const self                                     \
+		= MTP_CURRENT_WORKER(NAME##_id_key);                         \
+	struct NAME##JobRing * const ring = MTP_DEFAULT_RING(pool->queue);   \
+	struct NAME##ThreadArgs tmp = {0};                                   \
+	struct timespec deadline;                                            \
+	MTP_STAT stat = MTP_FULLUP;                                          \
+	MTP_BOOL ok;                                                         \
+	                                                                     \
+	tmp.terminate = MTP_FALSE;                                           \
+	tmp.task      = NULL;                                                \
+	tmp.payload   = in;                                                  \
+	MTP_JOB_STAMP(tmp);                                                  \
+	                                                                     \
+	NAME##JobsQueued(pool, 1);                                           \
+	MTP_TRY_SUBMIT(struct NAME##ThreadArgs, pool, self, &tmp, ok);       \
+	                                                                     \
+	if (ok == MTP_TRUE)                                                  \
+	{                                                                    \
+		return MTP_SUCCESS;                                          \
+	}                                                                    \
+	                                                                     \
+	switch (pool->opts.overflow)                                         \
+	{                                                                    \
+		case MTP_OVERFLOW_BLOCK:                                     \
+			MTP_ENQUEUE_JOB(struct NAME##ThreadArgs,             \
+				pool->queue, ring, &tmp);                    \
+			stat = MTP_SUCCESS;                                  \
+			break;                                               \
+		                                                             \
+		case MTP_OVERFLOW_CALLER_RUNS:                               \
+			CallFunc(ThreadFunc, in);                            \
+			stat = MTP_RANINLINE;                                \
+			break;                                               \
+		                                                             \
+		case MTP_OVERFLOW_GROW:                                      \
+			MTP_GROW_ENQUEUE_JOB(struct NAME##ThreadArgs,        \
+				pool->queue, ring, &tmp,                     \
+				pool->opts.grow_max, stat);                  \
+			break;                                               \
+		                                                             \
+		case MTP_OVERFLOW_TIMEOUT:                                   \
+			MTP_DEADLINE(deadline, pool->opts.timeout_ms);       \
+			MTP_TIMED_ENQUEUE_JOB(struct NAME##ThreadArgs,       \
+				pool->queue, ring, &tmp, &deadline, ok);     \
+			stat = (ok == MTP_TRUE) ? MTP_SUCCESS : MTP_TIMEOUT; \
+			break;                                               \
+		                                                             \
+		default:                                                     \
+			break;                                               \
+	}                                                                    \
+	                                                                     \
+	if (stat != MTP_SUCCESS)                                             \
+	{                                                                    \
+		MTP_JOBS_DONE(pool->queue, 1);                               \
+	}                                                                    \
+	                                                                     \
+	return stat;                                                         \
+}                                                                            \
+	                                                                     \
+void NAME##EnqueueJobs(struct NAME##ThreadPool *pool, const ElmType *arr,    \
+	size_t n)                                                            \
+{                                                                            \
+	struct NAME##Worker * const self                                     \
+		= MTP_CURRENT_WORKER(NAME##_id_key);                         \
+	                                                                     \
+	NAME##JobsQueued(pool, n);                                           \
+	MTP_SUBMIT_JOBS(struct NAME##ThreadArgs, pool, self, arr, n);        \
+}                                                                            \
+	                                                                     \
+/* Runs task(arg) on a worker in place of the pool's own function, counted   \
+ * and waited on exactly like any other job */                               \
+void NAME##EnqueueTask(struct NAME##ThreadPool *pool, void (*task)(void *),  \
+	void *arg)                                                           \
+{                                                                            \
+	struct NAME##Worker * const self                                     \
+		= MTP_CURRENT_WORKER(NAME##_id_key);                         \
+	struct NAME##ThreadArgs tmp = {0};                                   \
+	                                                                     \
+	tmp.terminate = MTP_FALSE;                                           \
+	tmp.task      = task;                                                \
+	tmp.arg       = arg;                                                 \
+	MTP_JOB_STAMP(tmp);                                                  \
+	                                                                     \
+	NAME##JobsQueued(pool, 1);                                           \
+	MTP_SUBMIT(struct NAME##ThreadArgs, pool, self, &tmp);               \
+}                                                                            \
+	                                                                     \
+/* Non-blocking EnqueueTask, returns MTP_FALSE if the queue is full */       \
+MTP_BOOL NAME##TryEnqueueTask(struct NAME##ThreadPool *pool,                 \
+	void (*task)(void *), void *arg)                                     \
+{                                                                            \
+	struct NAME##Worker * const self                                     \
+		= MTP_CURRENT_WORKER(NAME##_id_key);                         \
+	struct NAME##ThreadArgs tmp = {0};                                   \
+	MTP_BOOL ok;                                                         \
+	                                                                     \
+	tmp.terminate = MTP_FALSE;                                           \
+	tmp.task      = task;                                                \
+	tmp.arg       = arg;                                                 \
+	MTP_JOB_STAMP(tmp);                                                  \
+	                                                                     \
+	NAME##JobsQueued(pool, 1);                                           \
+	MTP_TRY_SUBMIT(struct NAME##ThreadArgs, pool, self, &tmp, ok);       \
+	                                                                     \
+	if (ok == MTP_FALSE)                                                 \
+	{                                                                    \
+		MTP_JOBS_DONE(pool->queue, 1);                               \
+	}                                                                    \
+	                                                                     \
+	return ok;                                                           \
+}                                                                            \
+	                                                                     \
+/* Hands out the next free slot of the queue for the payload to be written   \
+ * in place rather than copied in, waiting for room as EnqueueJob does. The  \
+ * job is counted from here on but is not run until CommitSlot */            \
+ElmType* NAME##AcquireSlot(struct NAME##ThreadPool *pool)                    \
+{                                                                            \
+	struct NAME##ThreadArgs *slot;                                       \
+	                                                                     \
+	NAME##JobsQueued(pool, 1);                                           \
+	MTP_RING_ACQUIRE(struct NAME##ThreadArgs, pool->queue,               \
+		MTP_DEFAULT_RING(pool->queue), slot);                        \
+	slot->terminate = MTP_FALSE;                                         \
+	slot->task      = NULL;                                              \
+	                                                                     \
+	return &(slot->payload);                                             \
+}                                                                            \
+	                                                                     \
+void NAME##CommitSlot(struct NAME##ThreadPool *pool, ElmType *slot)          \
+{                                                                            \
+	struct NAME##ThreadArgs * const args                                 \
+		= (struct NAME##ThreadArgs *) ((char *) slot                 \
+		- offsetof(struct NAME##ThreadArgs, payload));               \
+	                                                                     \
+	MTP_JOB_STAMP(*args);                                                \
+	MTP_RING_COMMIT(struct NAME##ThreadArgs, pool->queue,                \
+		MTP_DEFAULT_RING(pool->queue), args);                        \
+}                                                                            \
+	                                                                     \
+/* Runs a batch of jobs taken off the queue on the calling worker and counts \
+ * them done. held counts those not done yet, the worker's own share of      \
+ * jobs_inflight which a WaitOnIdle made from inside one cannot wait for */  \
+static void NAME##RunJobs(struct NAME##Worker *self,                         \
+	struct NAME##ThreadArgs *args, size_t got)                           \
+{                                                                            \
+	size_t run = 0;                                                      \
+	size_t i;                                                            \
+	MTP_IF_STAMP(struct timespec now;)                                   \
+	MTP_IF_STAMP(struct timespec end;)                                   \
+	                                                                     \
+	for (i = 0; i < got; i++)                                            \
+	{                                                                    \
+		run += (args[i].terminate == MTP_FALSE) ? 1 : 0;             \
+	}                                                                    \
+	                                                                     \
+	self->held += run;                                                   \
+	MTP_STAMP_CLOCK(now);                                                \
+	                                                                     \
+	for (i = 0; i < got; i++)                                            \
+	{                                                                    \
+		if (args[i].terminate == MTP_TRUE)                           \
+		{                                                            \
+			/* Retires whichever worker is highest, not          \
+			 * necessarily this one */                           \
+			NAME##RetireWorker(self->pool, MTP_FALSE);           \
+		}                                                            \
+		else                                                         \
+		{                                                            \
+			const size_t mark = self->arena.used;                \
+			                                                     \
+			if (args[i].task != NULL)                            \
+			{                                                    \
+				args[i].task(args[i].arg);                   \
+			}                                                    \
+			else                                                 \
+			{                                                    \
+				CallFunc(ThreadFunc, args[i].payload);       \
+			}                                                    \
+			                                                     \
+			/* Wound back to where the job found it, not to 0,   \
+			 * as it may have been helped in under another */    \
+			self->arena.used = mark;                             \
+			MTP_STAMP_CLOCK(end);                                \
+			MTP_STATS_JOB(self, args[i], now, end);              \
+			MTP_TRACE_JOB(self, args[i], now, end);              \
+			MTP_IF_STAMP(now = end;)                             \
+		}                                                            \
+	}                                                                    \
+	                                                                     \
+	MTP_JOBS_DONE(self->pool->queue, run);                               \
+	self->held -= run;                                                   \
+}                                                                            \
+	                                                                     \
+/* Runs one queued job, if there is one, on the calling worker in place of   \
+ * waiting, returning how many it ran */                                     \
+static size_t NAME##RunQueued(struct NAME##Worker *self)                     \
+{                                                                            \
+	static const struct timespec past;                                   \
+	struct NAME##ThreadArgs job;                                         \
+	size_t got;                                                          \
+	                                                                     \
+	/* Stops at once anyway, the deadline long past is a formality */    \
+	MTP_NEXT_JOBS(struct NAME##ThreadArgs, self, &job, 1, MTP_TRUE,      \
+		&past, got);                                                 \
+	NAME##RunJobs(self, &job, got);                                      \
+	                                                                     \
+	return got;                                                          \
+}                                                                            \
+	                                                                     \
+/* The calling thread's worker if it is one of the pool's, NULL otherwise */ \
+static struct NAME##Worker* NAME##Self(struct NAME##ThreadPool *pool)        \
+{                                                                            \
+	struct NAME##Worker * const self                                     \
+		= pthread_getspecific(NAME##_id_key);                        \
+	                                                                     \
+	return ((self != NULL) && (self->pool == pool)) ? self : NULL;       \
+}                                                                            \
+	                                                                     \
+/* The queue's MTP_HELP, run by a thread about to wait for room. A worker of \
+ * the pool may be the very thread that would make it, so it runs a queued   \
+ * job instead with 'lock', if any, released meanwhile. The jobs it has yet  \
+ * to queue are held by it until then, as far as WaitOnIdle is concerned */  \
+static MTP_BOOL NAME##Help(struct NAME##JobQueue *queue,                     \
+	pthread_mutex_t *lock, size_t unqueued)                              \
+{                                                                            \
+	struct NAME##Worker * const self                                     \
+		= pthread_getspecific(NAME##_id_key);                        \
+	                                                                     \
+	if ((self == NULL) || (self->pool->queue != queue))                  \
+	{                                                                    \
+		return MTP_FALSE;                                            \
+	}                                                                    \
+	                                                                     \
+	if (lock != NULL)                                                    \
+	{                                                                    \
+		pthread_mutex_unlock(lock);                                  \
+	}                                                                    \
+	                                                                     \
+	self->held += unqueued;                                              \
+	(void) NAME##RunQueued(self);                                        \
+	self->held -= unqueued;                                              \
+	                                                                     \
+	if (lock != NULL)                                                    \
+	{                                                                    \
+		pthread_mutex_lock(lock);                                    \
+	}                                                                    \
+	                                                                     \
+	return MTP_TRUE;                                                     \
+}                                                                            \
+	                                                                     \
+/* pthread_cond_wait for the waits a job may make, 'done' telling when the   \
+ * wait is over, or pthread_cond_timedwait if 'until' is not NULL. What a    \
+ * worker waits on may be stuck behind the jobs still queued, so it runs the \
+ * next of those instead, parked as a helper until there is one, 'until'     \
+ * passes, or it is woken by MTP_WAKE_HELPERS to find 'done' holds */        \
+static void NAME##HelpOrWait(struct NAME##Worker *self,                      \
+	pthread_cond_t *cond, pthread_mutex_t *mutex,                        \
+	MTP_BOOL (*done)(void *), void *arg, const struct timespec *until)   \
+{                                                                            \
+	struct NAME##JobQueue *queue;                                        \
+	struct NAME##ThreadArgs job;                                         \
+	size_t got;                                                          \
+	                                                                     \
+	if (self == NULL)                                                    \
+	{                                                                    \
+		if (until != NULL)                                           \
+		{                                                            \
+			pthread_cond_timedwait(cond, mutex, until);          \
+		}                                                            \
+		else                                                         \
+		{                                                            \
+			pthread_cond_wait(cond, mutex);                      \
+		}                                                            \
+		                                                             \
+		return;                                                      \
+	}                                                                    \
+	                                                                     \
+	queue = self->pool->queue;                                           \
+	pthread_mutex_unlock(mutex);                                         \
+	MTP_ATOMIC_ADD(&(queue->helpers), 1, MTP_SEQ_CST);                   \
+	MTP_ATOMIC_FENCE();                                                  \
+	MTP_NEXT_JOBS(struct NAME##ThreadArgs, self, &job, 1,                \
+		done(arg) == MTP_TRUE, until, got);                          \
+	MTP_ATOMIC_SUB(&(queue->helpers), 1, MTP_SEQ_CST);                   \
+	NAME##RunJobs(self, &job, got);                                      \
+	pthread_mutex_lock(mutex);                                           \
+}                                                                            \
+	                                                                     \
+void* NAME##ThreadRoutine(void *worker)                                      \
+{                                                                            \
+	struct NAME##Worker * const self = (struct NAME##Worker *) worker;   \
+	struct NAME##ThreadPool * const pool = self->pool;                   \
+	struct NAME##ThreadArgs args[MTP_DEQUEUE_BATCH] = {{0}};             \
+	struct timespec idle;                                                \
+	struct timespec *until = NULL;                                       \
+	MTP_BOOL leaving;                                                    \
+	MTP_BOOL ok;                                                         \
+	size_t got;                                                          \
+	MTP_IF_STATS(struct timespec then;)                                  \
+	MTP_IF_STATS(struct timespec now;)                                   \
+	                                                                     \
+	pthread_setspecific(NAME##_id_key, self);                            \
+	                                                                     \
+	for (;;)                                                             \
+	{                                                                    \
+		leaving = MTP_ATOMIC_LOAD(&(self->retire), MTP_RELAXED);     \
+		                                                             \
+		if (leaving == MTP_TRUE)                                     \
+		{                                                            \
+			/* Thieves soon stop visiting a retired slot, so     \
+			 * whatever is left there is run before leaving */   \
+			MTP_DEQUE_TAKE(struct NAME##ThreadArgs, self, args,  \
+				ok);                                         \
+			                                                     \
+			if (ok == MTP_FALSE)                                 \
+			{                                                    \
+				break;                                       \
+			}                                                    \
+			                                                     \
+			got = 1;                                             \
+		}                                                            \
+		else                                                         \
+		{                                                            \
+			if ((pool->opts.scale_depth != 0)                    \
+			&& (pool->opts.scale_idle_ms != 0))                  \
+			{                                                    \
+				MTP_DEADLINE(idle,                           \
+					pool->opts.scale_idle_ms);           \
+				until = &idle;                               \
+			}                                                    \
+			                                                     \
+			MTP_STATS_CLOCK(then);                               \
+			MTP_NEXT_JOBS(struct NAME##ThreadArgs, self, args,   \
+				MTP_DEQUEUE_BATCH,                           \
+				MTP_ATOMIC_LOAD(&(self->retire),             \
+				MTP_RELAXED), until, got);                   \
+			MTP_STATS_CLOCK(now);                                \
+			MTP_STATS_IDLE(self, then, now);                     \
+		}                                                            \
+		                                                             \
+		NAME##RunJobs(self, args, got);                              \
+		                                                             \
+		/* A stop for being retired also leaves got at 0 */          \
+		if ((got == 0) && (until != NULL) && (MTP_ATOMIC_LOAD(       \
+			&(self->retire), MTP_RELAXED) == MTP_FALSE))         \
+		{                                                            \
+			NAME##RetireWorker(pool, MTP_TRUE);                  \
+		}                                                            \
+	}                                                                    \
+	                                                                     \
+	pthread_mutex_lock(&(pool->resize_mutex));                           \
+	self->exited = MTP_TRUE;                                             \
+	pthread_cond_broadcast(&(pool->retired));                            \
+	pthread_mutex_unlock(&(pool->resize_mutex));                         \
+	                                                                     \
+	return NULL;                                                         \
+}                                                                            \
+	                                                                     \
+/* Frees what a pool allocated apart from its block, then the block itself   \
+ * unless it belongs to the caller. The workers must not be running */       \
+static void NAME##FreeThreadPool(struct NAME##ThreadPool *pool)              \
+{                                                                            \
+	struct NAME##JobRing *ring;                                          \
+	size_t i;                                                            \
+	                                                                     \
+	for (i = 0; i < MTP_PRIORITY_LEVELS + pool->queue->num_nodes; i++)   \
+	{                                                                    \
+		ring = MTP_RING_AT(pool->queue, i);                          \
+		                                                             \
+		if (ring->owned == MTP_FALSE)                                \
+		{                                                            \
+			continue;                                            \
+		}                                                            \
+		                                                             \
+		if (ring->jobs != NULL)                                      \
+		{                                                            \
+			MTP_FREE(ring->jobs);                                \
+		}                                                            \
+		                                                             \
+		if (ring->seqs != NULL)                                      \
+		{                                                            \
+			MTP_FREE(ring->seqs);                                \
+		}                                                            \
+	}                                                                    \
+	                                                                     \
+	if (pool->queue->nodes != NULL)                                      \
+	{                                                                    \
+		MTP_FREE(pool->queue->nodes);                                \
+	}                                                                    \
+	                                                                     \
+	if (pool->cpu_sets != NULL)                                          \
+	{                                                                    \
+		MTP_FREE(pool->cpu_sets);                                    \
+	}                                                                    \
+	                                                                     \
+	if (pool->timers.chunks != NULL)                                     \
+	{                                                                    \
+		for (i = 0; i < pool->timers.num_chunks; i++)                \
+		{                                                            \
+			MTP_FREE(pool->timers.chunks[i]);                    \
+		}                                                            \
+		                                                             \
+		MTP_FREE(pool->timers.chunks);                               \
+	}                                                                    \
+	                                                                     \
+	MTP_NOTIFY_CLOSE(pool->notify);                                      \
+	                                                                     \
+	if (pool->block != NULL)                                             \
+	{                                                                    \
+		MTP_FREE(pool->block);                                       \
+	}                                                                    \
+}                                                                            \
+	                                                                     \
+/* Measures the part of a pool that lives in its one block: the pool, its    \
+ * workers and their deques, the queue with its priority rings and the       \
+ * workers' arenas. With a non-NULL base it also lays those out there and    \
+ * points the pool at them. Returns 0 if the size does not fit a size_t */   \
+static size_t NAME##LayOut(char *base, size_t max_threads,                   \
+	size_t max_jobs, size_t arena)                                       \
+{                                                                            \
+	struct NAME##ThreadPool *pool;                                       \
+	struct NAME##Worker *workers;                                        \
+	struct NAME##JobQueue *queue;                                        \
+	struct NAME##ThreadArgs *slots;                                      \
+	size_t *seqs;                                                        \
+	char *arenas = NULL;                                                 \
+	size_t jobs_max;                                                     \
+	size_t deque_max;                                                    \
+	size_t at = 0;                                                       \
+	size_t i;                                                            \
+	                                                                     \
+	MTP_POW2_AT_LEAST(jobs_max, max_jobs, MTP_RING_MIN);                 \
+	MTP_DEQUE_CAP(deque_max, jobs_max);                                  \
+	                                                                     \
+	MTP_CARVE(base, at, 1, sizeof(struct NAME##ThreadPool), pool);       \
+	MTP_CARVE(base, at, max_threads, sizeof(struct NAME##Worker),        \
+		workers);                                                    \
+	MTP_CARVE(base, at, 1, sizeof(struct NAME##JobQueue), queue);        \
+	                                                                     \
+	if (arena != 0)                                                      \
+	{                                                                    \
+		MTP_CARVE(base, at, max_threads, arena, arenas);             \
+	}                                                                    \
+	                                                                     \
+	if (base != NULL)                                                    \
+	{                                                                    \
+		pool->workers     = workers;                                 \
+		pool->max_threads = max_threads;                             \
+		pool->queue       = queue;                                   \
+		pool->arenas      = arenas;                                  \
+	}                                                                    \
+	                                                                     \
+	for (i = 0; i < MTP_PRIORITY_LEVELS; i++)                            \
+	{                                                                    \
+		MTP_CARVE(base, at, jobs_max,                                \
+			sizeof(struct NAME##ThreadArgs), slots);             \
+		MTP_CARVE(base, at, jobs_max * MTP_RING_SEQS,                \
+			sizeof(size_t), seqs);                               \
+		                                                             \
+		if (base != NULL)                                            \
+		{                                                            \
+			queue->rings[i].jobs      = slots;                   \
+			queue->rings[i].seqs      = (MTP_RING_SEQS != 0)     \
+				? seqs : NULL;                               \
+			queue->rings[i].jobs_max  = jobs_max;                \
+			queue->rings[i].jobs_mask = jobs_max - 1;            \
+		}                                                            \
+	}                                                                    \
+	                                                                     \
+	for (i = 0; i < max_threads; i++)                                    \
+	{                                                                    \
+		MTP_CARVE(base, at, deque_max,                               \
+			sizeof(struct NAME##ThreadArgs), slots);             \
+		                                                             \
+		if (base != NULL)                                            \
+		{                                                            \
+			MTP_DEQUE_INIT(&(workers[i]), slots, deque_max);     \
+		}                                                            \
+	}                                                                    \
+	                                                                     \
+	return (at != MTP_CARVE_FAIL) ? at : 0;                              \
+}                                                                            \
+	                                                                     \
+/* Sets up and starts a pool in 'size' bytes at 'mem', with 'block' the      \
+ * allocation for FreeThreadPool to release, NULL if the caller owns it */   \
+static struct NAME##ThreadPool* NAME##InitPool(void *mem, size_t size,       \
+	void *block, const size_t num_threads, const size_t max_jobs,        \
+	const struct mtpOptions *opts)                                       \
+{                                                                            \
+	struct NAME##ThreadPool *pool;                                       \
+	const size_t need = NAME##PoolMemoryRequired(num_threads, max_jobs,  \
+		opts);                                                       \
+	char *base;                                                          \
+	struct mtpSpin spin;                                                 \
+	pthread_condattr_t attr;                                             \
+	MTP_BOOL alloc_ok;                                                   \
+	size_t nodes = 0;                                                    \
+	size_t arena;                                                        \
+	size_t i;                                                            \
+	                                                                     \
+	if ((mem == NULL) || (need == 0) || (size < need))                   \
+	{                                                                    \
+		return NULL;                                                 \
+	}                                                                    \
+	                                                                     \
+	base = (char *) mem + (MTP_BLOCK_ALIGN                               \
+		- (size_t) mem % MTP_BLOCK_ALIGN) % MTP_BLOCK_ALIGN;         \
+	                                                                     \
+	/* Caller memory need not be zeroed the way calloc'd memory is */    \
+	if (block == NULL)                                                   \
+	{                                                                    \
+		memset(base, 0, need - (MTP_BLOCK_ALIGN - 1));               \
+	}                                                                    \
+	                                                                     \
+	pool = (struct NAME##ThreadPool *) base;                             \
+	pool->block = block;                                                 \
+	pool->notify[0] = -1;                                                \
+	pool->notify[1] = -1;                                                \
+	MTP_IF_TRACE(MTP_STAMP_CLOCK(pool->epoch);)                          \
+	                                                                     \
+	if (opts != NULL)                                                    \
+	{                                                                    \
+		pool->opts = *opts;                                          \
+	}                                                                    \
+	                                                                     \
+	arena = MTP_ROUND_UP(pool->opts.arena_size, MTP_ARENA_ALIGN);        \
+	pool->target_threads = num_threads;                                  \
+	NAME##LayOut(base, (pool->opts.max_threads > num_threads)            \
+		? pool->opts.max_threads : num_threads, max_jobs, arena);    \
+	                                                                     \
+	MTP_LOAD_PLACEMENT(pool->opts, pool->cpu_sets, pool->num_sets,       \
+		nodes, alloc_ok);                                            \
+	                                                                     \
+	/* Every budget starts at the top and works its way down */          \
+	spin.hi = (pool->opts.spin != 0)                                     \
+		? pool->opts.spin : MTP_SPIN_DEFAULT;                        \
+	spin.hi = (pool->opts.idle != MTP_IDLE_PARK) ? spin.hi : 0;          \
+	spin.lo = (pool->opts.idle == MTP_IDLE_SPIN) ? spin.hi               \
+		: (spin.hi < MTP_SPIN_MIN) ? spin.hi : MTP_SPIN_MIN;         \
+	                                                                     \
+	/* Alone on one CPU a spinner only holds up the thread it waits on,  \
+	 * and as the wait then ends with it being preempted it would seem   \
+	 * to have paid off */                                               \
+	if ((pool->opts.idle == MTP_IDLE_ADAPTIVE)                           \
+	&& (sysconf(_SC_NPROCESSORS_ONLN) < 2))                              \
+	{                                                                    \
+		spin.lo = 0;                                                 \
+		spin.hi = 0;                                                 \
+	}                                                                    \
+	                                                                     \
+	spin.budget = spin.hi;                                               \
+	                                                                     \
+	if ((alloc_ok == MTP_TRUE) && (nodes != 0))                          \
+	{                                                                    \
+		if ((pool->queue->nodes = MTP_CALLOC(nodes,                  \
+			sizeof(struct NAME##JobRing))) == NULL)              \
+		{                                                            \
+			alloc_ok = MTP_FALSE;                                \
+		}                                                            \
+		else                                                         \
+		{                                                            \
+			pool->queue->num_nodes = nodes;                      \
+		}                                                            \
+	}                                                                    \
+	                                                                     \
+	/* How many node rings there are is only known once the topology has \
+	 * been read, so they are allocated apart from the block */          \
+	for (i = 0; (alloc_ok == MTP_TRUE) && (i < pool->queue->num_nodes);  \
+		i++)                                                         \
+	{                                                                    \
+		struct NAME##JobRing * const ring                            \
+			= &(pool->queue->nodes[i]);                          \
+		                                                             \
+		ring->owned     = MTP_TRUE;                                  \
+		ring->jobs_max  = pool->queue->rings[0].jobs_max;            \
+		ring->jobs_mask = ring->jobs_max - 1;                        \
+		                                                             \
+		if (((ring->jobs = MTP_CALLOC(ring->jobs_max,                \
+			sizeof(struct NAME##ThreadArgs))) == NULL)           \
+		|| ((MTP_RING_SEQS != 0) && ((ring->seqs = MTP_CALLOC(       \
+			ring->jobs_max, sizeof(size_t))) == NULL)))          \
+		{                                                            \
+			alloc_ok = MTP_FALSE;                                \
+		}                                                            \
+	}                                                                    \
+	                                                                     \
+	if (alloc_ok == MTP_TRUE)                                            \
+	{                                                                    \
+		MTP_NOTIFY_OPEN(pool->notify, alloc_ok);                     \
+	}                                                                    \
+	                                                                     \
+	if (alloc_ok == MTP_FALSE)                                           \
+	{                                                                    \
+		pool->block = NULL;                                          \
+		NAME##FreeThreadPool(pool);                                  \
+		                                                             \
+		return NULL;                                                 \
+	}                                                                    \
+	                                                                     \
+	for (i = 0; i < MTP_PRIORITY_LEVELS + pool->queue->num_nodes; i++)   \
+	{                                                                    \
+		MTP_RING_INIT(MTP_RING_AT(pool->queue, i));                  \
+	}                                                                    \
+	                                                                     \
+	for (i = 0; i < pool->max_threads; i++)                              \
+	{                                                                    \
+		pool->workers[i].pool = pool;                                \
+		pool->workers[i].id   = (i <= INT_MAX) ? (int) i : -1;       \
+		pool->workers[i].node = (nodes != 0) ? i % nodes : 0;        \
+		pool->workers[i].seed = (unsigned int) i + 1;                \
+		pool->workers[i].arena.base = (pool->arenas != NULL)         \
+			? pool->arenas + i * arena : NULL;                   \
+		pool->workers[i].arena.size = (pool->arenas != NULL)         \
+			? arena : 0;                                         \
+		pool->workers[i].spin = spin;                                \
+	}                                                                    \
+	                                                                     \
+	pthread_cond_init(&(pool->queue->has_jobs), NULL);                   \
+	pthread_cond_init(&(pool->queue->has_room), NULL);                   \
+	pthread_cond_init(&(pool->queue->is_idle),  NULL);                   \
+	pthread_mutex_init(&(pool->queue->ring_mutex), NULL);                \
+	pthread_mutex_init(&(pool->queue->idle_mutex), NULL);                \
+	pool->queue->help = NAME##Help;                                      \
+	pthread_cond_init(&(pool->retired), NULL);                           \
+	pthread_mutex_init(&(pool->resize_mutex), NULL);                     \
+	pthread_mutex_init(&(pool->groups_mutex), NULL);                     \
+	pthread_condattr_init(&attr);                                        \
+	MTP_CONDATTR_SETCLOCK(&attr, MTP_TIMER_CLOCK);                       \
+	pthread_cond_init(&(pool->timers.changed), &attr);                   \
+	pthread_condattr_destroy(&attr);                                     \
+	pthread_mutex_init(&(pool->timers.mutex), NULL);                     \
+	pthread_once(&(NAME##_id_once), NAME##IdKeyCreate);                  \
+	                                                                     \
+	pthread_mutex_lock(&(pool->resize_mutex));                           \
+	                                                                     \
+	for (i = 0; i < num_threads; i++)                                    \
+	{                                                                    \
+		if (NAME##SpawnWorker(pool, MTP_FALSE) != MTP_SUCCESS)       \
+		{                                                            \
+			break;                                               \
+		}                                                            \
+	}                                                                    \
+	                                                                     \
+	pthread_mutex_unlock(&(pool->resize_mutex));                         \
+	                                                                     \
+	/* The workers that did start are stopped and joined again, the      \
+	 * block being the caller's to free */                               \
+	if (i < num_threads)                                                 \
+	{                                                                    \
+		pool->block = NULL;                                          \
+		NAME##CleanupThreadPool(pool);                               \
+		                                                             \
+		return NULL;                                                 \
+	}                                                                    \
+	                                                                     \
+	return pool;                                                         \
+}                                                                            \
+	                                                                     \
+struct NAME##ThreadPool* NAME##NewThreadPool(const size_t num_threads,       \
+	const size_t max_jobs)                                               \
+{                                                                            \
+	return NAME##NewThreadPoolEx(num_threads, max_jobs, NULL);           \
+}                                                                            \
+	                                                                     \
+struct NAME##ThreadPool* NAME##NewThreadPoolEx(const size_t num_threads,     \
+	const size_t max_jobs, const struct mtpOptions *opts)                \
+{                                                                            \
+	struct NAME##ThreadPool *pool;                                       \
+	const size_t size = NAME##PoolMemoryRequired(num_threads, max_jobs,  \
+		opts);                                                       \
+	void *block;                                                         \
+	                                                                     \
+	if ((size == 0) || ((block = MTP_CALLOC(1, size)) == NULL))          \
+	{                                                                    \
+		return NULL;                                                 \
+	}                                                                    \
+	                                                                     \
+	if ((pool = NAME##InitPool(block, size, block, num_threads,          \
+		max_jobs, opts)) == NULL)                                    \
+	{                                                                    \
+		MTP_FREE(block);                                             \
+	}                                                                    \
+	                                                                     \
+	return pool;                                                         \
+}                                                                            \
+	                                                                     \
+size_t NAME##PoolMemoryRequired(const size_t num_threads,                    \
+	const size_t max_jobs, const struct mtpOptions *opts)                \
+{                                                                            \
+	static const struct mtpOptions defaults;                             \
+	size_t arena;                                                        \
+	size_t size;                                                         \
+	                                                                     \
+	if (opts == NULL)                                                    \
+	{                                                                    \
+		opts = &defaults;                                            \
+	}                                                                    \
+	                                                                     \
+	arena = MTP_ROUND_UP(opts->arena_size, MTP_ARENA_ALIGN);             \
+	                                                                     \
+	if ((arena < opts->arena_size)                                       \
+	|| ((size = NAME##LayOut(NULL, (opts->max_threads > num_threads)     \
+		? opts->max_threads : num_threads, max_jobs, arena)) == 0)   \
+	|| (size > MTP_CARVE_FAIL - MTP_BLOCK_ALIGN))                        \
+	{                                                                    \
+		return 0;                                                    \
+	}                                                                    \
+	                                                                     \
+	/* Slack to align the start of memory given at any address */        \
+	return size + MTP_BLOCK_ALIGN - 1;                                   \
+}                                                                            \
+	                                                                     \
+struct NAME##ThreadPool* NAME##InitThreadPoolInPlace(void *mem, size_t size, \
+	const size_t num_threads, const size_t max_jobs,                     \
+	const struct mtpOptions *opts)                                       \
+{                                                                            \
+	return NAME##InitPool(mem, size, NULL, num_threads, max_jobs, opts); \
+}                                                                            \
+	                                                                     \
+/* Grows or shrinks the pool to num_threads workers, at least one and at     \
+ * most max_threads. Growing starts the workers before returning, shrinking  \
+ * queues a terminate job per worker too many, each retiring the highest id  \
+ * once it is reached behind the jobs queued before it */                    \
+MTP_STAT NAME##ResizeThreadPool(struct NAME##ThreadPool *pool,               \
+	size_t num_threads)                                                  \
+{                                                                            \
+	struct NAME##ThreadArgs arg = {0};                                   \
+	MTP_STAT stat = MTP_SUCCESS;                                         \
+	size_t live;                                                         \
+	                                                                     \
+	arg.terminate = MTP_TRUE;                                            \
+	                                                                     \
+	if (num_threads > pool->max_threads)                                 \
+	{                                                                    \
+		num_threads = pool->max_threads;                             \
+		stat = MTP_FULLUP;                                           \
+	}                                                                    \
+	else if (num_threads == 0)                                           \
+	{                                                                    \
+		num_threads = 1;                                             \
+	}                                                                    \
+	                                                                     \
+	pthread_mutex_lock(&(pool->resize_mutex));                           \
+	pool->target_threads = num_threads;                                  \
+	                                                                     \
+	while (MTP_LIVE_THREADS(pool) < num_threads)                         \
+	{                                                                    \
+		if (NAME##SpawnWorker(pool, MTP_TRUE) != MTP_SUCCESS)        \
+		{                                                            \
+			stat = MTP_ERRMEM;                                   \
+			                                                     \
+			break;                                               \
+		}                                                            \
+	}                                                                    \
+	                                                                     \
+	live = MTP_LIVE_THREADS(pool);                                       \
+	pthread_mutex_unlock(&(pool->resize_mutex));                         \
+	                                                                     \
+	for (; live > num_threads; live--)                                   \
+	{                                                                    \
+		MTP_ENQUEUE_JOB(struct NAME##ThreadArgs, pool->queue,        \
+			MTP_DEFAULT_RING(pool->queue), &arg);                \
+	}                                                                    \
+	                                                                     \
+	return stat;                                                         \
+}                                                                            \
+	                                                                     \
+static void NAME##TimerStop(struct NAME##ThreadPool *pool);                  \
+	                                                                     \
+void NAME##CleanupThreadPool(struct NAME##ThreadPool *pool)                  \
+{                                                                            \
+	size_t live;                                                         \
+	size_t i;                                                            \
+	struct NAME##ThreadArgs arg = {0};                                   \
+	                                                                     \
+	arg.terminate = MTP_TRUE;                                            \
+	                                                                     \
+	if (pool == NULL)                                                    \
+	{                                                                    \
+		return;                                                      \
+	}                                                                    \
+	                                                                     \
+	/* Pending timers are dropped. Jobs still being submitted by         \
+	 * running jobs would otherwise end up behind the terminate          \
+	 * signals and never be run */                                       \
+	NAME##TimerStop(pool);                                               \
+	NAME##WaitOnIdle(pool);                                              \
+	                                                                     \
+	pthread_mutex_lock(&(pool->resize_mutex));                           \
+	pool->target_threads = 0;                                            \
+	live = MTP_LIVE_THREADS(pool);                                       \
+	pthread_mutex_unlock(&(pool->resize_mutex));                         \
+	                                                                     \
+	for (i = 0; i < live; i++)                                           \
+	{                                                                    \
+		MTP_ENQUEUE_JOB(struct NAME##ThreadArgs, pool->queue,        \
+			MTP_DEFAULT_RING(pool->queue), &arg);                \
+	}                                                                    \
+	                                                                     \
+	/* Slots retired earlier may hold workers not yet joined */          \
+	for (i = 0; i < pool->max_threads; i++)                              \
+	{                                                                    \
+		if (pool->workers[i].started == MTP_TRUE)                    \
+		{                                                            \
+			pthread_join(pool->workers[i].thread, NULL);         \
+		}                                                            \
+	}                                                                    \
+	                                                                     \
+	NAME##FreeThreadPool(pool);                                          \
+	pool = NULL;                                                         \
+}                                                                            \
+	                                                                     \
+/* Snapshot of the pool's counters, see MTP_STATS_READ. Returns the number   \
+ * of worker slots, 0 without MACRO_THREAD_POOL_STATS in which case 'stats'  \
+ * is zeroed and 'workers' left alone */                                     \
+size_t NAME##GetStats(struct NAME##ThreadPool *pool, struct mtpStats *stats, \
+	struct mtpWorkerStats *workers, size_t n)                            \
+{                                                                            \
+	static const struct mtpStats none;                                   \
+	                                                                     \
+	*stats = none;                                                       \
+	MTP_STATS_READ(pool, stats, workers, n);                             \
+	                                                                     \
+	return MTP_STATS_SLOTS(pool);                                        \
+}                                                                            \
+	                                                                     \
+/* Whether a nested WaitOnIdle may return, every job still counted being     \
+ * held by it or by another such wait */                                     \
+static MTP_BOOL NAME##IdleEnough(void *queue)                                \
+{                                                                            \
+	struct NAME##JobQueue * const q = (struct NAME##JobQueue *) queue;   \
+	                                                                     \
+	return (MTP_ATOMIC_LOAD(&(q->jobs_inflight), MTP_SEQ_CST)            \
+		<= MTP_ATOMIC_LOAD(&(q->held_waiting), MTP_SEQ_CST))         \
+		? MTP_TRUE : MTP_FALSE;                                      \
+}                                                                            \
+	                                                                     \
+/* Returns once no job is queued or running. From inside a job it cannot     \
+ * wait for the jobs its worker holds, its own among them, nor for those     \
+ * held by other workers waiting likewise, so it waits for all the rest,     \
+ * running queued jobs in the meantime */                                    \
+void NAME##WaitOnIdle(struct NAME##ThreadPool *pool)                         \
+{                                                                            \
+	struct NAME##JobQueue *queue = pool->queue;                          \
+	struct NAME##Worker * const self = NAME##Self(pool);                 \
+	size_t mine = 0;                                                     \
+	                                                                     \
+	/* A nested wait only adds what an outer one has not */              \
+	if (self != NULL)                                                    \
+	{                                                                    \
+		mine = self->held - self->held_waiting;                      \
+		self->held_waiting += mine;                                  \
+		MTP_ATOMIC_ADD(&(queue->held_waiting), mine, MTP_SEQ_CST);   \
+		                                                             \
+		/* What it holds may be all another nested wait waits for */ \
+		if (mine != 0)                                               \
+		{                                                            \
+			MTP_WAKE_HELPERS(queue);                             \
+		}                                                            \
+	}                                                                    \
+	                                                                     \
+	pthread_mutex_lock(&(queue->idle_mutex));                            \
+	MTP_ATOMIC_ADD(&(queue->idle_waiters), 1, MTP_SEQ_CST);              \
+	MTP_ATOMIC_FENCE();                                                  \
+	                                                                     \
+	while (MTP_ATOMIC_LOAD(&(queue->jobs_inflight), MTP_SEQ_CST)         \
+		> ((self != NULL) ? MTP_ATOMIC_LOAD(&(queue->held_waiting),  \
+		MTP_SEQ_CST) : 0))                                           \
+	{                                                                    \
+		NAME##HelpOrWait(self, &(queue->is_idle),                    \
+			&(queue->idle_mutex), NAME##IdleEnough, queue,       \
+			NULL);                                               \
+	}                                                                    \
+	                                                                     \
+	MTP_ATOMIC_SUB(&(queue->idle_waiters), 1, MTP_SEQ_CST);              \
+	pthread_mutex_unlock(&(queue->idle_mutex));                          \
+	                                                                     \
+	if (self != NULL)                                                    \
+	{                                                                    \
+		MTP_ATOMIC_SUB(&(queue->held_waiting), mine, MTP_SEQ_CST);   \
+		self->held_waiting -= mine;                                  \
+	}                                                                    \
+}                                                                            \
+	                                                                     \
+/* A graph of jobs in which each node is enqueued as a task the moment the   \
+ * last of its predecessors has run. Nodes are named by their index, so the  \
+ * node array may move as it grows, but never while the graph runs */        \
+struct NAME##Dag* NAME##NewDag(size_t max_nodes)                             \
+{                                                                            \
+	struct NAME##Dag *dag;                                               \
+	                                                                     \
+	if ((dag = MTP_CALLOC(1, sizeof(struct NAME##Dag))) == NULL)         \
+	{                                                                    \
+		return NULL;                                                 \
+	}                                                                    \
+	                                                                     \
+	dag->max_nodes = (max_nodes != 0) ? max_nodes : 1;                   \
+	                                                                     \
+	if ((dag->nodes = MTP_CALLOC(dag->max_nodes,                         \
+		sizeof(struct NAME##DagNode))) == NULL)                      \
+	{                                                                    \
+		MTP_FREE(dag);                                               \
+		                                                             \
+		return NULL;                                                 \
+	}                                                                    \
+	                                                                     \
+	dag->checked = MTP_TRUE;                                             \
+	pthread_cond_init(&(dag->is_done), NULL);                            \
+	pthread_mutex_init(&(dag->mutex), NULL);                             \
+	                                                                     \
+	return dag;                                                          \
+}                                                                            \
+	                                                                     \
+void NAME##CleanupDag(struct NAME##Dag *dag)                                 \
+{                                                                            \
+	size_t i;                                                            \
+	                                                                     \
+	for (i = 0; i < dag->num_nodes; i++)                                 \
+	{                                                                    \
+		if (dag->nodes[i].succ != NULL)                              \
+		{                                                            \
+			MTP_FREE(dag->nodes[i].succ);                        \
+		}                                                            \
+	}                                                                    \
+	                                                                     \
+	pthread_cond_destroy(&(dag->is_done));                               \
+	pthread_mutex_destroy(&(dag->mutex));                                \
+	MTP_FREE(dag->nodes);                                                \
+	MTP_FREE(dag);                                                       \
+}                                                                            \
+	                                                                     \
+MTP_STAT NAME##DagAddNode(struct NAME##Dag *dag, ElmType in, size_t *id)     \
+{                                                                            \
+	struct NAME##DagNode *nodes;                                         \
+	size_t i;                                                            \
+	                                                                     \
+	if (dag->num_nodes == dag->max_nodes)                                \
+	{                                                                    \
+		if ((nodes = MTP_CALLOC(dag->max_nodes * 2,                  \
+			sizeof(struct NAME##DagNode))) == NULL)              \
+		{                                                            \
+			return MTP_ERRMEM;                                   \
+		}                                                            \
+		                                                             \
+		for (i = 0; i < dag->num_nodes; i++)                         \
+		{                                                            \
+			nodes[i] = dag->nodes[i];                            \
+		}                                                            \
+		                                                             \
+		MTP_FREE(dag->nodes);                                        \
+		dag->nodes = nodes;                                          \
+		dag->max_nodes *= 2;                                         \
+	}                                                                    \
+	                                                                     \
+	nodes = &(dag->nodes[dag->num_nodes]);                               \
+	nodes->payload = in;                                                 \
+	nodes->dag     = dag;                                                \
+	*id = dag->num_nodes++;                                              \
+	                                                                     \
+	return MTP_SUCCESS;                                                  \
+}                                                                            \
+	                                                                     \
+/* Makes node 'to' wait on node 'from', both being ids from DagAddNode. A    \
+ * node waiting on itself could never run, so that is refused as well */     \
+MTP_STAT NAME##DagAddEdge(struct NAME##Dag *dag, size_t from, size_t to)     \
+{                                                                            \
+	struct NAME##DagNode *node;                                          \
+	size_t *succ;                                                        \
+	size_t i;                                                            \
+	                                                                     \
+	if ((from >= dag->num_nodes) || (to >= dag->num_nodes)               \
+		|| (from == to))                                             \
+	{                                                                    \
+		return MTP_FAILURE;                                          \
+	}                                                                    \
+	                                                                     \
+	node = &(dag->nodes[from]);                                          \
+	                                                                     \
+	if (node->num_succ == node->max_succ)                                \
+	{                                                                    \
+		const size_t cap = (node->max_succ != 0)                     \
+			? node->max_succ * 2 : 2;                            \
+		                                                             \
+		if ((succ = MTP_CALLOC(cap, sizeof(size_t))) == NULL)        \
+		{                                                            \
+			return MTP_ERRMEM;                                   \
+		}                                                            \
+		                                                             \
+		for (i = 0; i < node->num_succ; i++)                         \
+		{                                                            \
+			succ[i] = node->succ[i];                             \
+		}                                                            \
+		                                                             \
+		if (node->succ != NULL)                                      \
+		{                                                            \
+			MTP_FREE(node->succ);                                \
+		}                                                            \
+		                                                             \
+		node->succ     = succ;                                       \
+		node->max_succ = cap;                                        \
+	}                                                                    \
+	                                                                     \
+	node->succ[node->num_succ++] = to;                                   \
+	dag->nodes[to].in_degree++;                                          \
+	dag->checked = MTP_FALSE;                                            \
+	                                                                     \
+	return MTP_SUCCESS;                                                  \
+}                                                                            \
+	                                                                     \
+/* Kahn's algorithm over a stack threaded through the nodes themselves, the  \
+ * graph is acyclic exactly when every node gets taken off it */             \
+static MTP_BOOL NAME##DagAcyclic(struct NAME##Dag *dag)                      \
+{                                                                            \
+	struct NAME##DagNode * const nodes = dag->nodes;                     \
+	size_t top = MTP_NO_NODE;                                            \
+	size_t seen = 0;                                                     \
+	size_t i;                                                            \
+	size_t j;                                                            \
+	                                                                     \
+	for (i = 0; i < dag->num_nodes; i++)                                 \
+	{                                                                    \
+		if ((nodes[i].pending = nodes[i].in_degree) == 0)            \
+		{                                                            \
+			nodes[i].next = top;                                 \
+			top = i;                                             \
+		}                                                            \
+	}                                                                    \
+	                                                                     \
+	while (top != MTP_NO_NODE)                                           \
+	{                                                                    \
+		i = top;                                                     \
+		top = nodes[i].next;                                         \
+		seen++;                                                      \
+		                                                             \
+		for (j = 0; j < nodes[i].num_succ; j++)                      \
+		{                                                            \
+			if (--(nodes[nodes[i].succ[j]].pending) == 0)        \
+			{                                                    \
+				nodes[nodes[i].succ[j]].next = top;          \
+				top = nodes[i].succ[j];                      \
+			}                                                    \
+		}                                                            \
+	}                                                                    \
+	                                                                     \
+	return (seen == dag->num_nodes) ? MTP_TRUE : MTP_FALSE;              \
+}                                                                            \
+	                                                                     \
+/* Runs a stack of ready nodes threaded through their next members. Every    \
+ * successor a node was the last to wait on is enqueued as a task, or pushed \
+ * onto the stack should the queue be full, so that a worker never blocks on \
+ * a queue only workers can drain. The count of nodes left only drops once   \
+ * nothing here touches the node, and the caller only hears of it under the  \
+ * lock so it cannot free the graph while the last thread still holds it */  \
+static void NAME##DagTask(void *arg);                                        \
+	                                                                     \
+static void NAME##DagDrain(struct NAME##Dag *dag, size_t top)                \
+{                                                                            \
+	struct NAME##DagNode *node;                                          \
+	size_t i;                                                            \
+	                                                                     \
+	while (top != MTP_NO_NODE)                                           \
+	{                                                                    \
+		node = &(dag->nodes[top]);                                   \
+		top  = node->next;                                           \
+		CallFunc(ThreadFunc, node->payload);                         \
+		                                                             \
+		for (i = 0; i < node->num_succ; i++)                         \
+		{                                                            \
+			struct NAME##DagNode * const succ                    \
+				= &(dag->nodes[node->succ[i]]);              \
+			                                                     \
+			if ((MTP_ATOMIC_SUB(&(succ->pending), 1,             \
+				MTP_SEQ_CST) == 1)                           \
+			&& (!NAME##TryEnqueueTask(dag->pool,                 \
+				NAME##DagTask, succ)))                       \
+			{                                                    \
+				succ->next = top;                            \
+				top = node->succ[i];                         \
+			}                                                    \
+		}                                                            \
+		                                                             \
+		/* The graph may be gone once the lock is dropped */         \
+		if (MTP_ATOMIC_SUB(&(dag->remaining), 1, MTP_SEQ_CST) == 1)  \
+		{                                                            \
+			struct NAME##ThreadPool * const pool = dag->pool;    \
+			                                                     \
+			pthread_mutex_lock(&(dag->mutex));                   \
+			MTP_ATOMIC_STORE(&(dag->done), MTP_TRUE,             \
+				MTP_SEQ_CST);                                \
+			pthread_cond_signal(&(dag->is_done));                \
+			pthread_mutex_unlock(&(dag->mutex));                 \
+			MTP_WAKE_HELPERS(pool->queue);                       \
+		}                                                            \
+	}                                                                    \
+}                                                                            \
+	                                                                     \
+static MTP_BOOL NAME##DagFinished(void *dag)                                 \
+{                                                                            \
+	return MTP_ATOMIC_LOAD(&(((struct NAME##Dag *) dag)->done),          \
+		MTP_SEQ_CST);                                                \
+}                                                                            \
+	                                                                     \
+static void NAME##DagTask(void *arg)                                         \
+{                                                                            \
+	struct NAME##DagNode * const node = (struct NAME##DagNode *) arg;    \
+	                                                                     \
+	node->next = MTP_NO_NODE;                                            \
+	NAME##DagDrain(node->dag, (size_t) (node - node->dag->nodes));       \
+}                                                                            \
+	                                                                     \
+/* Runs every node of the graph on the pool, each once all of its            \
+ * predecessors have, and returns once the last has finished. The counts are \
+ * reset on each call so a graph may be run any number of times */           \
+MTP_STAT NAME##DagRun(struct NAME##ThreadPool *pool, struct NAME##Dag *dag)  \
+{                                                                            \
+	struct NAME##Worker * const self = NAME##Self(pool);                 \
+	size_t top = MTP_NO_NODE;                                            \
+	size_t i;                                                            \
+	                                                                     \
+	if (dag->checked == MTP_FALSE)                                       \
+	{                                                                    \
+		if (NAME##DagAcyclic(dag) == MTP_FALSE)                      \
+		{                                                            \
+			return MTP_ERRCYCLE;                                 \
+		}                                                            \
+		                                                             \
+		dag->checked = MTP_TRUE;                                     \
+	}                                                                    \
+	                                                                     \
+	if (dag->num_nodes == 0)                                             \
+	{                                                                    \
+		return MTP_SUCCESS;                                          \
+	}                                                                    \
+	                                                                     \
+	/* Every count is in place before the first root can touch one */    \
+	for (i = 0; i < dag->num_nodes; i++)                                 \
+	{                                                                    \
+		dag->nodes[i].pending = dag->nodes[i].in_degree;             \
+	}                                                                    \
+	                                                                     \
+	dag->pool = pool;                                                    \
+	MTP_ATOMIC_STORE(&(dag->done), MTP_FALSE, MTP_RELAXED);              \
+	MTP_ATOMIC_STORE(&(dag->remaining), dag->num_nodes, MTP_SEQ_CST);    \
+	                                                                     \
+	/* Roots that do not fit in the queue are run by the caller */       \
+	for (i = 0; i < dag->num_nodes; i++)                                 \
+	{                                                                    \
+		if ((dag->nodes[i].in_degree == 0)                           \
+		&& (!NAME##TryEnqueueTask(pool, NAME##DagTask,               \
+			&(dag->nodes[i]))))                                  \
+		{                                                            \
+			dag->nodes[i].next = top;                            \
+			top = i;                                             \
+		}                                                            \
+	}                                                                    \
+	                                                                     \
+	NAME##DagDrain(dag, top);                                            \
+	pthread_mutex_lock(&(dag->mutex));                                   \
+	                                                                     \
+	while (MTP_ATOMIC_LOAD(&(dag->done), MTP_SEQ_CST) == MTP_FALSE)      \
+	{                                                                    \
+		NAME##HelpOrWait(self, &(dag->is_done), &(dag->mutex),       \
+			NAME##DagFinished, dag, NULL);                       \
+	}                                                                    \
+	                                                                     \
+	pthread_mutex_unlock(&(dag->mutex));                                 \
+	                                                                     \
+	return MTP_SUCCESS;                                                  \
+}                                                                            \
+	                                                                     \
+/* A group holds its queued jobs itself, in a ring of MTP_GROUP_JOBS, and    \
+ * keeps a count of those yet to finish. Whoever waits on the group takes    \
+ * and runs them, worker or not, and only them, while the pool's queue gets  \
+ * a ticket for each, room allowing, that lets a worker run the oldest job   \
+ * of any group holding one. Groups holding jobs are on the pool's list,     \
+ * under groups_mutex, so a ticket never names a group that may be gone by   \
+ * the time it runs. The thread that runs a job counts it off, the last      \
+ * taking the lock to do so, so that a waiter seeing the count at zero under \
+ * the lock may destroy the group */                                         \
+void NAME##GroupInit(struct NAME##Group *group,                              \
+	struct NAME##ThreadPool *pool)                                       \
+{                                                                            \
+	group->pool    = pool;                                               \
+	group->next    = NULL;                                               \
+	group->pprev   = NULL;                                               \
+	group->head    = 0;                                                  \
+	group->queued  = 0;                                                  \
+	group->pending = 0;                                                  \
+	group->waiters = 0;                                                  \
+	pthread_cond_init(&(group->changed), NULL);                          \
+	pthread_mutex_init(&(group->mutex), NULL);                           \
+}                                                                            \
+	                                                                     \
+/* Takes the oldest job the group holds, MTP_FALSE if it holds none. Called  \
+ * with groups_mutex held, the group leaving the list with its last job */   \
+static MTP_BOOL NAME##GroupPop(struct NAME##Group *group, ElmType *out)      \
+{                                                                            \
+	if (group->queued == 0)                                              \
+	{                                                                    \
+		return MTP_FALSE;                                            \
+	}                                                                    \
+	                                                                     \
+	*out = group->jobs[group->head];                                     \
+	group->head = (group->head + 1) % MTP_GROUP_JOBS;                    \
+	MTP_ATOMIC_STORE(&(group->queued), group->queued - 1, MTP_SEQ_CST);  \
+	                                                                     \
+	if (group->queued == 0)                                              \
+	{                                                                    \
+		*(group->pprev) = group->next;                               \
+		                                                             \
+		if (group->next != NULL)                                     \
+		{                                                            \
+			group->next->pprev = group->pprev;                   \
+		}                                                            \
+		                                                             \
+		group->next  = NULL;                                         \
+		group->pprev = NULL;                                         \
+	}                                                                    \
+	                                                                     \
+	return MTP_TRUE;                                                     \
+}                                                                            \
+	                                                                     \
+/* Counts off a job of the group once it has run, waking its waiters when it \
+ * was the last outstanding */                                               \
+static void NAME##GroupDone(struct NAME##Group *group)                       \
+{                                                                            \
+	size_t pending = MTP_ATOMIC_LOAD(&(group->pending), MTP_RELAXED);    \
+	                                                                     \
+	while (pending > 1)                                                  \
+	{                                                                    \
+		if (MTP_ATOMIC_CAS(&(group->pending), &pending,              \
+			pending - 1))                                        \
+		{                                                            \
+			return;                                              \
+		}                                                            \
+	}                                                                    \
+	                                                                     \
+	pthread_mutex_lock(&(group->mutex));                                 \
+	                                                                     \
+	if (MTP_ATOMIC_SUB(&(group->pending), 1, MTP_SEQ_CST) == 1)          \
+	{                                                                    \
+		pthread_cond_broadcast(&(group->changed));                   \
+	}                                                                    \
+	                                                                     \
+	pthread_mutex_unlock(&(group->mutex));                               \
+}                                                                            \
+	                                                                     \
+/* Queued once for every job a group takes in. Runs the oldest job of the    \
+ * first group on the list, not necessarily the one it was queued for, and   \
+ * has nothing to do if waiters have taken them all */                       \
+static void NAME##GroupTicket(void *arg)                                     \
+{                                                                            \
+	struct NAME##ThreadPool * const pool                                 \
+		= (struct NAME##ThreadPool *) arg;                           \
+	struct NAME##Group *group;                                           \
+	MTP_BOOL got = MTP_FALSE;                                            \
+	ElmType job;                                                         \
+	                                                                     \
+	pthread_mutex_lock(&(pool->groups_mutex));                           \
+	                                                                     \
+	if ((group = pool->groups) != NULL)                                  \
+	{                                                                    \
+		got = NAME##GroupPop(group, &job);                           \
+	}                                                                    \
+	                                                                     \
+	pthread_mutex_unlock(&(pool->groups_mutex));                         \
+	                                                                     \
+	if (got == MTP_TRUE)                                                 \
+	{                                                                    \
+		CallFunc(ThreadFunc, job);                                   \
+		NAME##GroupDone(group);                                      \
+	}                                                                    \
+}                                                                            \
+	                                                                     \
+/* EnqueueJob for a job counted in 'group'. MTP_SUCCESS once the group       \
+ * holds it, or MTP_RANINLINE if the group already held MTP_GROUP_JOBS and   \
+ * the caller ran it instead. Never allocates */                             \
+MTP_STAT NAME##EnqueueJobInGroup(struct NAME##Group *group, ElmType in)      \
+{                                                                            \
+	struct NAME##ThreadPool * const pool = group->pool;                  \
+	MTP_BOOL held = MTP_FALSE;                                           \
+	                                                                     \
+	MTP_ATOMIC_ADD(&(group->pending), 1, MTP_SEQ_CST);                   \
+	pthread_mutex_lock(&(pool->groups_mutex));                           \
+	                                                                     \
+	if (group->queued < MTP_GROUP_JOBS)                                  \
+	{                                                                    \
+		group->jobs[(group->head + group->queued)                    \
+			% MTP_GROUP_JOBS] = in;                              \
+		                                                             \
+		if (group->queued == 0)                                      \
+		{                                                            \
+			group->next  = pool->groups;                         \
+			group->pprev = &(pool->groups);                      \
+			                                                     \
+			if (pool->groups != NULL)                            \
+			{                                                    \
+				pool->groups->pprev = &(group->next);        \
+			}                                                    \
+			                                                     \
+			pool->groups = group;                                \
+		}                                                            \
+		                                                             \
+		MTP_ATOMIC_STORE(&(group->queued), group->queued + 1,        \
+			MTP_SEQ_CST);                                        \
+		held = MTP_TRUE;                                             \
+	}                                                                    \
+	                                                                     \
+	pthread_mutex_unlock(&(pool->groups_mutex));                         \
+	                                                                     \
+	if (held == MTP_FALSE)                                               \
+	{                                                                    \
+		CallFunc(ThreadFunc, in);                                    \
+		NAME##GroupDone(group);                                      \
+		                                                             \
+		return MTP_RANINLINE;                                        \
+	}                                                                    \
+	                                                                     \
+	/* A waiter asleep on jobs already taken has one to run now, the     \
+	 * same handshake as MTP_WAKE */                                     \
+	MTP_ATOMIC_FENCE();                                                  \
+	                                                                     \
+	if (MTP_ATOMIC_LOAD(&(group->waiters), MTP_RELAXED) != 0)            \
+	{                                                                    \
+		pthread_mutex_lock(&(group->mutex));                         \
+		pthread_cond_broadcast(&(group->changed));                   \
+		pthread_mutex_unlock(&(group->mutex));                       \
+	}                                                                    \
+	                                                                     \
+	/* No ticket on a full queue: the job then waits for GroupWait, or a \
+	 * ticket of a later job, rather than the caller waiting for room */ \
+	(void) NAME##TryEnqueueTask(pool, NAME##GroupTicket, pool);          \
+	                                                                     \
+	return MTP_SUCCESS;                                                  \
+}                                                                            \
+	                                                                     \
+/* Returns once every job enqueued in the group so far has run. The caller   \
+ * runs whatever the group still holds itself, so that it never waits behind \
+ * the rest of the pool's work, then sleeps until the jobs workers took are  \
+ * done, or it is handed another */                                          \
+void NAME##GroupWait(struct NAME##Group *group)                              \
+{                                                                            \
+	struct NAME##ThreadPool * const pool = group->pool;                  \
+	MTP_BOOL done = MTP_FALSE;                                           \
+	MTP_BOOL got;                                                        \
+	ElmType job;                                                         \
+	                                                                     \
+	while (done == MTP_FALSE)                                            \
+	{                                                                    \
+		pthread_mutex_lock(&(pool->groups_mutex));                   \
+		got = NAME##GroupPop(group, &job);                           \
+		pthread_mutex_unlock(&(pool->groups_mutex));                 \
+		                                                             \
+		if (got == MTP_TRUE)                                         \
+		{                                                            \
+			CallFunc(ThreadFunc, job);                           \
+			NAME##GroupDone(group);                              \
+			                                                     \
+			continue;                                            \
+		}                                                            \
+		                                                             \
+		pthread_mutex_lock(&(group->mutex));                         \
+		MTP_ATOMIC_ADD(&(group->waiters), 1, MTP_SEQ_CST);           \
+		MTP_ATOMIC_FENCE();                                          \
+		                                                             \
+		if ((MTP_ATOMIC_LOAD(&(group->pending), MTP_SEQ_CST) != 0)   \
+		&& (MTP_ATOMIC_LOAD(&(group->queued), MTP_SEQ_CST) == 0))    \
+		{                                                            \
+			pthread_cond_wait(&(group->changed),                 \
+				&(group->mutex));                            \
+		}                                                            \
+		                                                             \
+		MTP_ATOMIC_SUB(&(group->waiters), 1, MTP_SEQ_CST);           \
+		done = (MTP_ATOMIC_LOAD(&(group->pending), MTP_SEQ_CST)      \
+			== 0) ? MTP_TRUE : MTP_FALSE;                        \
+		pthread_mutex_unlock(&(group->mutex));                       \
+	}                                                                    \
+}                                                                            \
+	                                                                     \
+/* No job touches the group once GroupWait has seen the last of them done */ \
+void NAME##GroupDestroy(struct NAME##Group *group)                           \
+{                                                                            \
+	NAME##GroupWait(group);                                              \
+	pthread_cond_destroy(&(group->changed));                             \
+	pthread_mutex_destroy(&(group->mutex));                              \
+}                                                                            \
+	                                                                     \
+/* Ticks of MTP_TIMER_TICK_MS since the timer thread was started */          \
+static unsigned long NAME##TimerNow(struct NAME##TimerWheel *wheel)          \
+{                                                                            \
+	struct timespec now;                                                 \
+	                                                                     \
+	MTP_CLOCK_NOW(MTP_MONOTONIC, now);                                   \
+	                                                                     \
+	return (unsigned long) (((now.tv_sec - wheel->epoch.tv_sec) * 1000L  \
+		+ (now.tv_nsec - wheel->epoch.tv_nsec) / 1000000L)           \
+		/ MTP_TIMER_TICK_MS);                                        \
+}                                                                            \
+	                                                                     \
+/* Links 'timer' into the slot of the lowest level whose turn, counted from  \
+ * the wheel's current tick, reaches the timer's expiry */                   \
+static void NAME##TimerPlace(struct NAME##TimerWheel *wheel,                 \
+	struct NAME##Timer *timer)                                           \
+{                                                                            \
+	struct NAME##Timer **slot;                                           \
+	unsigned long at = timer->expires;                                   \
+	unsigned long delta;                                                 \
+	size_t level = 0;                                                    \
+	                                                                     \
+	if (at < wheel->curr)                                                \
+	{                                                                    \
+		at = wheel->curr;                                            \
+	}                                                                    \
+	else if (at - wheel->curr >= MTP_TIMER_SPAN)                         \
+	{                                                                    \
+		at = wheel->curr + MTP_TIMER_SPAN - 1;                       \
+	}                                                                    \
+	                                                                     \
+	delta = at - wheel->curr;                                            \
+	                                                                     \
+	while (delta >= (1UL << (MTP_TIMER_BITS * (level + 1))))             \
+	{                                                                    \
+		level++;                                                     \
+	}                                                                    \
+	                                                                     \
+	slot = &(wheel->slots[level][(at >> (MTP_TIMER_BITS * level))        \
+		& MTP_TIMER_MASK]);                                          \
+	timer->next  = *slot;                                                \
+	timer->pprev = slot;                                                 \
+	                                                                     \
+	if (*slot != NULL)                                                   \
+	{                                                                    \
+		(*slot)->pprev = &(timer->next);                             \
+	}                                                                    \
+	                                                                     \
+	*slot = timer;                                                       \
+}                                                                            \
+	                                                                     \
+static void NAME##TimerUnlink(struct NAME##Timer *timer)                     \
+{                                                                            \
+	*(timer->pprev) = timer->next;                                       \
+	                                                                     \
+	if (timer->next != NULL)                                             \
+	{                                                                    \
+		timer->next->pprev = timer->pprev;                           \
+	}                                                                    \
+}                                                                            \
+	                                                                     \
+/* Takes a timer off the free list, allocating another chunk of them when it \
+ * is empty. A timer's index names its chunk and its place in it */          \
+static struct NAME##Timer* NAME##TimerAlloc(struct NAME##TimerWheel *wheel)  \
+{                                                                            \
+	struct NAME##Timer **chunks;                                         \
+	struct NAME##Timer *chunk;                                           \
+	size_t max;                                                          \
+	size_t i;                                                            \
+	                                                                     \
+	if (wheel->free == NULL)                                             \
+	{                                                                    \
+		if (wheel->num_chunks == wheel->max_chunks)                  \
+		{                                                            \
+			max = (wheel->max_chunks == 0)                       \
+				? 8 : wheel->max_chunks * 2;                 \
+			                                                     \
+			if ((chunks = MTP_CALLOC(max,                        \
+				sizeof(struct NAME##Timer *))) == NULL)      \
+			{                                                    \
+				return NULL;                                 \
+			}                                                    \
+			                                                     \
+			for (i = 0; i < wheel->num_chunks; i++)              \
+			{                                                    \
+				chunks[i] = wheel->chunks[i];                \
+			}                                                    \
+			                                                     \
+			if (wheel->chunks != NULL)                           \
+			{                                                    \
+				MTP_FREE(wheel->chunks);                     \
+			}                                                    \
+			                                                     \
+			wheel->chunks     = chunks;                          \
+			wheel->max_chunks = max;                             \
+		}                                                            \
+		                                                             \
+		if ((chunk = MTP_CALLOC(MTP_TIMER_CHUNK,                     \
+			sizeof(struct NAME##Timer))) == NULL)                \
+		{                                                            \
+			return NULL;                                         \
+		}                                                            \
+		                                                             \
+		for (i = MTP_TIMER_CHUNK; i-- > 0;)                          \
+		{                                                            \
+			chunk[i].index = wheel->num_chunks                   \
+				* MTP_TIMER_CHUNK + i;                       \
+			chunk[i].next  = wheel->free;                        \
+			wheel->free    = &(chunk[i]);                        \
+		}                                                            \
+		                                                             \
+		wheel->chunks[wheel->num_chunks++] = chunk;                  \
+	}                                                                    \
+	                                                                     \
+	chunk       = wheel->free;                                           \
+	wheel->free = chunk->next;                                           \
+	                                                                     \
+	return chunk;                                                        \
+}                                                                            \
+	                                                                     \
+/* Returns a timer to the free list, staling any handle to it */             \
+static void NAME##TimerRelease(struct NAME##TimerWheel *wheel,               \
+	struct NAME##Timer *timer)                                           \
+{                                                                            \
+	timer->state = MTP_TIMER_FREE;                                       \
+	timer->seq++;                                                        \
+	timer->next  = wheel->free;                                          \
+	wheel->free  = timer;                                                \
+}                                                                            \
+	                                                                     \
+/* Moves the wheel on to tick 'now' and returns the timers that came due as  \
+ * a list. Each time a level's turn comes round the next slot of the level   \
+ * above is spilled into it, its timers placed again now that they are       \
+ * within its reach */                                                       \
+static struct NAME##Timer* NAME##TimerAdvance(                               \
+	struct NAME##TimerWheel *wheel, unsigned long now)                   \
+{                                                                            \
+	struct NAME##Timer *due = NULL;                                      \
+	struct NAME##Timer *spill;                                           \
+	struct NAME##Timer *timer;                                           \
+	struct NAME##Timer **slot;                                           \
+	size_t level;                                                        \
+	                                                                     \
+	while (wheel->curr <= now)                                           \
+	{                                                                    \
+		for (level = 1; (level < MTP_TIMER_LEVELS)                   \
+			&& (((wheel->curr >> (MTP_TIMER_BITS * (level - 1))) \
+			& MTP_TIMER_MASK) == 0); level++)                    \
+		{                                                            \
+			slot  = &(wheel->slots[level][(wheel->curr           \
+				>> (MTP_TIMER_BITS * level))                 \
+				& MTP_TIMER_MASK]);                          \
+			spill = *slot;                                       \
+			*slot = NULL;                                        \
+			                                                     \
+			while (spill != NULL)                                \
+			{                                                    \
+				timer = spill;                               \
+				spill = spill->next;                         \
+				NAME##TimerPlace(wheel, timer);              \
+			}                                                    \
+		}                                                            \
+		                                                             \
+		slot = &(wheel->slots[0][wheel->curr & MTP_TIMER_MASK]);     \
+		                                                             \
+		while (*slot != NULL)                                        \
+		{                                                            \
+			timer = *slot;                                       \
+			*slot = timer->next;                                 \
+			timer->state = MTP_TIMER_FIRING;                     \
+			timer->next  = due;                                  \
+			due = timer;                                         \
+			wheel->pending--;                                    \
+		}                                                            \
+		                                                             \
+		wheel->curr++;                                               \
+	}                                                                    \
+	                                                                     \
+	return due;                                                          \
+}                                                                            \
+	                                                                     \
+/* The tick the timer thread next has to look at the wheel, that of the next \
+ * timer in the first level's current turn or else the turn's end */         \
+static unsigned long NAME##TimerNext(struct NAME##TimerWheel *wheel)         \
+{                                                                            \
+	unsigned long tick = wheel->curr;                                    \
+	                                                                     \
+	do                                                                   \
+	{                                                                    \
+		if (wheel->slots[0][tick & MTP_TIMER_MASK] != NULL)          \
+		{                                                            \
+			break;                                               \
+		}                                                            \
+		                                                             \
+		tick++;                                                      \
+	} while ((tick & MTP_TIMER_MASK) != 0);                              \
+	                                                                     \
+	return tick;                                                         \
+}                                                                            \
+	                                                                     \
+/* Queues a due timer's job if there is room for it at once, MTP_FALSE if    \
+ * not, as the timer thread must never wait on the queue */                  \
+static MTP_BOOL NAME##TimerFire(struct NAME##ThreadPool *pool, ElmType in)   \
+{                                                                            \
+	struct NAME##Worker * const self                                     \
+		= MTP_CURRENT_WORKER(NAME##_id_key);                         \
+	struct NAME##ThreadArgs tmp = {0};                                   \
+	MTP_BOOL ok;                                                         \
+	                                                                     \
+	tmp.terminate = MTP_FALSE;                                           \
+	tmp.task      = NULL;                                                \
+	tmp.payload   = in;                                                  \
+	MTP_JOB_STAMP(tmp);                                                  \
+	                                                                     \
+	NAME##JobsQueued(pool, 1);                                           \
+	MTP_TRY_SUBMIT(struct NAME##ThreadArgs, pool, self, &tmp, ok);       \
+	                                                                     \
+	if (ok == MTP_FALSE)                                                 \
+	{                                                                    \
+		MTP_JOBS_DONE(pool->queue, 1);                               \
+	}                                                                    \
+	                                                                     \
+	return ok;                                                           \
+}                                                                            \
+	                                                                     \
+/* Enqueues the jobs of timers as they come due, without the wheel's lock    \
+ * held so that CancelTimer is held up by no more than a try at the queue. A \
+ * timer whose job finds the queue full goes back on the wheel for the next  \
+ * tick, so that one cannot stall the others, unless cancelled meanwhile. A  \
+ * periodic timer goes back once its job is queued, one period on from when  \
+ * it was due or from now if that has already passed */                      \
+static void* NAME##TimerRoutine(void *arg)                                   \
+{                                                                            \
+	struct NAME##ThreadPool * const pool = arg;                          \
+	struct NAME##TimerWheel * const wheel = &(pool->timers);             \
+	struct NAME##Timer *missed;                                          \
+	struct NAME##Timer *fired;                                           \
+	struct NAME##Timer *due;                                             \
+	struct NAME##Timer *timer;                                           \
+	struct timespec deadline;                                            \
+	unsigned long now;                                                   \
+	int state;                                                           \
+	                                                                     \
+	pthread_mutex_lock(&(wheel->mutex));                                 \
+	                                                                     \
+	while (wheel->stop == MTP_FALSE)                                     \
+	{                                                                    \
+		now = NAME##TimerNow(wheel);                                 \
+		                                                             \
+		if ((due = NAME##TimerAdvance(wheel, now)) != NULL)          \
+		{                                                            \
+			pthread_mutex_unlock(&(wheel->mutex));               \
+			missed = NULL;                                       \
+			fired  = NULL;                                       \
+			                                                     \
+			/* Only this thread links a firing timer */          \
+			while (due != NULL)                                  \
+			{                                                    \
+				timer = due;                                 \
+				due   = due->next;                           \
+				state = MTP_TIMER_FIRING;                    \
+				                                             \
+				if (!MTP_ATOMIC_CAS(&(timer->state), &state, \
+					MTP_TIMER_SUBMITTING))               \
+				{                                            \
+					timer->next = missed;                \
+					missed = timer;                      \
+				}                                            \
+				else if (NAME##TimerFire(pool,               \
+					timer->payload))                     \
+				{                                            \
+					MTP_ATOMIC_STORE(&(timer->state),    \
+						MTP_TIMER_FIRED,             \
+						MTP_SEQ_CST);                \
+					timer->next = fired;                 \
+					fired = timer;                       \
+				}                                            \
+				else                                         \
+				{                                            \
+					MTP_ATOMIC_STORE(&(timer->state),    \
+						MTP_TIMER_FIRING,            \
+						MTP_SEQ_CST);                \
+					timer->next = missed;                \
+					missed = timer;                      \
+				}                                            \
+			}                                                    \
+			                                                     \
+			pthread_mutex_lock(&(wheel->mutex));                 \
+			                                                     \
+			while (missed != NULL)                               \
+			{                                                    \
+				timer  = missed;                             \
+				missed = missed->next;                       \
+				                                             \
+				if (timer->state == MTP_TIMER_CANCELLED)     \
+				{                                            \
+					NAME##TimerRelease(wheel, timer);    \
+					                                     \
+					continue;                            \
+				}                                            \
+				                                             \
+				timer->expires = wheel->curr;                \
+				timer->state   = MTP_TIMER_ARMED;            \
+				NAME##TimerPlace(wheel, timer);              \
+				wheel->pending++;                            \
+			}                                                    \
+			                                                     \
+			while (fired != NULL)                                \
+			{                                                    \
+				timer = fired;                               \
+				fired = fired->next;                         \
+				                                             \
+				if (timer->period == 0)                      \
+				{                                            \
+					NAME##TimerRelease(wheel, timer);    \
+					                                     \
+					continue;                            \
+				}                                            \
+				                                             \
+				timer->expires += timer->period;             \
+				                                             \
+				if (timer->expires < wheel->curr)            \
+				{                                            \
+					timer->expires = wheel->curr;        \
+				}                                            \
+				                                             \
+				timer->state = MTP_TIMER_ARMED;              \
+				NAME##TimerPlace(wheel, timer);              \
+				wheel->pending++;                            \
+			}                                                    \
+		}                                                            \
+		else if (wheel->pending == 0)                                \
+		{                                                            \
+			wheel->wake = ULONG_MAX;                             \
+			pthread_cond_wait(&(wheel->changed),                 \
+				&(wheel->mutex));                            \
+		}                                                            \
+		else                                                         \
+		{                                                            \
+			wheel->wake = NAME##TimerNext(wheel);                \
+			MTP_DEADLINE_ON(MTP_TIMER_CLOCK, deadline,           \
+				(wheel->wake - now) * MTP_TIMER_TICK_MS);    \
+			pthread_cond_timedwait(&(wheel->changed),            \
+				&(wheel->mutex), &deadline);                 \
+		}                                                            \
+	}                                                                    \
+	                                                                     \
+	pthread_mutex_unlock(&(wheel->mutex));                               \
+	                                                                     \
+	return NULL;                                                         \
+}                                                                            \
+	                                                                     \
+/* Arms a timer that enqueues 'in' after 'delay_ms', and every 'period_ms'   \
+ * after that unless it is 0, starting the timer thread with the first */    \
+static MTP_STAT NAME##TimerAdd(struct NAME##ThreadPool *pool,                \
+	unsigned long delay_ms, unsigned long period_ms, ElmType in,         \
+	struct mtpTimer *handle)                                             \
+{                                                                            \
+	struct NAME##TimerWheel * const wheel = &(pool->timers);             \
+	struct NAME##Timer *timer;                                           \
+	unsigned long now;                                                   \
+	                                                                     \
+	pthread_mutex_lock(&(wheel->mutex));                                 \
+	                                                                     \
+	if (wheel->started == MTP_FALSE)                                     \
+	{                                                                    \
+		MTP_CLOCK_NOW(MTP_MONOTONIC, wheel->epoch);                  \
+		wheel->wake = ULONG_MAX;                                     \
+		                                                             \
+		if (pthread_create(&(wheel->thread), NULL,                   \
+			NAME##TimerRoutine, pool) != 0)                      \
+		{                                                            \
+			pthread_mutex_unlock(&(wheel->mutex));               \
+			                                                     \
+			return MTP_ERRMEM;                                   \
+		}                                                            \
+		                                                             \
+		wheel->started = MTP_TRUE;                                   \
+	}                                                                    \
+	                                                                     \
+	if ((timer = NAME##TimerAlloc(wheel)) == NULL)                       \
+	{                                                                    \
+		pthread_mutex_unlock(&(wheel->mutex));                       \
+		                                                             \
+		return MTP_ERRMEM;                                           \
+	}                                                                    \
+	                                                                     \
+	now = NAME##TimerNow(wheel);                                         \
+	                                                                     \
+	/* An empty wheel skips ahead instead of ticking through the gap */  \
+	if ((wheel->pending == 0) && (wheel->curr < now))                    \
+	{                                                                    \
+		wheel->curr = now;                                           \
+	}                                                                    \
+	                                                                     \
+	timer->payload = in;                                                 \
+	timer->expires = now + MTP_TIMER_TICKS(delay_ms);                    \
+	timer->period  = MTP_TIMER_TICKS(period_ms);                         \
+	timer->state   = MTP_TIMER_ARMED;                                    \
+	NAME##TimerPlace(wheel, timer);                                      \
+	wheel->pending++;                                                    \
+	                                                                     \
+	if (timer->expires < wheel->wake)                                    \
+	{                                                                    \
+		pthread_cond_signal(&(wheel->changed));                      \
+	}                                                                    \
+	                                                                     \
+	if (handle != NULL)                                                  \
+	{                                                                    \
+		handle->index = timer->index;                                \
+		handle->seq   = timer->seq;                                  \
+	}                                                                    \
+	                                                                     \
+	pthread_mutex_unlock(&(wheel->mutex));                               \
+	                                                                     \
+	return MTP_SUCCESS;                                                  \
+}                                                                            \
+	                                                                     \
+/* Stops the timer thread, if started, dropping whatever timers are left */  \
+static void NAME##TimerStop(struct NAME##ThreadPool *pool)                   \
+{                                                                            \
+	MTP_BOOL started;                                                    \
+	                                                                     \
+	pthread_mutex_lock(&(pool->timers.mutex));                           \
+	pool->timers.stop = MTP_TRUE;                                        \
+	started = pool->timers.started;                                      \
+	pthread_cond_signal(&(pool->timers.changed));                        \
+	pthread_mutex_unlock(&(pool->timers.mutex));                         \
+	                                                                     \
+	if (started == MTP_TRUE)                                             \
+	{                                                                    \
+		pthread_join(pool->timers.thread, NULL);                     \
+	}                                                                    \
+}                                                                            \
+	                                                                     \
+/* EnqueueJob 'delay_ms' from now, rounded up to whole timer ticks. If       \
+ * 'timer' is not NULL it is set to name the timer for CancelTimer. Returns  \
+ * MTP_ERRMEM if the timer or the timer thread cannot be had */              \
+MTP_STAT NAME##EnqueueJobAfter(struct NAME##ThreadPool *pool,                \
+	unsigned long delay_ms, ElmType in, struct mtpTimer *timer)          \
+{                                                                            \
+	return NAME##TimerAdd(pool, delay_ms, 0, in, timer);                 \
+}                                                                            \
+	                                                                     \
+/* EnqueueJobAfter that keeps enqueueing 'in' every 'period_ms', at least    \
+ * one tick, until cancelled. A run missed while the queue was full is not   \
+ * made up, the next following one period after the late one */              \
+MTP_STAT NAME##EnqueueJobEvery(struct NAME##ThreadPool *pool,                \
+	unsigned long period_ms, ElmType in, struct mtpTimer *timer)         \
+{                                                                            \
+	if (period_ms < MTP_TIMER_TICK_MS)                                   \
+	{                                                                    \
+		period_ms = MTP_TIMER_TICK_MS;                               \
+	}                                                                    \
+	                                                                     \
+	return NAME##TimerAdd(pool, period_ms, period_ms, in, timer);        \
+}                                                                            \
+	                                                                     \
+/* Disarms a timer in constant time. Returns MTP_TRUE if that kept its job,  \
+ * or a periodic timer's further jobs, from being enqueued, MTP_FALSE if the \
+ * timer had already fired or been cancelled */                              \
+MTP_BOOL NAME##CancelTimer(struct NAME##ThreadPool *pool,                    \
+	struct mtpTimer timer)                                               \
+{                                                                            \
+	struct NAME##TimerWheel * const wheel = &(pool->timers);             \
+	struct NAME##Timer *node = NULL;                                     \
+	MTP_BOOL cancelled = MTP_FALSE;                                      \
+	int state = MTP_TIMER_FREE;                                          \
+	                                                                     \
+	pthread_mutex_lock(&(wheel->mutex));                                 \
+	                                                                     \
+	if (timer.index / MTP_TIMER_CHUNK < wheel->num_chunks)               \
+	{                                                                    \
+		node = &(wheel->chunks[timer.index / MTP_TIMER_CHUNK]        \
+			[timer.index % MTP_TIMER_CHUNK]);                    \
+	}                                                                    \
+	                                                                     \
+	/* A stale handle's seq is behind that of the timer it named */      \
+	if ((node != NULL) && (node->seq == timer.seq))                      \
+	{                                                                    \
+		state = MTP_ATOMIC_LOAD(&(node->state), MTP_RELAXED);        \
+	}                                                                    \
+	                                                                     \
+	if (state == MTP_TIMER_ARMED)                                        \
+	{                                                                    \
+		NAME##TimerUnlink(node);                                     \
+		wheel->pending--;                                            \
+		NAME##TimerRelease(wheel, node);                             \
+		cancelled = MTP_TRUE;                                        \
+	}                                                                    \
+	else if ((state != MTP_TIMER_FREE)                                   \
+		&& (state != MTP_TIMER_CANCELLED))                           \
+	{                                                                    \
+		/* Due, so the timer thread releases it. Only waits out its  \
+		 * try at the queue, which never blocks, to learn whether    \
+		 * the job went in */                                        \
+		state = MTP_TIMER_FIRING;                                    \
+		                                                             \
+		while ((!MTP_ATOMIC_CAS(&(node->state), &state,              \
+			MTP_TIMER_CANCELLED))                                \
+			&& (state == MTP_TIMER_SUBMITTING))                  \
+		{                                                            \
+			sched_yield();                                       \
+			state = MTP_TIMER_FIRING;                            \
+		}                                                            \
+		                                                             \
+		if (state == MTP_TIMER_FIRING)                               \
+		{                                                            \
+			cancelled = MTP_TRUE;                                \
+		}                                                            \
+		else if ((state == MTP_TIMER_FIRED) && (node->period != 0))  \
+		{                                                            \
+			node->period = 0;                                    \
+			cancelled = MTP_TRUE;                                \
+		}                                                            \
+	}                                                                    \
+	                                                                     \
+	pthread_mutex_unlock(&(wheel->mutex));                               \
+	                                                                     \
+	return cancelled;                                                    \
+}                                                                            \
+	                                                                     \
+/* Runs the job then pushes it onto the pool's list of finished ones. The    \
+ * descriptor is only signalled when the list was empty, a reader yet to     \
+ * drain a longer one having been woken already. 'done' may be reused        \
+ * once it is on the list, so nothing is read from it after */               \
+static void NAME##CompletionTask(void *arg)                                  \
+{                                                                            \
+	struct NAME##Completion * const done = arg;                          \
+	struct NAME##ThreadPool * const pool = done->pool;                   \
+	struct NAME##Completion *head;                                       \
+	                                                                     \
+	CallFunc(ThreadFunc, done->payload);                                 \
+	head = MTP_ATOMIC_LOAD(&(pool->done), MTP_RELAXED);                  \
+	                                                                     \
+	do                                                                   \
+	{                                                                    \
+		done->next = head;                                           \
+	}                                                                    \
+	while (!MTP_ATOMIC_CAS(&(pool->done), &head, done));                 \
+	                                                                     \
+	if (head == NULL)                                                    \
+	{                                                                    \
+		MTP_NOTIFY_SIGNAL(pool->notify);                             \
+	}                                                                    \
+}                                                                            \
+	                                                                     \
+/* EnqueueJob that, once the job has run, queues 'done' for                  \
+ * DrainCompletions with the payload as the job left it. 'done' belongs to   \
+ * the caller and must not be touched again until it has been drained */     \
+void NAME##EnqueueJobNotify(struct NAME##ThreadPool *pool, ElmType in,       \
+	struct NAME##Completion *done)                                       \
+{                                                                            \
+	done->payload = in;                                                  \
+	done->pool    = pool;                                                \
+	done->next    = NULL;                                                \
+	NAME##EnqueueTask(pool, NAME##CompletionTask, done);                 \
+}                                                                            \
+	                                                                     \
+/* Takes every completion so far in one go, oldest first and linked          \
+ * through next, or NULL if there are none. The descriptor is cleared before \
+ * the list is taken so that a completion racing in after leaves it set */   \
+struct NAME##Completion* NAME##DrainCompletions(                             \
+	struct NAME##ThreadPool *pool)                                       \
+{                                                                            \
+	struct NAME##Completion *head;                                       \
+	struct NAME##Completion *next;                                       \
+	struct NAME##Completion *prev = NULL;                                \
+	                                                                     \
+	MTP_NOTIFY_CLEAR(pool->notify);                                      \
+	head = MTP_ATOMIC_LOAD(&(pool->done), MTP_RELAXED);                  \
+	                                                                     \
+	while ((head != NULL)                                                \
+	&& (!MTP_ATOMIC_CAS(&(pool->done), &head, NULL)))                    \
+	{                                                                    \
+	}                                                                    \
+	                                                                     \
+	/* Pushed newest first */                                            \
+	while (head != NULL)                                                 \
+	{                                                                    \
+		next       = head->next;                                     \
+		head->next = prev;                                           \
+		prev       = head;                                           \
+		head       = next;                                           \
+	}                                                                    \
+	                                                                     \
+	return prev;                                                         \
+}                                                                            \
+	                                                                     \
+/* The descriptor to poll for readability, -1 without                        \
+ * MACRO_THREAD_POOL_COMPLETIONS in which case DrainCompletions still works  \
+ * but must be polled */                                                     \
+int NAME##CompletionFd(struct NAME##ThreadPool *pool)                        \
+{                                                                            \
+	return pool->notify[0];                                              \
+}                                                                            \
+	                                                                     \
+/* The jobs each worker slot has kept, as Chrome trace-event JSON that       \
+ * chrome://tracing and Perfetto load, see MTP_TRACE_DUMP. Only there under  \
+ * MACRO_THREAD_POOL_TRACE */                                                \
+MTP_TRACE_DEFINITIONS(NAME)                                                  \
+	                                                                     \
+enum {NAME##_MTP_DEFINITIONS_DUMMY = 0}
+
+/* ----------------------------- MIND THE GAP ----------------------------- */
+
+/* FUNC takes its payload by value, void FUNC(TYPE) */
+#define MACRO_THREAD_POOL_DEFINITIONS(NAME, TYPE, FUNC) \
+MTP_POOL_DEFINITIONS(NAME, TYPE, FUNC, MTP_CALL_BY_VALUE)
+
+#define MACRO_THREAD_POOL_COMPLETE(NAME, TYPE, FUNC) \
+MACRO_THREAD_POOL_PROTOTYPES(NAME, TYPE); \
+MACRO_THREAD_POOL_DEFINITIONS(NAME, TYPE, FUNC); \
+enum {NAME##_MTP_COMPLETE_DUMMY = 0}
+
+/* FUNC is handed a pointer to the job's payload, void FUNC(const TYPE *) */
+#define MACRO_THREAD_POOL_POINTER_DEFINITIONS(NAME, TYPE, FUNC) \
+MTP_POOL_DEFINITIONS(NAME, TYPE, FUNC, MTP_CALL_BY_POINTER)
+
+#define MACRO_THREAD_POOL_POINTER_COMPLETE(NAME, TYPE, FUNC) \
+MACRO_THREAD_POOL_PROTOTYPES(NAME, TYPE); \
+MACRO_THREAD_POOL_POINTER_DEFINITIONS(NAME, TYPE, FUNC); \
+enum {NAME##_MTP_POINTER_COMPLETE_DUMMY = 0}
+
+/* ----------------------------- MIND THE GAP ----------------------------- */
+
+/* Parallel for over [begin, end) on an existing pool, generates the function
+ * NAME##LOOP which splits the range into chunks of 'grain' iterations and
+ * calls BodyFunc(lo, hi, ctx) on each, with the calling thread taking part.
+ * Needs only the prototypes of pool NAME and may be used more than once */
+#define MACRO_THREAD_POOL_PARALLEL_FOR(NAME, LOOP, CtxType, BodyFunc)        \
+	                                                                     \
+struct NAME##LOOP##Loop                                                      \
+{                                                                            \
+	CtxType *ctx;                                                        \
+	size_t begin;                                                        \
+	size_t len;                                                          \
+	size_t grain;                                                        \
+	size_t parts;                                                        \
+	size_t next;                                                         \
+	size_t done;                                                         \
+	size_t refs;                                                         \
+	MTP_SCHEDULE schedule;                                               \
+	pthread_cond_t is_done;                                              \
+	pthread_mutex_t mutex;                                               \
+};                                                                           \
+	                                                                     \
+static void NAME##LOOP##Release(struct NAME##LOOP##Loop *loop)               \
+{                                                                            \
+	if (MTP_ATOMIC_SUB(&(loop->refs), 1, MTP_SEQ_CST) == 1)              \
+	{                                                                    \
+		pthread_cond_destroy(&(loop->is_done));                      \
+		pthread_mutex_destroy(&(loop->mutex));                       \
+		MTP_FREE(loop);                                              \
+	}                                                                    \
+}                                                                            \
+	                                                                     \
+/* Static loops hand out whole slots, a slot being every parts'th chunk of   \
+ * 'grain' iterations. The others hand out single chunks off a shared        \
+ * cursor, guided chunks shrinking along with the remaining range */         \
+static void NAME##LOOP##Work(struct NAME##LOOP##Loop *loop)                  \
+{                                                                            \
+	const size_t len = loop->len;                                        \
+	size_t ran = 0;                                                      \
+	size_t lo;                                                           \
+	size_t hi;                                                           \
+	                                                                     \
+	if (loop->schedule == MTP_SCHED_STATIC)                              \
+	{                                                                    \
+		const size_t grain  = loop->grain;                           \
+		const size_t stride = loop->parts * grain;                   \
+		size_t slot;                                                 \
+		                                                             \
+		while ((slot = MTP_ATOMIC_ADD(&(loop->next), 1,              \
+			MTP_RELAXED)) < loop->parts)                         \
+		{                                                            \
+			for (lo = slot * grain; lo < len; lo += stride)      \
+			{                                                    \
+				hi = (len - lo > grain) ? lo + grain : len;  \
+				BodyFunc(loop->begin + lo, loop->begin + hi, \
+					loop->ctx);                          \
+				ran += hi - lo;                              \
+				                                             \
+				if (len - lo <= stride)                      \
+				{                                            \
+					break;                               \
+				}                                            \
+			}                                                    \
+		}                                                            \
+	}                                                                    \
+	else                                                                 \
+	{                                                                    \
+		lo = MTP_ATOMIC_LOAD(&(loop->next), MTP_RELAXED);            \
+		                                                             \
+		while (lo < len)                                             \
+		{                                                            \
+			size_t chunk = loop->grain;                          \
+			                                                     \
+			if ((loop->schedule == MTP_SCHED_GUIDED)             \
+			&& ((len - lo) / (2 * loop->parts) > chunk))         \
+			{                                                    \
+				chunk = (len - lo) / (2 * loop->parts);      \
+			}                                                    \
+			                                                     \
+			hi = (len - lo > chunk) ? lo + chunk : len;          \
+			                                                     \
+			if (MTP_ATOMIC_CAS(&(loop->next), &lo, hi))          \
+			{                                                    \
+				BodyFunc(loop->begin + lo, loop->begin + hi, \
+					loop->ctx);                          \
+				ran += hi - lo;                              \
+				lo = hi;                                     \
+			}                                                    \
+		}                                                            \
+	}                                                                    \
+	                                                                     \
+	/* Whoever completes the range wakes the caller, the lock ensures    \
+	 * the caller is either yet to check the count or already asleep */  \
+	if ((ran != 0)                                                       \
+	&& (MTP_ATOMIC_ADD(&(loop->done), ran, MTP_SEQ_CST) + ran == len))   \
+	{                                                                    \
+		pthread_mutex_lock(&(loop->mutex));                          \
+		pthread_cond_signal(&(loop->is_done));                       \
+		pthread_mutex_unlock(&(loop->mutex));                        \
+	}                                                                    \
+}                                                                            \
+	                                                                     \
+static void NAME##LOOP##Helper(void *loop)                                   \
+{                                                                            \
+	NAME##LOOP##Work((struct NAME##LOOP##Loop *) loop);                  \
+	NAME##LOOP##Release((struct NAME##LOOP##Loop *) loop);               \
+}                                                                            \
+	                                                                     \
+void NAME##LOOP(struct NAME##ThreadPool *pool, const size_t begin,           \
+	const size_t end, const size_t grain, const MTP_SCHEDULE schedule,   \
+	CtxType *ctx)                                                        \
+{                                                                            \
+	struct NAME##LOOP##Loop *loop;                                       \
+	size_t chunks;                                                       \
+	size_t helpers;                                                      \
+	size_t i;                                                            \
+	                                                                     \
+	if (end <= begin)                                                    \
+	{                                                                    \
+		return;                                                      \
+	}                                                                    \
+	                                                                     \
+	/* A helper slow to be dequeued may outlive this call so the loop is \
+	 * on the heap, failing that the caller runs every iteration */      \
+	if ((loop = MTP_CALLOC(1, sizeof(struct NAME##LOOP##Loop))) == NULL) \
+	{                                                                    \
+		BodyFunc(begin, end, ctx);                                   \
+		                                                             \
+		return;                                                      \
+	}                                                                    \
+	                                                                     \
+	loop->ctx      = ctx;                                                \
+	loop->begin    = begin;                                              \
+	loop->len      = end - begin;                                        \
+	loop->parts    = MTP_LIVE_THREADS(pool) + 1;                         \
+	loop->schedule = schedule;                                           \
+	loop->grain    = (grain != 0) ? grain                                \
+		: (schedule == MTP_SCHED_STATIC)                             \
+		? (loop->len - 1) / loop->parts + 1 : 1;                     \
+	                                                                     \
+	if (loop->grain > loop->len)                                         \
+	{                                                                    \
+		loop->grain = loop->len;                                     \
+	}                                                                    \
+	                                                                     \
+	chunks  = (loop->len - 1) / loop->grain + 1;                         \
+	helpers = (chunks < loop->parts) ? chunks - 1 : loop->parts - 1;     \
+	loop->refs = helpers + 1;                                            \
+	pthread_cond_init(&(loop->is_done), NULL);                           \
+	pthread_mutex_init(&(loop->mutex), NULL);                            \
+	                                                                     \
+	/* Helpers are only an offer of help, a full queue must not stall    \
+	 * a loop run from inside a worker so unsent ones are written off */ \
+	for (i = 0; i < helpers; i++)                                        \
+	{                                                                    \
+		if (!NAME##TryEnqueueTask(pool, NAME##LOOP##Helper, loop))   \
+		{                                                            \
+			MTP_ATOMIC_SUB(&(loop->refs), helpers - i,           \
+				MTP_SEQ_CST);                                \
+			                                                     \
+			break;                                               \
+		}                                                            \
+	}                                                                    \
+	                                                                     \
+	NAME##LOOP##Work(loop);                                              \
+	pthread_mutex_lock(&(loop->mutex));                                  \
+	                                                                     \
+	while (MTP_ATOMIC_LOAD(&(loop->done), MTP_ACQUIRE) != loop->len)     \
+	{                                                                    \
+		pthread_cond_wait(&(loop->is_done), &(loop->mutex));         \
+	}                                                                    \
+	                                                                     \
+	pthread_mutex_unlock(&(loop->mutex));                                \
+	NAME##LOOP##Release(loop);                                           \
+}                                                                            \
+	                                                                     \
+enum {NAME##LOOP##_MTP_PARALLEL_FOR_DUMMY = 0}
+
+/* ----------------------------- MIND THE GAP ----------------------------- */
+
+/* Futures variant, FUNC returns a result of type RTYPE which is handed back
+ * through the future that NAME##Submit returns. Builds an ordinary pool named
+ * NAME##Task underneath whose jobs carry the payload and the future, futures
+ * come out of a slab owned by the NAME##FuturePool */
+#define MACRO_THREAD_POOL_FUTURE_PROTOTYPES(NAME, ElmType, ResType)          \
+	                                                                     \
+struct NAME##Future                                                          \
+{                                                                            \
+	ResType result;                                                      \
+	MTP_BOOL done;                                                       \
+	struct NAME##FuturePool *owner;                                      \
+	struct NAME##Future *next;                                           \
+};                                                                           \
+	                                                                     \
+struct NAME##FutureJob                                                       \
+{                                                                            \
+	ElmType payload;                                                     \
+	struct NAME##Future *future;                                         \
+};                                                                           \
+	                                                                     \
+MACRO_THREAD_POOL_PROTOTYPES(NAME##Task, struct NAME##FutureJob);            \
+	                                                                     \
+struct NAME##FuturePool                                                      \
+{                                                                            \
+	struct NAME##TaskThreadPool *tasks;                                  \
+	struct NAME##Future *slab;                                           \
+	struct NAME##Future *free_list;                                      \
+	size_t waiters;                                                      \
+	pthread_cond_t is_done;                                              \
+	pthread_mutex_t slab_mutex;                                          \
+	pthread_mutex_t done_mutex;                                          \
+};                                                                           \
+	                                                                     \
+struct NAME##FuturePool* NAME##NewFuturePool(const size_t num_threads,       \
+	const size_t max_jobs, const size_t max_futures);                    \
+void NAME##CleanupFuturePool(struct NAME##FuturePool *pool);                 \
+struct NAME##Future* NAME##Submit(struct NAME##FuturePool *pool,             \
+	ElmType in);                                                         \
+MTP_BOOL NAME##FutureReady(struct NAME##Future *future);                     \
+ResType NAME##FutureGet(struct NAME##Future *future);                        \
+void NAME##FutureRelease(struct NAME##Future *future);                       \
+/* Futures of different FuturePools may be mixed, WaitAll then waiting on    \
+ * each in turn and WaitAny on each pool in turn a millisecond at a time */  \
+void NAME##WaitAll(struct NAME##Future * const *futures, const size_t n);    \
+size_t NAME##WaitAny(struct NAME##Future * const *futures, const size_t n);  \
+	                                                                     \
+enum {NAME##_MTP_FUTURE_PROTOTYPE_DUMMY = 0}
+
+/* ----------------------------- MIND THE GAP ----------------------------- */
+
+#define MACRO_THREAD_POOL_FUTURE_DEFINITIONS(NAME, ElmType, ResType,         \
+	ThreadFunc)                                                          \
+	                                                                     \
+static void NAME##FutureRun(struct NAME##FutureJob job);                     \
+	                                                                     \
+MACRO_THREAD_POOL_DEFINITIONS(NAME##Task, struct NAME##FutureJob,            \
+	NAME##FutureRun);                                                    \
+	                                                                     \
+/* The result is written before 'done' is released, the owner's condition is \
+ * only touched if a waiter has announced itself, the fence in               \
+ * MTP_WAKE_HELPERS serving both. Workers waiting from inside a job are      \
+ * parked as helpers on the queue instead */                                 \
+static void NAME##FutureRun(struct NAME##FutureJob job)                      \
+{                                                                            \
+	struct NAME##FuturePool * const owner = job.future->owner;           \
+	                                                                     \
+	job.future->result = ThreadFunc(job.payload);                        \
+	MTP_ATOMIC_STORE(&(job.future->done), MTP_TRUE, MTP_RELEASE);        \
+	MTP_WAKE_HELPERS(owner->tasks->queue);                               \
+	                                                                     \
+	if (MTP_ATOMIC_LOAD(&(owner->waiters), MTP_RELAXED) != 0)            \
+	{                                                                    \
+		pthread_mutex_lock(&(owner->done_mutex));                    \
+		pthread_cond_broadcast(&(owner->is_done));                   \
+		pthread_mutex_unlock(&(owner->done_mutex));                  \
+	}                                                                    \
+}                                                                            \
+	                                                                     \
+/* Index of the first future whose state differs from 'done', or 'n' if      \
+ * there is none. Waiting on all is then a search for one not yet done and   \
+ * waiting on any a search for one that is */                                \
+static size_t NAME##FutureScan(struct NAME##Future * const *futures,         \
+	const size_t n, const MTP_BOOL done)                                 \
+{                                                                            \
+	size_t i;                                                            \
+	                                                                     \
+	for (i = 0; i < n; i++)                                              \
+	{                                                                    \
+		if (MTP_ATOMIC_LOAD(&(futures[i]->done), MTP_ACQUIRE)        \
+			!= done)                                             \
+		{                                                            \
+			break;                                               \
+		}                                                            \
+	}                                                                    \
+	                                                                     \
+	return i;                                                            \
+}                                                                            \
+	                                                                     \
+/* What a FutureAwait waits for, as HelpOrWait's test sees it */             \
+struct NAME##FutureWait                                                      \
+{                                                                            \
+	struct NAME##Future * const *futures;                                \
+	size_t n;                                                            \
+	MTP_BOOL all;                                                        \
+};                                                                           \
+	                                                                     \
+static MTP_BOOL NAME##FuturesFinished(void *wait)                            \
+{                                                                            \
+	const struct NAME##FutureWait * const w                              \
+		= (const struct NAME##FutureWait *) wait;                    \
+	                                                                     \
+	return ((NAME##FutureScan(w->futures, w->n, w->all) == w->n)         \
+		== w->all) ? MTP_TRUE : MTP_FALSE;                           \
+}                                                                            \
+	                                                                     \
+/* From inside a job of the owner's pool the caller runs queued jobs rather  \
+ * than sleep, those it waits for likely among them. Only one owner's        \
+ * condition can be slept on, so futures of mixed owners are waited on one   \
+ * at a time when all are wanted, and when any will do each owner's is slept \
+ * on in turn for a millisecond at a time until one is done */               \
+static size_t NAME##FutureAwait(struct NAME##Future * const *futures,        \
+	const size_t n, const MTP_BOOL all)                                  \
+{                                                                            \
+	struct NAME##FuturePool *owner;                                      \
+	struct NAME##TaskWorker *self;                                       \
+	struct NAME##FutureWait wait;                                        \
+	struct timespec until;                                               \
+	struct timespec *turn;                                               \
+	size_t hit = NAME##FutureScan(futures, n, all);                      \
+	size_t i;                                                            \
+	                                                                     \
+	if ((n == 0) || ((hit == n) == all))                                 \
+	{                                                                    \
+		return hit;                                                  \
+	}                                                                    \
+	                                                                     \
+	owner = futures[0]->owner;                                           \
+	                                                                     \
+	i = 1;                                                               \
+	                                                                     \
+	while ((i < n) && (futures[i]->owner == owner))                      \
+	{                                                                    \
+		i++;                                                         \
+	}                                                                    \
+	                                                                     \
+	if ((i < n) && (all == MTP_TRUE))                                    \
+	{                                                                    \
+		for (i = hit; i < n; i++)                                    \
+		{                                                            \
+			(void) NAME##FutureAwait(&(futures[i]), 1, all);     \
+		}                                                            \
+		                                                             \
+		return n;                                                    \
+	}                                                                    \
+	                                                                     \
+	wait.futures = futures;                                              \
+	wait.n       = n;                                                    \
+	wait.all     = all;                                                  \
+	turn         = (i < n) ? &until : NULL;                              \
+	i            = 0;                                                    \
+	                                                                     \
+	do                                                                   \
+	{                                                                    \
+		owner = futures[i]->owner;                                   \
+		self  = NAME##TaskSelf(owner->tasks);                        \
+		i     = (i + 1) % n;                                         \
+		                                                             \
+		if (turn != NULL)                                            \
+		{                                                            \
+			MTP_DEADLINE(until, 1);                              \
+		}                                                            \
+		                                                             \
+		pthread_mutex_lock(&(owner->done_mutex));                    \
+		MTP_ATOMIC_ADD(&(owner->waiters), 1, MTP_SEQ_CST);           \
+		MTP_ATOMIC_FENCE();                                          \
+		                                                             \
+		if (NAME##FuturesFinished(&wait) == MTP_FALSE)               \
+		{                                                            \
+			NAME##TaskHelpOrWait(self, &(owner->is_done),        \
+				&(owner->done_mutex), NAME##FuturesFinished, \
+				&wait, turn);                                \
+		}                                                            \
+		                                                             \
+		MTP_ATOMIC_SUB(&(owner->waiters), 1, MTP_SEQ_CST);           \
+		pthread_mutex_unlock(&(owner->done_mutex));                  \
+	}                                                                    \
+	while (((hit = NAME##FutureScan(futures, n, all)) == n) != all);     \
+	                                                                     \
+	return hit;                                                          \
+}                                                                            \
+	                                                                     \
+struct NAME##FuturePool* NAME##NewFuturePool(const size_t num_threads,       \
+	const size_t max_jobs, const size_t max_futures)                     \
+{                                                                            \
+	struct NAME##FuturePool *pool = NULL;                                \
+	size_t i;                                                            \
+	                                                                     \
+	if ((pool = MTP_CALLOC(1, sizeof(struct NAME##FuturePool))) == NULL) \
+	{                                                                    \
+		return NULL;                                                 \
+	}                                                                    \
+	                                                                     \
+	if ((max_futures == 0)                                               \
+	|| ((pool->slab = MTP_CALLOC(max_futures,                            \
+		sizeof(struct NAME##Future))) == NULL))                      \
+	{                                                                    \
+		MTP_FREE(pool);                                              \
+		                                                             \
+		return NULL;                                                 \
+	}                                                                    \
+	                                                                     \
+	for (i = 0; i < max_futures; i++)                                    \
+	{                                                                    \
+		pool->slab[i].owner = pool;                                  \
+		pool->slab[i].next  = (i + 1 < max_futures)                  \
+			? &(pool->slab[i + 1]) : NULL;                       \
+	}                                                                    \
+	                                                                     \
+	pool->free_list = pool->slab;                                        \
+	pthread_cond_init(&(pool->is_done), NULL);                           \
+	pthread_mutex_init(&(pool->slab_mutex), NULL);                       \
+	pthread_mutex_init(&(pool->done_mutex), NULL);                       \
+	                                                                     \
+	if ((pool->tasks = NAME##TaskNewThreadPool(num_threads, max_jobs))   \
+		== NULL)                                                     \
+	{                                                                    \
+		NAME##CleanupFuturePool(pool);                               \
+		                                                             \
+		return NULL;                                                 \
+	}                                                                    \
+	                                                                     \
+	return pool;                                                         \
+}                                                                            \
+	                                                                     \
+void NAME##CleanupFuturePool(struct NAME##FuturePool *pool)                  \
+{                                                                            \
+	if (pool == NULL)                                                    \
+	{                                                                    \
+		return;                                                      \
+	}                                                                    \
 	                                                                     \
-	while (((queue)->read_curs == (queue)->write_curs)                   \
-	&& ((queue)->jobs_waiting != 0))                                     \
+	if (pool->tasks != NULL)                                             \
 	{                                                                    \
-		pthread_cond_wait(&((queue)->has_room),                      \
-			&((queue)->ring_mutex));                             \
+		NAME##TaskCleanupThreadPool(pool->tasks);                    \
 	}                                                                    \
 	                                                                     \
-	((type *) (queue)->jobs)[(queue)->write_curs++] = *((type *) in);    \
-	(queue)->write_curs %= (queue)->jobs_max;                            \
-	(queue)->jobs_waiting++;                                             \
+	pthread_cond_destroy(&(pool->is_done));                              \
+	pthread_mutex_destroy(&(pool->slab_mutex));                          \
+	pthread_mutex_destroy(&(pool->done_mutex));                          \
+	MTP_FREE(pool->slab);                                                \
+	MTP_FREE(pool);                                                      \
+}                                                                            \
 	                                                                     \
-	pthread_cond_broadcast(&((queue)->has_jobs));                        \
-	pthread_mutex_unlock(&((queue)->ring_mutex));                        \
-} while (0)
-
-#define MTP_DEQUEUE_JOB(type, queue, out)                                    \
-do                                                                           \
+struct NAME##Future* NAME##Submit(struct NAME##FuturePool *pool,             \
+	ElmType in)                                                          \
 {                                                                            \
-	pthread_mutex_lock(&((queue)->ring_mutex));                          \
+	struct NAME##Future *future;                                         \
+	struct NAME##FutureJob job;                                          \
+	                                                                     \
+	pthread_mutex_lock(&(pool->slab_mutex));                             \
 	                                                                     \
-	while ((queue)->jobs_waiting == 0)                                   \
+	if ((future = pool->free_list) != NULL)                              \
 	{                                                                    \
-		pthread_cond_wait(&((queue)->has_jobs),                      \
-			&((queue)->ring_mutex));                             \
+		pool->free_list = future->next;                              \
 	}                                                                    \
 	                                                                     \
-	*((type *) out) = ((type *) (queue)->jobs)[(queue)->read_curs++];    \
-	(queue)->read_curs %= (queue)->jobs_max;                             \
-	(queue)->jobs_waiting--;                                             \
-	pthread_cond_broadcast(&((queue)->has_room));                        \
+	pthread_mutex_unlock(&(pool->slab_mutex));                           \
 	                                                                     \
-	if ((queue)->jobs_waiting == 0)                                      \
+	if (future == NULL)                                                  \
 	{                                                                    \
-		pthread_cond_broadcast(&((queue)->is_empty));                \
+		return NULL;                                                 \
 	}                                                                    \
 	                                                                     \
-	pthread_mutex_unlock(&((queue)->ring_mutex));                        \
-} while (0)
-
-/* ----------------------------- MIND THE GAP ----------------------------- */
-
-#define MACRO_THREAD_POOL_PROTOTYPES(NAME, ElmType)                          \
-                                                                             \
-struct NAME##ThreadArgs                                                      \
-{                                                                            \
-	MTP_BOOL terminate;                                                  \
-	ElmType payload;                                                     \
-};                                                                           \
-                                                                             \
-struct NAME##JobQueue                                                        \
-{                                                                            \
-	struct NAME##ThreadArgs *jobs;                                       \
-	size_t  jobs_max;                                                    \
-	size_t  jobs_waiting;                                                \
-	size_t  jobs_working;                                                \
-	size_t  write_curs;                                                  \
-	size_t  read_curs;                                                   \
-	pthread_cond_t has_jobs;                                             \
-	pthread_cond_t has_room;                                             \
-	pthread_cond_t is_empty;                                             \
-	pthread_cond_t is_idle;                                              \
-	pthread_mutex_t ring_mutex;                                          \
-	pthread_mutex_t work_mutex;                                          \
-};                                                                           \
-                                                                             \
-struct NAME##ThreadPool                                                      \
-{                                                                            \
-	pthread_t *threads;                                                  \
-	size_t num_threads;                                                  \
-	struct NAME##JobQueue *queue;                                        \
-};                                                                           \
-                                                                             \
-void NAME##EnqueueJob(struct NAME##ThreadPool *pool, ElmType in);            \
-void* NAME##ThreadRoutine(void *queue);                                      \
-struct NAME##ThreadPool* NAME##NewThreadPool(const size_t num_threads,       \
-	const size_t max_jobs);                                              \
-void NAME##CleanupThreadPool(struct NAME##ThreadPool *pool);                 \
-void NAME##WaitOnIdle(struct NAME##ThreadPool *pool);                        \
-                                                                             \
-enum {MTP_PROTOTYPE_DUMMY = 0}
-
-/* ----------------------------- MIND THE GAP ----------------------------- */
-
-#define MACRO_THREAD_POOL_DEFINITIONS(NAME, ElmType, ThreadFunc)             \
-                                                                             \
-static pthread_once_t NAME##_id_once = PTHREAD_ONCE_INIT;                    \
-static pthread_key_t NAME##_id_key;                                          \
-                                                                             \
-static void NAME##IdDestroy(void *key)                                       \
-{                                                                            \
-	MTP_FREE(key);                                                       \
+	future->done = MTP_FALSE;                                            \
+	future->next = NULL;                                                 \
+	job.payload  = in;                                                   \
+	job.future   = future;                                               \
+	NAME##TaskEnqueueJob(pool->tasks, job);                              \
+	                                                                     \
+	return future;                                                       \
 }                                                                            \
-                                                                             \
-static void NAME##IdKeyCreate(void)                                          \
+	                                                                     \
+MTP_BOOL NAME##FutureReady(struct NAME##Future *future)                      \
 {                                                                            \
-	pthread_key_create(&(NAME##_id_key), NAME##IdDestroy);               \
+	return MTP_ATOMIC_LOAD(&(future->done), MTP_ACQUIRE);                \
 }                                                                            \
-                                                                             \
-static void NAME##IdCreate(void)                                             \
+	                                                                     \
+ResType NAME##FutureGet(struct NAME##Future *future)                         \
 {                                                                            \
-	static pthread_mutex_t inc_mutex = PTHREAD_MUTEX_INITIALIZER;        \
-	static volatile unsigned int runner = 0;                             \
-	signed int *thread_id = MTP_CALLOC(1, sizeof(signed int));           \
+	NAME##FutureAwait(&future, 1, MTP_TRUE);                             \
 	                                                                     \
-	pthread_mutex_lock(&(inc_mutex));                                    \
-	*thread_id = (runner <= INT_MAX) ? (signed int) runner++ : -1;       \
-	pthread_mutex_unlock(&(inc_mutex));                                  \
-	pthread_once(&(NAME##_id_once), NAME##IdKeyCreate);                  \
-	pthread_setspecific(NAME##_id_key, thread_id);                       \
+	return future->result;                                               \
 }                                                                            \
-                                                                             \
-int NAME##GetThreadId(void)                                                  \
+	                                                                     \
+void NAME##FutureRelease(struct NAME##Future *future)                        \
 {                                                                            \
-	int * const ret = pthread_getspecific(NAME##_id_key);                \
+	struct NAME##FuturePool * const owner = future->owner;               \
 	                                                                     \
-	return (ret != NULL) ? (*ret) : (-1);                                \
+	NAME##FutureAwait(&future, 1, MTP_TRUE);                             \
+	pthread_mutex_lock(&(owner->slab_mutex));                            \
+	future->next = owner->free_list;                                     \
+	owner->free_list = future;                                           \
+	pthread_mutex_unlock(&(owner->slab_mutex));                          \
 }                                                                            \
-                                                                             \
-void NAME##EnqueueJob(struct NAME##ThreadPool *pool, ElmType in)             \
+	                                                                     \
+void NAME##WaitAll(struct NAME##Future * const *futures, const size_t n)     \
 {                                                                            \
-	struct NAME##ThreadArgs tmp;                                         \
+	NAME##FutureAwait(futures, n, MTP_TRUE);                             \
+}                                                                            \
 	                                                                     \
-	tmp.terminate = MTP_FALSE;                                           \
-	tmp.payload   = in;                                                  \
-                                                                             \
-	MTP_ENQUEUE_JOB(struct NAME##ThreadArgs, pool->queue, &tmp);         \
+size_t NAME##WaitAny(struct NAME##Future * const *futures, const size_t n)   \
+{                                                                            \
+	return NAME##FutureAwait(futures, n, MTP_FALSE);                     \
 }                                                                            \
-                                                                             \
-void* NAME##ThreadRoutine(void *queue)                                       \
+	                                                                     \
+enum {NAME##_MTP_FUTURE_DEFINITIONS_DUMMY = 0}
+
+/* ----------------------------- MIND THE GAP ----------------------------- */
+
+#define MACRO_THREAD_POOL_FUTURE_COMPLETE(NAME, TYPE, RTYPE, FUNC) \
+MACRO_THREAD_POOL_FUTURE_PROTOTYPES(NAME, TYPE, RTYPE); \
+MACRO_THREAD_POOL_FUTURE_DEFINITIONS(NAME, TYPE, RTYPE, FUNC); \
+enum {NAME##_MTP_FUTURE_COMPLETE_DUMMY = 0}
+
+/* ----------------------------- MIND THE GAP ----------------------------- */
+
+/* Whether the item numbered 'seq' lies beyond the window of pipeline 'line'
+ * once 'done' items have been retired. An unordered sink retires items out of
+ * turn, so done may already have passed a number not yet admitted, which
+ * counts as inside */
+#define MTP_PIPE_OUTSIDE(line, seq, done)                                    \
+	(((seq) - (done) >= (line)->window)                                  \
+	&& ((seq) - (done) <= ((size_t) -1) / 2))
+
+/* Takes the next sequence number of pipeline 'line' into 'seq', waiting for
+ * the item it numbers to fit the window. Waiters announce themselves as with
+ * MTP_WAKE so MTP_PIPE_RETIRE only takes the lock when someone is asleep */
+#define MTP_PIPE_ADMIT(line, seq)                                            \
+do                                                                           \
 {                                                                            \
-	struct NAME##ThreadArgs args = {0};                                  \
+	size_t mtp_done;                                                     \
 	                                                                     \
-	NAME##IdCreate();                                                    \
+	(seq)    = MTP_ATOMIC_ADD(&((line)->issued), 1, MTP_RELAXED);        \
+	mtp_done = MTP_ATOMIC_LOAD(&((line)->retired), MTP_ACQUIRE);         \
 	                                                                     \
-	for (;;)                                                             \
+	if (((line)->window != 0) && MTP_PIPE_OUTSIDE(line, seq, mtp_done))  \
 	{                                                                    \
-		struct NAME##JobQueue * const tmp                            \
-			= (struct NAME##JobQueue *) queue;                   \
+		pthread_mutex_lock(&((line)->mutex));                        \
+		(line)->stalls++;                                            \
+		MTP_ATOMIC_ADD(&((line)->waiters), 1, MTP_SEQ_CST);          \
+		MTP_ATOMIC_FENCE();                                          \
+		mtp_done = MTP_ATOMIC_LOAD(&((line)->retired), MTP_ACQUIRE); \
 		                                                             \
-		MTP_DEQUEUE_JOB(struct NAME##ThreadArgs, tmp, &args);        \
+		while (MTP_PIPE_OUTSIDE(line, seq, mtp_done))                \
+		{                                                            \
+			pthread_cond_wait(&((line)->changed),                \
+				&((line)->mutex));                           \
+			mtp_done = MTP_ATOMIC_LOAD(&((line)->retired),       \
+				MTP_ACQUIRE);                                \
+		}                                                            \
 		                                                             \
-		if (args.terminate == MTP_TRUE)                              \
+		MTP_ATOMIC_SUB(&((line)->waiters), 1, MTP_SEQ_CST);          \
+		pthread_mutex_unlock(&((line)->mutex));                      \
+	}                                                                    \
+} while (0)
+
+/* Counts 'n' items as having left pipeline 'line', waking Push callers held
+ * back by the window and PipelineWait callers */
+#define MTP_PIPE_RETIRE(line, n)                                             \
+do                                                                           \
+{                                                                            \
+	MTP_ATOMIC_ADD(&((line)->retired), (n), MTP_SEQ_CST);                \
+	MTP_ATOMIC_FENCE();                                                  \
+	                                                                     \
+	if (MTP_ATOMIC_LOAD(&((line)->waiters), MTP_RELAXED) != 0)           \
+	{                                                                    \
+		pthread_mutex_lock(&((line)->mutex));                        \
+		pthread_cond_broadcast(&((line)->changed));                  \
+		pthread_mutex_unlock(&((line)->mutex));                      \
+	}                                                                    \
+} while (0)
+
+/* What a slot of an ordered sink's reorder buffer holds */
+#define MTP_PIPE_EMPTY 0
+#define MTP_PIPE_ITEM  1
+#define MTP_PIPE_HOLE  2
+
+/* Pipelines are declared from the sink back to the first stage, as each
+ * stage hands its output to the one named after it. The sink ends the
+ * pipeline and owns what its stages share, calling SinkFunc, void
+ * SinkFunc(ElmType), on every item that reaches it from whichever worker
+ * brought it. Ordered sinks hold items that arrive early in a reorder buffer
+ * of window slots, keyed by sequence number, and pass them on one at a time
+ * in the order they were pushed, others call SinkFunc as items come in and
+ * possibly from several threads at once */
+#define MACRO_THREAD_POOL_SINK_PROTOTYPES(NAME, ElmType)                     \
+	                                                                     \
+struct NAME##Stage                                                           \
+{                                                                            \
+	struct mtpPipeline *line;                                            \
+	struct mtpPipeline control;                                          \
+	ElmType *slots;                                                      \
+	unsigned char *state;                                                \
+	size_t mask;                                                         \
+	size_t next;                                                         \
+	size_t held;                                                         \
+	MTP_BOOL ordered;                                                    \
+	MTP_BOOL draining;                                                   \
+	pthread_mutex_t mutex;                                               \
+};                                                                           \
+	                                                                     \
+struct NAME##Stage* NAME##NewSink(const size_t window,                       \
+	const MTP_BOOL ordered);                                             \
+void NAME##CleanupSink(struct NAME##Stage *sink);                            \
+void NAME##StagePut(struct NAME##Stage *sink, size_t seq, ElmType in);       \
+void NAME##PipelineWait(struct NAME##Stage *sink);                           \
+size_t NAME##PipelineStats(struct NAME##Stage *sink,                         \
+	struct mtpStageStats *stats, size_t n);                              \
+	                                                                     \
+enum {NAME##_MTP_SINK_PROTOTYPE_DUMMY = 0}
+
+/* ----------------------------- MIND THE GAP ----------------------------- */
+
+#define MACRO_THREAD_POOL_SINK_DEFINITIONS(NAME, ElmType, SinkFunc)          \
+	                                                                     \
+/* Hands over the item numbered 'seq', or a hole where it was dropped if     \
+ * 'in' is NULL. Whoever fills the slot the sink is waiting on drains every  \
+ * slot ready from there on, outside the lock, while the others only leave   \
+ * their item behind. A slot is emptied before the window moves past it so   \
+ * an admitted item always finds its own slot free */                        \
+static void NAME##SinkPut(struct NAME##Stage *sink, size_t seq,              \
+	const ElmType *in)                                                   \
+{                                                                            \
+	ElmType item;                                                        \
+	size_t slot;                                                         \
+	unsigned char state;                                                 \
+	                                                                     \
+	if (sink->ordered == MTP_FALSE)                                      \
+	{                                                                    \
+		if (in != NULL)                                              \
 		{                                                            \
-			pthread_exit(0);                                     \
+			SinkFunc(*in);                                       \
 		}                                                            \
 		                                                             \
-		pthread_mutex_lock(&(tmp->work_mutex));                      \
-		tmp->jobs_working++;                                         \
-		pthread_mutex_unlock(&(tmp->work_mutex));                    \
+		MTP_PIPE_RETIRE(sink->line, 1);                              \
 		                                                             \
-		ThreadFunc(args.payload);                                    \
+		return;                                                      \
+	}                                                                    \
+	                                                                     \
+	slot = seq & sink->mask;                                             \
+	pthread_mutex_lock(&(sink->mutex));                                  \
+	                                                                     \
+	if (in != NULL)                                                      \
+	{                                                                    \
+		sink->slots[slot] = *in;                                     \
+	}                                                                    \
+	                                                                     \
+	sink->state[slot] = (in != NULL) ? MTP_PIPE_ITEM : MTP_PIPE_HOLE;    \
+	sink->held++;                                                        \
+	                                                                     \
+	if (sink->draining == MTP_TRUE)                                      \
+	{                                                                    \
+		pthread_mutex_unlock(&(sink->mutex));                        \
 		                                                             \
-		pthread_mutex_lock(&(tmp->work_mutex));                      \
-		tmp->jobs_working--;                                         \
+		return;                                                      \
+	}                                                                    \
+	                                                                     \
+	sink->draining = MTP_TRUE;                                           \
+	                                                                     \
+	while ((state = sink->state[slot = sink->next & sink->mask])         \
+		!= MTP_PIPE_EMPTY)                                           \
+	{                                                                    \
+		item = sink->slots[slot];                                    \
+		sink->state[slot] = MTP_PIPE_EMPTY;                          \
+		sink->held--;                                                \
+		sink->next++;                                                \
+		pthread_mutex_unlock(&(sink->mutex));                        \
 		                                                             \
-		if (tmp->jobs_working == 0)                                  \
+		if (state == MTP_PIPE_ITEM)                                  \
 		{                                                            \
-			pthread_cond_broadcast(&(tmp->is_idle));             \
+			SinkFunc(item);                                      \
 		}                                                            \
 		                                                             \
-		pthread_mutex_unlock(&(tmp->work_mutex));                    \
+		MTP_PIPE_RETIRE(sink->line, 1);                              \
+		pthread_mutex_lock(&(sink->mutex));                          \
 	}                                                                    \
+	                                                                     \
+	sink->draining = MTP_FALSE;                                          \
+	pthread_mutex_unlock(&(sink->mutex));                                \
 }                                                                            \
-                                                                             \
-struct NAME##ThreadPool* NAME##NewThreadPool(const size_t num_threads,       \
-	const size_t max_jobs)                                               \
+	                                                                     \
+static void NAME##SinkSkip(void *sink, size_t seq)                           \
 {                                                                            \
-	struct NAME##ThreadPool *pool = NULL;                                \
-	size_t i;                                                            \
+	NAME##SinkPut((struct NAME##Stage *) sink, seq, NULL);               \
+}                                                                            \
+	                                                                     \
+void NAME##StagePut(struct NAME##Stage *sink, size_t seq, ElmType in)        \
+{                                                                            \
+	NAME##SinkPut(sink, seq, &in);                                       \
+}                                                                            \
+	                                                                     \
+/* An ordered sink needs a window to size its reorder buffer by */           \
+struct NAME##Stage* NAME##NewSink(const size_t window,                       \
+	const MTP_BOOL ordered)                                              \
+{                                                                            \
+	struct NAME##Stage *sink;                                            \
+	size_t cap = 0;                                                      \
 	                                                                     \
-	if ((pool = MTP_CALLOC(1, sizeof(struct NAME##ThreadPool))) == NULL) \
+	if ((ordered == MTP_TRUE) && (window == 0))                          \
 	{                                                                    \
 		return NULL;                                                 \
 	}                                                                    \
 	                                                                     \
-	if ((pool->threads = MTP_CALLOC(num_threads, sizeof(pthread_t)))     \
-		== NULL)                                                     \
+	if ((sink = MTP_CALLOC(1, sizeof(struct NAME##Stage))) == NULL)      \
 	{                                                                    \
-		MTP_FREE(pool);                                              \
-		                                                             \
 		return NULL;                                                 \
 	}                                                                    \
 	                                                                     \
-	if ((pool->queue = MTP_CALLOC(1, sizeof(struct NAME##JobQueue)))     \
-		== NULL)                                                     \
+	if (ordered == MTP_TRUE)                                             \
 	{                                                                    \
-		MTP_FREE(pool->threads);                                     \
-		MTP_FREE(pool);                                              \
+		MTP_POW2_AT_LEAST(cap, window, 1);                           \
 		                                                             \
-		return NULL;                                                 \
+		if (((sink->slots = MTP_CALLOC(cap, sizeof(ElmType)))        \
+			== NULL)                                             \
+		|| ((sink->state = MTP_CALLOC(cap, 1)) == NULL))             \
+		{                                                            \
+			MTP_FREE(sink->slots);                               \
+			MTP_FREE(sink);                                      \
+			                                                     \
+			return NULL;                                         \
+		}                                                            \
+		                                                             \
+		sink->mask = cap - 1;                                        \
 	}                                                                    \
 	                                                                     \
-	if ((pool->queue->jobs = MTP_CALLOC(max_jobs,                        \
-		sizeof(struct NAME##ThreadArgs))) == NULL)                   \
+	sink->line           = &(sink->control);                             \
+	sink->ordered        = ordered;                                      \
+	sink->control.window = window;                                       \
+	sink->control.sink   = sink;                                         \
+	sink->control.skip   = NAME##SinkSkip;                               \
+	pthread_cond_init(&(sink->control.changed), NULL);                   \
+	pthread_mutex_init(&(sink->control.mutex), NULL);                    \
+	pthread_mutex_init(&(sink->mutex), NULL);                            \
+	                                                                     \
+	return sink;                                                         \
+}                                                                            \
+	                                                                     \
+/* Every stage feeding the sink must have been cleaned up first */           \
+void NAME##CleanupSink(struct NAME##Stage *sink)                             \
+{                                                                            \
+	if (sink == NULL)                                                    \
 	{                                                                    \
-		MTP_FREE(pool->queue);                                       \
-		MTP_FREE(pool->threads);                                     \
-		MTP_FREE(pool);                                              \
+		return;                                                      \
+	}                                                                    \
+	                                                                     \
+	pthread_cond_destroy(&(sink->control.changed));                      \
+	pthread_mutex_destroy(&(sink->control.mutex));                       \
+	pthread_mutex_destroy(&(sink->mutex));                               \
+	MTP_FREE(sink->slots);                                               \
+	MTP_FREE(sink->state);                                               \
+	MTP_FREE(sink);                                                      \
+}                                                                            \
+	                                                                     \
+/* Waits until every item pushed so far has reached the sink or been         \
+ * dropped along the way */                                                  \
+void NAME##PipelineWait(struct NAME##Stage *sink)                            \
+{                                                                            \
+	struct mtpPipeline * const line = sink->line;                        \
+	                                                                     \
+	pthread_mutex_lock(&(line->mutex));                                  \
+	MTP_ATOMIC_ADD(&(line->waiters), 1, MTP_SEQ_CST);                    \
+	MTP_ATOMIC_FENCE();                                                  \
+	                                                                     \
+	while (MTP_ATOMIC_LOAD(&(line->retired), MTP_ACQUIRE)                \
+		!= MTP_ATOMIC_LOAD(&(line->issued), MTP_ACQUIRE))            \
+	{                                                                    \
+		pthread_cond_wait(&(line->changed), &(line->mutex));         \
+	}                                                                    \
+	                                                                     \
+	MTP_ATOMIC_SUB(&(line->waiters), 1, MTP_SEQ_CST);                    \
+	pthread_mutex_unlock(&(line->mutex));                                \
+}                                                                            \
+	                                                                     \
+/* Fills the first 'n' entries of 'stats' with the stages from first to      \
+ * last and then the sink, returning how many entries there are in all */    \
+size_t NAME##PipelineStats(struct NAME##Stage *sink,                         \
+	struct mtpStageStats *stats, size_t n)                               \
+{                                                                            \
+	struct mtpPipeline * const line = sink->line;                        \
+	struct mtpPipeStage *entry;                                          \
+	size_t count = 0;                                                    \
+	                                                                     \
+	pthread_mutex_lock(&(line->mutex));                                  \
+	                                                                     \
+	for (entry = line->stages; entry != NULL; entry = entry->next)       \
+	{                                                                    \
+		if (count < n)                                               \
+		{                                                            \
+			entry->stats(entry->stage, &(stats[count]));         \
+		}                                                            \
 		                                                             \
-		return NULL;                                                 \
+		count++;                                                     \
 	}                                                                    \
 	                                                                     \
-	pool->queue->jobs_max = max_jobs;                                    \
-	pthread_cond_init(&(pool->queue->has_jobs), NULL);                   \
-	pthread_cond_init(&(pool->queue->has_room), NULL);                   \
-	pthread_cond_init(&(pool->queue->is_empty), NULL);                   \
-	pthread_cond_init(&(pool->queue->is_idle),  NULL);                   \
-	pthread_mutex_init(&(pool->queue->ring_mutex), NULL);                \
-	pthread_mutex_init(&(pool->queue->work_mutex), NULL);                \
+	if (count < n)                                                       \
+	{                                                                    \
+		stats[count].name     = #NAME;                               \
+		stats[count].threads  = 0;                                   \
+		stats[count].capacity = line->window;                        \
+		stats[count].stalls   = line->stalls;                        \
+		stats[count].done     = (unsigned long)                      \
+			MTP_ATOMIC_LOAD(&(line->retired), MTP_RELAXED);      \
+		pthread_mutex_lock(&(sink->mutex));                          \
+		stats[count].running  = sink->draining;                      \
+		stats[count].queued   = sink->held;                          \
+		pthread_mutex_unlock(&(sink->mutex));                        \
+	}                                                                    \
 	                                                                     \
-	for (i = 0; i < num_threads; i++)                                    \
+	pthread_mutex_unlock(&(line->mutex));                                \
+	                                                                     \
+	return count + 1;                                                    \
+}                                                                            \
+	                                                                     \
+enum {NAME##_MTP_SINK_DEFINITIONS_DUMMY = 0}
+
+/* ----------------------------- MIND THE GAP ----------------------------- */
+
+#define MACRO_THREAD_POOL_SINK_COMPLETE(NAME, TYPE, FUNC) \
+MACRO_THREAD_POOL_SINK_PROTOTYPES(NAME, TYPE); \
+MACRO_THREAD_POOL_SINK_DEFINITIONS(NAME, TYPE, FUNC); \
+enum {NAME##_MTP_SINK_COMPLETE_DUMMY = 0}
+
+/* ----------------------------- MIND THE GAP ----------------------------- */
+
+/* A pipeline stage taking items of type ElmType and handing its output to
+ * NEXT, another stage or the sink, whose prototypes must come first. Builds
+ * an ordinary pool named NAME##Pipe underneath, so every stage has workers
+ * and a bounded ring of its own, and a stage whose ring is full holds up the
+ * workers of the stage before it rather than letting work pile up */
+#define MACRO_THREAD_POOL_STAGE_PROTOTYPES(NAME, ElmType, NEXT)              \
+	                                                                     \
+struct NAME##PipeJob                                                         \
+{                                                                            \
+	ElmType payload;                                                     \
+	size_t seq;                                                          \
+	struct NAME##Stage *stage;                                           \
+};                                                                           \
+	                                                                     \
+MACRO_THREAD_POOL_PROTOTYPES(NAME##Pipe, struct NAME##PipeJob);              \
+	                                                                     \
+struct NAME##Stage                                                           \
+{                                                                            \
+	struct mtpPipeline *line;                                            \
+	struct NEXT##Stage *next;                                            \
+	struct NAME##PipeThreadPool *pool;                                   \
+	struct mtpPipeStage entry;                                           \
+	size_t running;                                                      \
+	unsigned long done;                                                  \
+	unsigned long stalls;                                                \
+};                                                                           \
+	                                                                     \
+struct NAME##Stage* NAME##NewStage(struct NEXT##Stage *next,                 \
+	const size_t num_threads, const size_t max_jobs);                    \
+void NAME##CleanupStage(struct NAME##Stage *stage);                          \
+void NAME##Push(struct NAME##Stage *stage, ElmType in);                      \
+void NAME##StagePut(struct NAME##Stage *stage, size_t seq, ElmType in);      \
+void NAME##StageStats(struct NAME##Stage *stage,                             \
+	struct mtpStageStats *stats);                                        \
+	                                                                     \
+enum {NAME##_MTP_STAGE_PROTOTYPE_DUMMY = 0}
+
+/* ----------------------------- MIND THE GAP ----------------------------- */
+
+/* StageFunc, MTP_BOOL StageFunc(ElmType, OutType *), writes its result for
+ * NEXT through the pointer, or returns MTP_FALSE to drop the item */
+#define MACRO_THREAD_POOL_STAGE_DEFINITIONS(NAME, ElmType, NEXT, OutType,    \
+	StageFunc)                                                           \
+	                                                                     \
+static void NAME##StageRun(struct NAME##PipeJob job);                        \
+	                                                                     \
+MACRO_THREAD_POOL_DEFINITIONS(NAME##Pipe, struct NAME##PipeJob,              \
+	NAME##StageRun);                                                     \
+	                                                                     \
+/* A dropped item goes straight to the sink as a hole so an ordered sink     \
+ * does not wait on it. running includes the time spent handing a result to  \
+ * NEXT, which is where a stage held up by the one after it shows */         \
+static void NAME##StageRun(struct NAME##PipeJob job)                         \
+{                                                                            \
+	struct NAME##Stage * const stage = job.stage;                        \
+	OutType out;                                                         \
+	                                                                     \
+	MTP_BOOL keep;                                                       \
+	                                                                     \
+	MTP_ATOMIC_ADD(&(stage->running), 1, MTP_RELAXED);                   \
+	keep = StageFunc(job.payload, &out);                                 \
+	MTP_ATOMIC_ADD(&(stage->done), 1, MTP_RELAXED);                      \
+	                                                                     \
+	if (keep)                                                            \
+	{                                                                    \
+		NEXT##StagePut(stage->next, job.seq, out);                   \
+	}                                                                    \
+	else                                                                 \
 	{                                                                    \
-		pthread_create(&pool->threads[i], NULL, NAME##ThreadRoutine, \
-			pool->queue);                                        \
+		stage->line->skip(stage->line->sink, job.seq);               \
 	}                                                                    \
 	                                                                     \
-	pool->num_threads = num_threads;                                     \
+	MTP_ATOMIC_SUB(&(stage->running), 1, MTP_RELAXED);                   \
+}                                                                            \
 	                                                                     \
-	return pool;                                                         \
+static void NAME##StageStatsEntry(void *stage, struct mtpStageStats *stats)  \
+{                                                                            \
+	NAME##StageStats((struct NAME##Stage *) stage, stats);               \
 }                                                                            \
-                                                                             \
-void NAME##CleanupThreadPool(struct NAME##ThreadPool *pool)                  \
+	                                                                     \
+/* The pipeline is shared with NEXT, which must outlive the stage */         \
+struct NAME##Stage* NAME##NewStage(struct NEXT##Stage *next,                 \
+	const size_t num_threads, const size_t max_jobs)                     \
 {                                                                            \
-	size_t i;                                                            \
-	struct NAME##ThreadArgs arg = {0};                                   \
+	struct NAME##Stage *stage;                                           \
 	                                                                     \
-	arg.terminate = MTP_TRUE;                                            \
+	if ((stage = MTP_CALLOC(1, sizeof(struct NAME##Stage))) == NULL)     \
+	{                                                                    \
+		return NULL;                                                 \
+	}                                                                    \
 	                                                                     \
-	if (pool == NULL)                                                    \
+	if ((stage->pool = NAME##PipeNewThreadPool(num_threads, max_jobs))   \
+		== NULL)                                                     \
 	{                                                                    \
-		return;                                                      \
+		MTP_FREE(stage);                                             \
+		                                                             \
+		return NULL;                                                 \
 	}                                                                    \
 	                                                                     \
-	if (pool->threads != NULL)                                           \
+	stage->line        = next->line;                                     \
+	stage->next        = next;                                           \
+	stage->entry.stage = stage;                                          \
+	stage->entry.stats = NAME##StageStatsEntry;                          \
+	                                                                     \
+	/* Stages are made from the sink back, so the list runs first to     \
+	 * last */                                                           \
+	pthread_mutex_lock(&(stage->line->mutex));                           \
+	stage->entry.next   = stage->line->stages;                           \
+	stage->line->stages = &(stage->entry);                               \
+	pthread_mutex_unlock(&(stage->line->mutex));                         \
+	                                                                     \
+	return stage;                                                        \
+}                                                                            \
+	                                                                     \
+/* Runs whatever the stage still holds into NEXT, so stages are cleaned up   \
+ * from the first on, and takes the stage out of the pipeline */             \
+void NAME##CleanupStage(struct NAME##Stage *stage)                           \
+{                                                                            \
+	struct mtpPipeStage **link;                                          \
+	                                                                     \
+	if (stage == NULL)                                                   \
 	{                                                                    \
-		if ((pool->queue != NULL)                                    \
-		&& (pool->queue->jobs != NULL))                              \
-		{                                                            \
-			for (i = 0; i < pool->num_threads; i++)              \
-			{                                                    \
-				MTP_ENQUEUE_JOB(struct NAME##ThreadArgs,     \
-					pool->queue, &arg);                  \
-			}                                                    \
-									     \
-			for (i = 0; i < pool->num_threads; i++)              \
-			{                                                    \
-				pthread_join(pool->threads[i], NULL);        \
-			}                                                    \
-		}                                                            \
-								             \
-		MTP_FREE(pool->threads);                                     \
+		return;                                                      \
 	}                                                                    \
-								             \
-	if (pool->queue != NULL)                                             \
+	                                                                     \
+	NAME##PipeCleanupThreadPool(stage->pool);                            \
+	pthread_mutex_lock(&(stage->line->mutex));                           \
+	                                                                     \
+	for (link = &(stage->line->stages); *link != NULL;                   \
+		link = &((*link)->next))                                     \
 	{                                                                    \
-		if (pool->queue->jobs != NULL)                               \
+		if (*link == &(stage->entry))                                \
 		{                                                            \
-			MTP_FREE(pool->queue->jobs);                         \
+			*link = stage->entry.next;                           \
+			                                                     \
+			break;                                               \
 		}                                                            \
-								             \
-		MTP_FREE(pool->queue);                                       \
 	}                                                                    \
-		                                                             \
-	MTP_FREE(pool);                                                      \
-	pool = NULL;                                                         \
+	                                                                     \
+	pthread_mutex_unlock(&(stage->line->mutex));                         \
+	MTP_FREE(stage);                                                     \
 }                                                                            \
-                                                                             \
-void NAME##WaitOnIdle(struct NAME##ThreadPool *pool)                         \
+	                                                                     \
+/* Feeds a new item into the pipeline at this stage, waiting first for the   \
+ * window if the pipeline has one. Not to be called from inside a stage of   \
+ * the same pipeline, whose window could then never open */                  \
+void NAME##Push(struct NAME##Stage *stage, ElmType in)                       \
 {                                                                            \
-	struct NAME##JobQueue *queue = pool->queue;                          \
-                                                                             \
-	pthread_mutex_lock(&(queue->ring_mutex));                            \
+	size_t seq;                                                          \
 	                                                                     \
-	while (queue->jobs_waiting != 0)                                     \
-	{                                                                    \
-		pthread_cond_wait(&(queue->is_empty), &(queue->ring_mutex)); \
-	}                                                                    \
+	MTP_PIPE_ADMIT(stage->line, seq);                                    \
+	NAME##StagePut(stage, seq, in);                                      \
+}                                                                            \
+	                                                                     \
+/* A ring found full counts as a stall before the caller waits for room */   \
+void NAME##StagePut(struct NAME##Stage *stage, size_t seq, ElmType in)       \
+{                                                                            \
+	struct NAME##PipeJob job;                                            \
 	                                                                     \
-	pthread_mutex_unlock(&(queue->ring_mutex));                          \
-	pthread_mutex_lock(&(queue->work_mutex));                            \
+	job.payload = in;                                                    \
+	job.seq     = seq;                                                   \
+	job.stage   = stage;                                                 \
 	                                                                     \
-	while (queue->jobs_working != 0)                                     \
+	if (NAME##PipeTryEnqueueJob(stage->pool, job) != MTP_SUCCESS)        \
 	{                                                                    \
-		pthread_cond_wait(&(queue->is_idle), &(queue->work_mutex));  \
+		MTP_ATOMIC_ADD(&(stage->stalls), 1, MTP_RELAXED);            \
+		NAME##PipeEnqueueJob(stage->pool, job);                      \
 	}                                                                    \
+}                                                                            \
 	                                                                     \
-	pthread_mutex_unlock(&(queue->work_mutex));                          \
+/* A snapshot taken while items move, queued being what is in flight less    \
+ * what the workers hold */                                                  \
+void NAME##StageStats(struct NAME##Stage *stage,                             \
+	struct mtpStageStats *stats)                                         \
+{                                                                            \
+	struct NAME##PipeJobQueue * const queue = stage->pool->queue;        \
+	size_t inflight = MTP_ATOMIC_LOAD(&(queue->jobs_inflight),           \
+		MTP_RELAXED);                                                \
+	                                                                     \
+	stats->name     = #NAME;                                             \
+	stats->threads  = MTP_LIVE_THREADS(stage->pool);                     \
+	stats->capacity = MTP_DEFAULT_RING(queue)->jobs_max;                 \
+	stats->running  = MTP_ATOMIC_LOAD(&(stage->running), MTP_RELAXED);   \
+	stats->queued   = (inflight > stats->running)                        \
+		? inflight - stats->running : 0;                             \
+	stats->done     = MTP_ATOMIC_LOAD(&(stage->done), MTP_RELAXED);      \
+	stats->stalls   = MTP_ATOMIC_LOAD(&(stage->stalls), MTP_RELAXED);    \
 }                                                                            \
-                                                                             \
-enum {MTP_DEFINITIONS_DUMMY = 0}
+	                                                                     \
+enum {NAME##_MTP_STAGE_DEFINITIONS_DUMMY = 0}
 
 /* ----------------------------- MIND THE GAP ----------------------------- */
 
-#define MACRO_THREAD_POOL_COMPLETE(NAME, TYPE, FUNC) \
-MACRO_THREAD_POOL_PROTOTYPES(NAME, TYPE);            \
-MACRO_THREAD_POOL_DEFINITIONS(NAME, TYPE, FUNC);     \
-enum {MTP_COMPLETE_DUMMY = 0}
+#define MACRO_THREAD_POOL_STAGE_COMPLETE(NAME, TYPE, NEXT, OTYPE, FUNC) \
+MACRO_THREAD_POOL_STAGE_PROTOTYPES(NAME, TYPE, NEXT); \
+MACRO_THREAD_POOL_STAGE_DEFINITIONS(NAME, TYPE, NEXT, OTYPE, FUNC); \
+enum {NAME##_MTP_STAGE_COMPLETE_DUMMY = 0}
 
 #endif /* MACRO_THREAD_POOL_H */
 